@@ -33,6 +33,7 @@
 event = {}
 rtb = {}
 httpcb = {}
+policy = {}
 shorteners = {}
 
 httpcb.handle_report = function(con, status, resp, extras)
@@ -63,6 +64,12 @@ function hasShortener(input)
     return false
 end
 
+--[[ Policy hooks for commands listed in native_commands. They are only called for the conditions listed in
+	native_policy_hooks, "blacklist" or "hellban", and return the result of the command. Without one the message is
+	dropped, as the event handlers below drop it.
+	policy.MSG = function(con, args, condition) return const.FERR_OK end
+--]]
+
 -- Parts a connection from a channel.
 function partChannel(chan, con, is_disconnect)
     local cname = c.getName(chan)
@@ -1112,6 +1119,7 @@ end
 
 -- Sends an RP ad to a channel.
 -- Syntax: LRP <channel> <message>
+-- Only used when native_commands doesn't list it, or for isolated connections. Keep NativeCommand in step.
 event.LRP =
 function(con, args)
     if args.channel == nil or args.message == nil then
@@ -1158,6 +1166,7 @@ end
 
 -- Sends a chat message to a channel.
 -- Syntax: MSG <channel> <message>
+-- Only used when native_commands doesn't list it, or for isolated connections. Keep NativeCommand in step.
 event.MSG =
 function(con, args)
     if args.channel == nil or args.message == nil then
@@ -1227,6 +1236,7 @@ end
 
 -- Sends a private message to another user.
 -- Syntax: PRI <recipient> <message>
+-- Only used when native_commands doesn't list it, or for isolated connections. Keep NativeCommand in step.
 event.PRI =
 function(con, args)
     if args.recipient == nil or args.message == nil then
@@ -1491,7 +1501,7 @@ function(con, args)
     local oldstatus, statusmesg = u.getStatus(target)
     u.setStatus(target, "crown", statusmesg)
 
-    s.broadcast("STA", { character = u.getName(target), status = "crown", statusmsg = statusmesg })
+    s.broadcastPresence("STA", { character = u.getName(target), status = "crown", statusmsg = statusmesg })
     return const.FERR_OK
 end
 
@@ -1635,7 +1645,7 @@ function(con, args)
 
     u.setStatus(con, newstatus, statusmessage)
     s.logMessage("status", con, nil, nil, "Status: " .. newstatus .. " Message: " .. statusmessage)
-    s.broadcast("STA", { character = u.getName(con), status = newstatus, statusmsg = statusmessage })
+    s.broadcastPresence("STA", { character = u.getName(con), status = newstatus, statusmsg = statusmessage })
     return const.FERR_OK
 end
 
@@ -1683,6 +1693,7 @@ end
 
 -- Sends a typing status message to another character.
 -- Syntax: TPN <target> <status>
+-- Only used when native_commands doesn't list it, or for isolated connections. Keep NativeCommand in step.
 event.TPN =
 function(con, args)
     if args.character == nil or args.status == nil then
@@ -1923,7 +1934,7 @@ function(con, args)
     s.sendUserList(con, "LIS", 100)
 
     s.logMessage("connect", con, nil, nil, nil)
-    s.broadcast("NLN", { identity = name, status = "online", gender = u.getGender(con) })
+    s.broadcastPresence("NLN", { identity = name, status = "online", gender = u.getGender(con) })
 
     if isop or issupercop then
         s.addToStaffCallTargets(con)
@@ -1948,7 +1959,7 @@ function(con)
     for i, v in ipairs(channels) do
         partChannel(v, con, true)
     end
-    s.broadcast("FLN", { character = name })
+    s.broadcastPresence("FLN", { character = name })
     s.logMessage("disconnect", con, nil, nil, nil)
     local found, chan = c.getChannel("adh-uberawesomestaffroom")
     if found == true then
@@ -161,6 +161,156 @@ function BlacklistTest()
     testing.assert(false, hasShortener("what is this?"))
 end
 
+-- Runs a command through main.lua and then through NativeCommand, each with clear flood timers, and checks that both
+-- return the expected code.
+function NativeMatches(con, command, args, expected)
+    testing.resetTimers(con)
+    testing.assert(expected, event[command](con, args))
+    testing.resetTimers(con)
+    testing.assert(expected, testing.runNative(con, command, args))
+end
+
+function nativeSetUp()
+    c.createChannel("native")
+    local _, chan = c.getChannel("native")
+    c.join(chan, cons.normal)
+    return chan
+end
+
+function NativeMessageTest()
+    print("Ensuring that the native MSG, LRP, PRI and TPN handlers return what main.lua returns.")
+    local chan = nativeSetUp()
+    local con = cons.normal
+    NativeMatches(con, "MSG", { channel = "native" }, const.FERR_BAD_SYNTAX)
+    NativeMatches(con, "MSG", { channel = "nowhere", message = "hi" }, const.FERR_CHANNEL_NOT_FOUND)
+    NativeMatches(con, "MSG", { channel = "native", message = string.rep("a", const.MSG_MAX + 1) },
+        const.FERR_MESSAGE_TOO_LONG)
+    NativeMatches(cons.cop, "MSG", { channel = "native", message = "hi" }, const.FERR_NOT_IN_CHANNEL)
+    NativeMatches(con, "MSG", { channel = "Native", message = "hi" }, OK)
+    c.setMode(chan, "ads")
+    NativeMatches(con, "MSG", { channel = "native", message = "hi" }, const.FERR_ADS_ONLY)
+    NativeMatches(con, "LRP", { channel = "native", message = "hi" }, OK)
+    c.setMode(chan, "chat")
+    NativeMatches(con, "LRP", { channel = "native", message = "hi" }, const.FERR_CHAT_ONLY)
+    c.setMode(chan, "both")
+    NativeMatches(con, "LRP", { message = "hi" }, const.FERR_BAD_SYNTAX)
+    NativeMatches(con, "LRP", { channel = "native", message = string.rep("a", const.LRP_MAX + 1) },
+        const.FERR_MESSAGE_TOO_LONG)
+    NativeMatches(cons.cop, "LRP", { channel = "native", message = "hi" }, const.FERR_NOT_IN_CHANNEL)
+    NativeMatches(con, "PRI", { recipient = "cop" }, const.FERR_BAD_SYNTAX)
+    NativeMatches(con, "PRI", { recipient = "nobody", message = "hi" }, const.FERR_USER_NOT_FOUND)
+    NativeMatches(con, "PRI", { recipient = "cop", message = string.rep("a", const.PRI_MAX + 1) },
+        const.FERR_MESSAGE_TOO_LONG)
+    NativeMatches(con, "PRI", { recipient = "Cop", message = "hi" }, OK)
+    NativeMatches(con, "TPN", { character = "cop" }, const.FERR_BAD_SYNTAX)
+    NativeMatches(con, "TPN", { character = "cop", status = "typing" }, OK)
+    NativeMatches(con, "TPN", { character = "cop", status = "dancing" }, OK)
+    NativeMatches(con, "TPN", { character = "nobody", status = "typing" }, OK)
+    testing.killChannel("native")
+end
+
+function NativeFloodTest()
+    print("Ensuring that the native handlers share their flood timers with main.lua.")
+    nativeSetUp()
+    local con = cons.normal
+    local args = { channel = "native", message = "hi" }
+    testing.resetTimers(con)
+    testing.assert(OK, event.MSG(con, args))
+    testing.assert(const.FERR_THROTTLE_MESSAGE, testing.runNative(con, "MSG", args))
+    testing.assert(const.FERR_THROTTLE_MESSAGE, testing.runNative(con, "LRP", args))
+    testing.assert(const.FERR_THROTTLE_MESSAGE, testing.runNative(con, "PRI", { recipient = "cop", message = "hi" }))
+    testing.resetTimers(con)
+    testing.assert(OK, testing.runNative(con, "PRI", { recipient = "cop", message = "hi" }))
+    testing.assert(const.FERR_THROTTLE_MESSAGE, event.MSG(con, args))
+    testing.assert(const.FERR_THROTTLE_MESSAGE, event.PRI(con, { recipient = "cop", message = "hi" }))
+    -- The ad timer is kept by the channel, apart from the message timer.
+    testing.resetTimers(con)
+    testing.assert(OK, event.LRP(con, args))
+    testing.resetTimers(con, true)
+    testing.assert(const.FERR_THROTTLE_AD, testing.runNative(con, "LRP", args))
+    testing.resetTimers(con)
+    testing.assert(OK, testing.runNative(con, "LRP", args))
+    testing.resetTimers(con, true)
+    testing.assert(const.FERR_THROTTLE_AD, event.LRP(con, args))
+    testing.killChannel("native")
+end
+
+function NativePolicyTest()
+    print("Ensuring that the native handlers drop blacklisted and hellbanned messages, or pass them to policy hooks.")
+    nativeSetUp()
+    local con = cons.normal
+    local blacklisted = { channel = "native", message = "I think newts are not cute." }
+    local private = { recipient = "cop", message = "I think newts are not cute." }
+    local conditions = {}
+    local hook = function(_, _, condition)
+        table.insert(conditions, condition)
+        return NOT_OP
+    end
+    policy.MSG = hook
+    policy.LRP = hook
+    policy.PRI = hook
+
+    NativeMatches(con, "MSG", blacklisted, OK)
+    NativeMatches(con, "LRP", blacklisted, OK)
+    testing.setPolicyHooks(true, false)
+    NativeMatches(con, "PRI", private, OK)
+    testing.resetTimers(con)
+    testing.assert(NOT_OP, testing.runNative(con, "MSG", blacklisted))
+    testing.resetTimers(con)
+    testing.assert(NOT_OP, testing.runNative(con, "LRP", blacklisted))
+    testing.assert(2, #conditions)
+    testing.assert("blacklist", conditions[2])
+
+    testing.setPolicyHooks(false, false)
+    u.setMiscData(con, "hellban", "yes")
+    NativeMatches(con, "MSG", { channel = "native", message = "hi" }, OK)
+    NativeMatches(con, "LRP", { channel = "native", message = "hi" }, OK)
+    NativeMatches(con, "PRI", { recipient = "cop", message = "hi" }, OK)
+    testing.assert(2, #conditions)
+    testing.setPolicyHooks(false, true)
+    testing.resetTimers(con)
+    testing.assert(NOT_OP, testing.runNative(con, "MSG", { channel = "native", message = "hi" }))
+    testing.resetTimers(con)
+    testing.assert(NOT_OP, testing.runNative(con, "PRI", { recipient = "cop", message = "hi" }))
+    testing.assert(4, #conditions)
+    testing.assert("hellban", conditions[4])
+
+    testing.setPolicyHooks(false, false)
+    policy.MSG = nil
+    policy.LRP = nil
+    policy.PRI = nil
+    testing.killChannel("native")
+end
+
+function PresenceOrderTest()
+    print("Ensuring that a character's NLN is sent before anything they send.")
+    testing.setPresenceTick(60)
+    local watcher = testing.createConnection("watcher", true)
+    local chan = nativeSetUp()
+    c.join(chan, watcher)
+    testing.takeSent(watcher)
+
+    s.broadcastPresence("NLN", { identity = "normal", status = "online", gender = "None" })
+    testing.resetTimers(cons.normal)
+    testing.assert(OK, testing.runNative(cons.normal, "MSG", { channel = "native", message = "hi" }))
+    local sent = testing.takeSent(watcher)
+    testing.assert(2, #sent)
+    testing.assert("NLN", sent[1])
+    testing.assert("MSG", sent[2])
+
+    -- Coming back within the tick only shows up as a status change when the tick ends.
+    s.broadcastPresence("FLN", { character = "normal" })
+    s.broadcastPresence("NLN", { identity = "normal", status = "online", gender = "None" })
+    testing.assert(0, #testing.takeSent(watcher))
+    testing.setPresenceTick(0)
+    sent = testing.takeSent(watcher)
+    testing.assert(1, #sent)
+    testing.assert("STA", sent[1])
+
+    testing.removeConnection("watcher")
+    testing.killChannel("native")
+end
+
 tests = {
     CBUTest,
     CKUTest,
@@ -170,7 +320,11 @@ tests = {
     CSOTest,
     RMOTest,
     RSTTest,
-    BlacklistTest
+    BlacklistTest,
+    NativeMessageTest,
+    NativeFloodTest,
+    NativePolicyTest,
+    PresenceOrderTest
 }
 
 function runTests()
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "precompiled_headers.hpp"
+
+#include "admission.hpp"
+#include "logging.hpp"
+#include "server.hpp"
+#include "startup_config.hpp"
+
+// How often address buckets that have refilled completely are thrown away, in seconds.
+#define ADMISSION_PRUNE_INTERVAL 60.
+
+pthread_mutex_t Admission::mutex = PTHREAD_MUTEX_INITIALIZER;
+TokenBucket Admission::global = {0, 0};
+std::tr1::unordered_map<uint32_t, TokenBucket> Admission::addresses;
+double Admission::lastPrune = 0;
+
+double Admission::globalRate = 0;
+double Admission::globalBurst = 0;
+double Admission::addressRate = 0;
+double Admission::addressBurst = 0;
+
+std::atomic<unsigned long long> Admission::statAccepted(0);
+std::atomic<unsigned long long> Admission::statDeferred(0);
+std::atomic<unsigned long long> Admission::statRejected(0);
+std::atomic<unsigned long long> Admission::statDropped(0);
+
+void Admission::configure() {
+    MUT_LOCK(mutex);
+    globalRate = StartupConfig::getDouble("admission_rate");
+    globalBurst = StartupConfig::getDouble("admission_burst");
+    addressRate = StartupConfig::getDouble("admission_ip_rate");
+    addressBurst = StartupConfig::getDouble("admission_ip_burst");
+    global.tokens = globalBurst;
+    global.updated = 0;
+    addresses.clear();
+    MUT_UNLOCK(mutex);
+    if (globalRate <= 0 || globalBurst < 1)
+        LOG(INFO) << "Not limiting the rate of new connections.";
+    else
+        LOG(INFO) << "Admitting " << globalRate << " connections per second with bursts of " << globalBurst << ".";
+    if (addressRate <= 0 || addressBurst < 1)
+        LOG(INFO) << "Not limiting the rate of new connections per address.";
+    else
+        LOG(INFO) << "Admitting " << addressRate << " connections per second per address with bursts of "
+                  << addressBurst << ".";
+}
+
+void Admission::refill(TokenBucket& bucket, double now, double rate, double burst) {
+    if (bucket.updated && now > bucket.updated) {
+        bucket.tokens += (now - bucket.updated) * rate;
+        if (bucket.tokens > burst)
+            bucket.tokens = burst;
+    }
+    bucket.updated = now;
+}
+
+bool Admission::acquire(double now, double& wait) {
+    MUT_LOCK(mutex);
+    if (globalRate <= 0 || globalBurst < 1) {
+        MUT_UNLOCK(mutex);
+        return true;
+    }
+    refill(global, now, globalRate, globalBurst);
+    bool acquired = global.tokens >= 1.;
+    if (acquired)
+        global.tokens -= 1.;
+    else
+        wait = globalRate > 0 ? (1. - global.tokens) / globalRate : 1.;
+    MUT_UNLOCK(mutex);
+    return acquired;
+}
+
+void Admission::release() {
+    MUT_LOCK(mutex);
+    global.tokens += 1.;
+    if (global.tokens > globalBurst)
+        global.tokens = globalBurst;
+    MUT_UNLOCK(mutex);
+}
+
+AdmissionResult Admission::admit(uint32_t address, double now) {
+    if (Server::isValidLB(address)) {
+        ++statAccepted;
+        return ADMISSION_ACCEPT;
+    }
+
+    MUT_LOCK(mutex);
+    if (addressRate <= 0 || addressBurst < 1) {
+        MUT_UNLOCK(mutex);
+        ++statAccepted;
+        return ADMISSION_ACCEPT;
+    }
+    if (now - lastPrune > ADMISSION_PRUNE_INTERVAL)
+        prune(now);
+    TokenBucket& bucket = addresses[address];
+    if (!bucket.updated)
+        bucket.tokens = addressBurst;
+    refill(bucket, now, addressRate, addressBurst);
+    bool admitted = bucket.tokens >= 1.;
+    if (admitted) {
+        bucket.tokens -= 1.;
+    } else {
+        // Otherwise a single address reconnecting in a loop would use up the global bucket for everyone else.
+        global.tokens += 1.;
+        if (global.tokens > globalBurst)
+            global.tokens = globalBurst;
+    }
+    MUT_UNLOCK(mutex);
+
+    if (!admitted) {
+        ++statRejected;
+        return ADMISSION_REJECT;
+    }
+    ++statAccepted;
+    return ADMISSION_ACCEPT;
+}
+
+// Must be called with the mutex held.
+void Admission::prune(double now) {
+    lastPrune = now;
+    for (auto i = addresses.begin(); i != addresses.end();) {
+        refill(i->second, now, addressRate, addressBurst);
+        if (i->second.tokens >= addressBurst)
+            i = addresses.erase(i);
+        else
+            ++i;
+    }
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FSERV_ADMISSION_H
+#define FSERV_ADMISSION_H
+
+#include <stdint.h>
+#include <atomic>
+#include <tr1/unordered_map>
+#include "fthread.hpp"
+
+enum AdmissionResult {
+    ADMISSION_ACCEPT,
+    ADMISSION_REJECT // Close the connection. Its address has used up its tokens.
+};
+
+struct TokenBucket {
+    double tokens;
+    double updated;
+};
+
+/**
+ * Admission control for new connections, applied at the listener before a ConnectionInstance is allocated.
+ *
+ * A global token bucket limits how fast connections are taken from the listen backlog, so that a reconnect storm
+ * after a restart is spread out instead of landing on Lua all at once. A second bucket per remote address rejects
+ * addresses that reconnect faster than any client should. Load balancer addresses are only subject to the global
+ * bucket, as every connection through them shares their address.
+ *
+ * A bucket whose rate or burst is 0, as in a config from before these keys existed, is off.
+ *
+ * Listeners in reactor threads share these buckets, so they are protected by a mutex.
+ */
+class Admission {
+public:
+    static void configure();
+
+    // Takes a token from the global bucket. If there is none, wait is set to the seconds until the next one.
+    static bool acquire(double now, double& wait);
+    // Returns a token taken by acquire that wasn't used, because the backlog turned out to be empty.
+    static void release();
+    // Called after a successful acquire. A rejected connection gives its global token back.
+    static AdmissionResult admit(uint32_t address, double now);
+
+    static void countDeferred() {
+        ++statDeferred;
+    }
+
+    // The io_uring backend can't leave connections in the backlog, so it closes them when the global bucket is empty.
+    static void countDropped() {
+        ++statDropped;
+    }
+
+    static unsigned long long getAccepted() {
+        return statAccepted;
+    }
+
+    static unsigned long long getDeferred() {
+        return statDeferred;
+    }
+
+    static unsigned long long getRejected() {
+        return statRejected;
+    }
+
+    static unsigned long long getDropped() {
+        return statDropped;
+    }
+private:
+
+    Admission() { }
+
+    ~Admission() { }
+
+    static void refill(TokenBucket& bucket, double now, double rate, double burst);
+    static void prune(double now);
+
+    static pthread_mutex_t mutex;
+    static TokenBucket global;
+    static std::tr1::unordered_map<uint32_t, TokenBucket> addresses;
+    static double lastPrune;
+
+    static double globalRate;
+    static double globalBurst;
+    static double addressRate;
+    static double addressBurst;
+
+    static std::atomic<unsigned long long> statAccepted;
+    static std::atomic<unsigned long long> statDeferred;
+    static std::atomic<unsigned long long> statRejected;
+    static std::atomic<unsigned long long> statDropped;
+};
+
+#endif //FSERV_ADMISSION_H
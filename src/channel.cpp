@@ -25,6 +25,7 @@
 
 #include "precompiled_headers.hpp"
 #include "channel.hpp"
+#include "channel_directory.hpp"
 #include "logging.hpp"
 
 #include <ctime>
@@ -43,6 +44,8 @@ lastActivity(0),
 canDestroy(true),
 title(""),
 topUsers(0),
+listedAs(CT_MAX),
+listedSlot(0),
 refCount(0) {
     if (chantype == CT_PRIVATE) {
         description = privChanDescriptionDefault;
@@ -61,6 +64,8 @@ lastActivity(0),
 canDestroy(true),
 title(""),
 topUsers(0),
+listedAs(CT_MAX),
+listedSlot(0),
 refCount(0) {
     invites.insert(creator->characterNameLower);
     owner = creator->characterName;
@@ -68,41 +73,77 @@ refCount(0) {
 }
 
 Channel::~Channel() {
-    assert(participants.size() == 0);
+    assert(members.size() == 0);
     assert(participantCount == 0);
 }
 
 void Channel::sendToAll(string& message) {
     MessagePtr outMessage(MessageBuffer::fromString(message));
-    for (chconlist_t::iterator i = participants.begin(); i != participants.end(); ++i) {
-        (*i)->send(outMessage);
+    sendToAll(outMessage);
+}
+
+void Channel::sendToAll(MessagePtr message) {
+    for (chmemberlist_t::const_iterator i = members.begin(); i != members.end(); ++i) {
+        i->connection->send(message);
     }
 }
 
 void Channel::sendToChannel(ConnectionPtr src, string& message) {
     MessagePtr outMessage(MessageBuffer::fromString(message));
-    for (chconlist_t::iterator i = participants.begin(); i != participants.end(); ++i) {
-        ConnectionPtr p = *i;
-        if (p != src)
-            p->send(outMessage);
+    sendToChannel(src, outMessage);
+}
+
+void Channel::sendToChannel(ConnectionPtr src, MessagePtr message) {
+    ConnectionInstance* source = src.get();
+    for (chmemberlist_t::const_iterator i = members.begin(); i != members.end(); ++i) {
+        if (i->connection != source)
+            i->connection->send(message);
     }
 }
 
 void Channel::join(ConnectionPtr con) {
+    if (inChannel(con))
+        return;
     lastActivity = time(nullptr);
-    ++participantCount;
-    participants.insert(con);
-    con->joinChannel(this);
+    ChannelMember member = {con.get(), con->channelList.size()};
+    ChannelMembership membership = {ChannelPtr(this), members.size()};
+    members.push_back(member);
+    con->channelIndex[this] = con->channelList.size();
+    con->channelList.push_back(membership);
+    intrusive_ptr_add_ref(con.get());
+    participantCount = members.size();
     if (participantCount > topUsers)
         topUsers = participantCount;
+    ChannelDirectory::changed(this);
 }
 
 void Channel::part(ConnectionPtr con) {
+    size_t index = con->findChannel(this);
+    if (index == con->channelList.size())
+        return;
     lastActivity = time(nullptr);
-    --participantCount;
     timerMap.erase(con->characterNameLower);
-    participants.erase(con);
-    con->leaveChannel(this);
+
+    // Swap the last member into the leaving member's slot.
+    size_t slot = con->channelList[index].slot;
+    ChannelMember moved = members.back();
+    members[slot] = moved;
+    moved.connection->channelList[moved.index].slot = slot;
+    members.pop_back();
+    participantCount = members.size();
+
+    // And the connection's last channel into this channel's place in its list.
+    size_t last = con->channelList.size() - 1;
+    if (index != last) {
+        con->channelList[index] = con->channelList[last];
+        const ChannelMembership& membership = con->channelList[index];
+        membership.channel->members[membership.slot].index = index;
+        con->channelIndex[membership.channel.get()] = index;
+    }
+    con->channelList.pop_back();
+    con->channelIndex.erase(this);
+    intrusive_ptr_release(con.get());
+    ChannelDirectory::changed(this);
 }
 
 void Channel::kick(ConnectionPtr dest) {
@@ -146,12 +187,7 @@ void Channel::unban(string& dest) {
 }
 
 bool Channel::inChannel(ConnectionPtr con) {
-    for (chconlist_t::iterator i = participants.begin(); i != participants.end(); ++i) {
-        if (con == (*i))
-            return true;
-    }
-
-    return false;
+    return con->findChannel(this) != con->channelList.size();
 }
 
 bool Channel::isBanned(ConnectionPtr con) {
@@ -298,6 +334,17 @@ void Channel::setPublic(bool newstatus) {
         type = CT_PUBPRIVATE;
     else
         type = CT_PRIVATE;
+    ChannelDirectory::changed(this);
+}
+
+void Channel::setMode(ChannelMessageMode newmode) {
+    chatMode = newmode;
+    ChannelDirectory::changed(this);
+}
+
+void Channel::setTitle(string newtitle) {
+    title = newtitle;
+    ChannelDirectory::changed(this);
 }
 
 json_t* Channel::saveChannel() {
@@ -316,7 +363,7 @@ json_t* Channel::saveChannel() {
             json_string_nocheck(owner.c_str())
             );
     json_object_set_new_nocheck(ret, "users",
-            json_integer(participants.size())
+            json_integer(members.size())
             );
     json_object_set_new_nocheck(ret, "title",
             json_string_nocheck(title.c_str())
@@ -66,7 +66,18 @@ typedef struct {
     time_t timeout;
 } BanRecord;
 
-typedef unordered_set<ConnectionPtr, boost::hash<ConnectionPtr> > chconlist_t;
+// A connection in the channel, and the index of the channel in the connection's channelList.
+struct ChannelMember {
+    ConnectionInstance* connection;
+    size_t index;
+};
+
+/*
+ * The members of a channel, in no particular order. Each member and its ChannelMembership point at each other, so that
+ * leaving swaps the last member into the hole in constant time. The channel holds one reference to each member for as
+ * long as it is in the channel, so walking the list needs no reference counting.
+ */
+typedef vector<ChannelMember> chmemberlist_t;
 typedef unordered_set<string> chstringset_t;
 typedef unordered_map<string, BanRecord> chbanmap_t;
 typedef unordered_map<string, ModRecord> chmodmap_t;
@@ -80,6 +91,8 @@ public:
 
     void sendToAll(string& message); //Sends to everyone, including source.
     void sendToChannel(ConnectionPtr src, string& message); //Sends to everyone, excluding source.
+    void sendToAll(MessagePtr message);
+    void sendToChannel(ConnectionPtr src, MessagePtr message);
 
     void join(ConnectionPtr con);
     void part(ConnectionPtr con);
@@ -151,20 +164,23 @@ public:
         return modeToString();
     }
 
-    void setMode(ChannelMessageMode newmode) {
-        chatMode = newmode;
+    const ChannelMessageMode getMode() const {
+        return chatMode;
     }
 
+    void setMode(ChannelMessageMode newmode);
+
     const int getParticipantCount() const {
         return participantCount;
     }
 
     void updateParticipantCount() {
-        participantCount = participants.size();
+        participantCount = members.size();
     }
 
-    const chconlist_t& getParticipants() const {
-        return participants;
+    // Joining or leaving changes the order of the list, so loops that do either must walk a copy.
+    const chmemberlist_t& getMembers() const {
+        return members;
     }
 
     const time_t getLastActivity() const {
@@ -189,9 +205,7 @@ public:
         return title;
     }
 
-    void setTitle(string newtitle) {
-        title = newtitle;
-    }
+    void setTitle(string newtitle);
 
     const int getTopUserCount() const {
         return topUsers;
@@ -209,7 +223,7 @@ protected:
     string description;
     ChannelType type;
     ChannelMessageMode chatMode;
-    chconlist_t participants;
+    chmemberlist_t members;
     chmodmap_t moderators;
     string owner;
     chbanmap_t bans;
@@ -222,6 +236,10 @@ protected:
     chstringset_t invites;
     int topUsers;
 
+    // Maintained by ChannelDirectory. CT_MAX when the channel isn't in the directory.
+    ChannelType listedAs;
+    size_t listedSlot;
+
     int refCount;
 
     friend inline void intrusive_ptr_release(Channel* p)
@@ -232,6 +250,7 @@ protected:
     }
     friend inline void intrusive_ptr_add_ref(Channel* p) { __sync_fetch_and_add(&p->refCount, 1); }
 private:
+    friend class ChannelDirectory;
     static string privChanDescriptionDefault;
 };
 
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "precompiled_headers.hpp"
+
+#include "channel_directory.hpp"
+#include "logging.hpp"
+#include "server.hpp"
+#include "startup_config.hpp"
+
+ChannelDirectory::Listing ChannelDirectory::listings[CT_MAX];
+double ChannelDirectory::refreshInterval = 0;
+
+void ChannelDirectory::configure() {
+    refreshInterval = StartupConfig::getDouble("channel_list_interval");
+}
+
+void ChannelDirectory::add(Channel* channel) {
+    if (channel->listedAs != CT_MAX)
+        return;
+    Listing& listing = listings[channel->getType()];
+    DirectoryEntry entry = {channel, string(), true};
+    channel->listedAs = channel->getType();
+    channel->listedSlot = listing.entries.size();
+    listing.entries.push_back(entry);
+    listing.dirty = true;
+}
+
+void ChannelDirectory::remove(Channel* channel) {
+    if (channel->listedAs == CT_MAX)
+        return;
+    Listing& listing = listings[channel->listedAs];
+    size_t slot = channel->listedSlot;
+    if (slot != listing.entries.size() - 1) {
+        std::swap(listing.entries[slot], listing.entries.back());
+        listing.entries[slot].channel->listedSlot = slot;
+    }
+    listing.entries.pop_back();
+    listing.dirty = true;
+    channel->listedAs = CT_MAX;
+}
+
+void ChannelDirectory::changed(Channel* channel) {
+    if (channel->listedAs == CT_MAX)
+        return;
+    if (channel->listedAs != channel->getType()) {
+        remove(channel);
+        add(channel);
+        return;
+    }
+    Listing& listing = listings[channel->listedAs];
+    listing.entries[channel->listedSlot].dirty = true;
+    listing.dirty = true;
+}
+
+void ChannelDirectory::serialize(DirectoryEntry& entry, ChannelType type) {
+    Channel* channel = entry.channel;
+    json_t* channode = json_object();
+    json_object_set_new_nocheck(channode, "name", json_string_nocheck(channel->getName().c_str()));
+    if (type == CT_PUBLIC) {
+        json_object_set_new_nocheck(channode, "mode", json_string_nocheck(channel->getModeString().c_str()));
+    } else {
+        json_t* titlenode = json_string(channel->getTitle().c_str());
+        if (!titlenode)
+            titlenode = json_string("This channel had an invalid title. This is a safe default.");
+        json_object_set_new_nocheck(channode, "title", titlenode);
+    }
+    json_object_set_new_nocheck(channode, "characters", json_integer(channel->getParticipantCount()));
+    char* json = json_dumps(channode, JSON_COMPACT);
+    entry.json = json;
+    free(json);
+    json_decref(channode);
+    entry.dirty = false;
+}
+
+MessagePtr ChannelDirectory::getList(ChannelType type) {
+    Listing& listing = listings[type];
+    double now = Server::getEventTime();
+    if (listing.message && (!listing.dirty || now < listing.built + refreshInterval))
+        return listing.message;
+
+    string message(type == CT_PUBLIC ? "CHA" : "ORS");
+    message.append(" {\"channels\":[");
+    for (vector<DirectoryEntry>::iterator i = listing.entries.begin(); i != listing.entries.end(); ++i) {
+        if (i->dirty)
+            serialize(*i, type);
+        if (i != listing.entries.begin())
+            message.push_back(',');
+        message.append(i->json);
+    }
+    message.append("]}");
+    listing.message = MessageBuffer::fromString(message);
+    listing.dirty = false;
+    listing.built = now;
+    return listing.message;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FSERV_CHANNEL_DIRECTORY_H
+#define FSERV_CHANNEL_DIRECTORY_H
+
+#include <string>
+#include <vector>
+#include "channel.hpp"
+#include "messagebuffer.hpp"
+
+using std::string;
+using std::vector;
+
+struct DirectoryEntry {
+    Channel* channel;
+    string json; // The channel's object in the list, as of the last time it was clean.
+    bool dirty;
+};
+
+/**
+ * The CHA and ORS channel lists.
+ *
+ * Every channel in ServerState has an entry in the listing for its type, which is marked dirty when the channel is
+ * joined, parted, retitled, has its mode changed or changes type. A list is only put together again when it is asked
+ * for and has changed, and then only its dirty entries are serialized again. channel_list_interval is the least time
+ * between two rebuilds of the same list; until it passes, the last list is sent even if it is out of date.
+ */
+class ChannelDirectory {
+public:
+    static void configure();
+
+    static void add(Channel* channel);
+    static void remove(Channel* channel);
+    static void changed(Channel* channel);
+
+    // CHA for CT_PUBLIC, ORS for CT_PUBPRIVATE.
+    static MessagePtr getList(ChannelType type);
+private:
+
+    ChannelDirectory() { }
+
+    ~ChannelDirectory() { }
+
+    struct Listing {
+        vector<DirectoryEntry> entries;
+        MessagePtr message;
+        bool dirty;
+        double built;
+    };
+
+    static void serialize(DirectoryEntry& entry, ChannelType type);
+
+    static Listing listings[CT_MAX];
+    static double refreshInterval;
+};
+
+#endif //FSERV_CHANNEL_DIRECTORY_H
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "precompiled_headers.hpp"
+
+#include "command_table.hpp"
+
+// Picked so that no two commands share a slot. The static_assert below says when a new command needs a new one.
+#define COMMAND_HASH_MULTIPLIER 0xc78cf0afu
+#define COMMAND_HASH_BITS 7
+#define COMMAND_HASH_SLOTS (1 << COMMAND_HASH_BITS)
+
+static constexpr char commandNames[CMD_COUNT][4] = {
+    "PIN", "IDN", "FKS", "ZZZ", "VAR", "ACB", "AOP", "AWC", "BRO", "CBL", "CBU", "CCR", "CDS", "CHA", "CIU", "CKU",
+    "COA", "COL", "COR", "CRC", "CSO", "CTU", "CUB", "DOP", "FRL", "IGN", "JCH", "KIC", "KIK", "KIN", "LCH", "LRP",
+    "MSG", "ORS", "PCR", "PRI", "PRO", "RLD", "RLL", "RMO", "RST", "RWD", "SCP", "SFC", "STA", "TMO", "TPN", "UNB",
+    "UPT"
+};
+
+static constexpr uint32_t packName(int i) {
+    return static_cast<uint8_t> (commandNames[i][0]) | static_cast<uint8_t> (commandNames[i][1]) << 8 |
+        static_cast<uint8_t> (commandNames[i][2]) << 16;
+}
+
+static constexpr uint32_t slotOf(uint32_t packed) {
+    return (packed * COMMAND_HASH_MULTIPLIER) >> (32 - COMMAND_HASH_BITS);
+}
+
+static constexpr bool distinctFrom(int i, int j) {
+    return j >= CMD_COUNT || (slotOf(packName(i)) != slotOf(packName(j)) && distinctFrom(i, j + 1));
+}
+
+static constexpr bool perfect(int i) {
+    return i >= CMD_COUNT || (distinctFrom(i, i + 1) && perfect(i + 1));
+}
+
+static_assert(perfect(0), "Two commands hash to the same slot. Change COMMAND_HASH_MULTIPLIER.");
+
+/*
+ * Slot to CommandId, built once at startup from the names above.
+ */
+struct CommandSlots {
+    uint32_t packed[COMMAND_HASH_SLOTS];
+    int8_t id[COMMAND_HASH_SLOTS];
+
+    CommandSlots() {
+        for (int i = 0; i < COMMAND_HASH_SLOTS; ++i) {
+            packed[i] = 0;
+            id[i] = CMD_UNKNOWN;
+        }
+        for (int i = 0; i < CMD_COUNT; ++i) {
+            packed[slotOf(packName(i))] = packName(i);
+            id[slotOf(packName(i))] = i;
+        }
+    }
+};
+
+static const CommandSlots commandSlots;
+
+CommandId CommandTable::find(const char* command, size_t length) {
+    if (length != 3)
+        return CMD_UNKNOWN;
+    uint32_t packed = pack(command);
+    uint32_t slot = slotOf(packed);
+    if (commandSlots.packed[slot] != packed)
+        return CMD_UNKNOWN;
+    return static_cast<CommandId> (commandSlots.id[slot]);
+}
+
+const char* CommandTable::name(CommandId id) {
+    return id >= 0 && id < CMD_COUNT ? commandNames[id] : "";
+}
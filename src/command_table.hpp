@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FSERV_COMMAND_TABLE_H
+#define FSERV_COMMAND_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every client command the server or main.lua handles. Must stay in the same order as the names in command_table.cpp.
+enum CommandId {
+    CMD_UNKNOWN = -1,
+    CMD_PIN,
+    CMD_IDN,
+    CMD_FKS,
+    CMD_ZZZ,
+    CMD_VAR,
+    CMD_ACB,
+    CMD_AOP,
+    CMD_AWC,
+    CMD_BRO,
+    CMD_CBL,
+    CMD_CBU,
+    CMD_CCR,
+    CMD_CDS,
+    CMD_CHA,
+    CMD_CIU,
+    CMD_CKU,
+    CMD_COA,
+    CMD_COL,
+    CMD_COR,
+    CMD_CRC,
+    CMD_CSO,
+    CMD_CTU,
+    CMD_CUB,
+    CMD_DOP,
+    CMD_FRL,
+    CMD_IGN,
+    CMD_JCH,
+    CMD_KIC,
+    CMD_KIK,
+    CMD_KIN,
+    CMD_LCH,
+    CMD_LRP,
+    CMD_MSG,
+    CMD_ORS,
+    CMD_PCR,
+    CMD_PRI,
+    CMD_PRO,
+    CMD_RLD,
+    CMD_RLL,
+    CMD_RMO,
+    CMD_RST,
+    CMD_RWD,
+    CMD_SCP,
+    CMD_SFC,
+    CMD_STA,
+    CMD_TMO,
+    CMD_TPN,
+    CMD_UNB,
+    CMD_UPT,
+    CMD_COUNT
+};
+
+/**
+ * Maps three letter commands to a CommandId without comparing strings. The letters are packed into an integer and
+ * looked up in a perfect hash table, which is checked for collisions when it is compiled.
+ */
+class CommandTable {
+public:
+    static CommandId find(const char* command, size_t length);
+    static const char* name(CommandId id);
+
+    static uint32_t pack(const char* command) {
+        return static_cast<uint8_t> (command[0]) | static_cast<uint8_t> (command[1]) << 8 |
+            static_cast<uint8_t> (command[2]) << 16;
+    }
+private:
+
+    CommandTable() { }
+
+    ~CommandTable() { }
+};
+
+#endif //FSERV_COMMAND_TABLE_H
@@ -33,11 +33,59 @@
 #include "server.hpp"
 #include "lua_constants.hpp"
 #include "channel.hpp"
+#include "reactor.hpp"
+#include "websocket_deflate.hpp"
+#include "uring.hpp"
+#include "fthread.hpp"
+#include "startup_config.hpp"
+#include "tls.hpp"
 
-#define MAX_SEND_QUEUE_ITEMS 150
-// This sets the size at which long messages are split into multiple pieces.
-// No more than this amount will ever be sent to a single send() call at once.
-#define MAX_SEND_QUEUE_ITEM_SIZE 8192
+// Connections are allocated this many at a time. Slabs are kept for the life of the process.
+#define CONNECTION_SLAB_SIZE 256
+
+size_t ConnectionInstance::sendQueueLow = 0;
+size_t ConnectionInstance::sendQueueHigh = 0;
+size_t ConnectionInstance::sendQueueMax = 0;
+double ConnectionInstance::sendQueueStall = 0;
+size_t ConnectionInstance::fragmentSize = 0;
+size_t ConnectionInstance::sendQueueGlobalMax = 0;
+
+std::atomic<unsigned long long> ConnectionInstance::statQueuedBytes(0);
+std::atomic<unsigned long long> ConnectionInstance::statSuperseded(0);
+std::atomic<unsigned long long> ConnectionInstance::statSlowConsumers(0);
+
+// Free connection slots, linked through their first word.
+static void* connectionFreeList = 0;
+static pthread_mutex_t connectionPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void* ConnectionInstance::operator new(size_t size) {
+    if (size != sizeof(ConnectionInstance))
+        return ::operator new(size);
+
+    MUT_LOCK(connectionPoolMutex);
+    if (!connectionFreeList) {
+        char* slab = static_cast<char*> (::operator new(sizeof(ConnectionInstance) * CONNECTION_SLAB_SIZE));
+        for (int i = CONNECTION_SLAB_SIZE - 1; i >= 0; --i) {
+            void* slot = slab + i * sizeof(ConnectionInstance);
+            *static_cast<void**> (slot) = connectionFreeList;
+            connectionFreeList = slot;
+        }
+    }
+    void* p = connectionFreeList;
+    connectionFreeList = *static_cast<void**> (p);
+    MUT_UNLOCK(connectionPoolMutex);
+    return p;
+}
+
+void ConnectionInstance::operator delete(void* p) {
+    if (!p)
+        return;
+
+    MUT_LOCK(connectionPoolMutex);
+    *static_cast<void**> (p) = connectionFreeList;
+    connectionFreeList = p;
+    MUT_UNLOCK(connectionPoolMutex);
+}
 
 ConnectionInstance::ConnectionInstance()
 :
@@ -48,19 +96,44 @@ authStarted(false),
 identified(false),
 admin(false),
 globalModerator(false),
+batchPresence(false),
+presenceListed(0),
 protocol(PROTOCOL_UNKNOWN),
 closed(false),
 delayClose(false),
 status("online"),
 gender("None"),
+userListSlot(0),
+handshakeScanned(0),
+inflater(0),
 writePosition(0),
+queuedBytes(0),
+congested(false),
+congestedSince(0),
+statWriteCalls(0),
+statWriteFrames(0),
 loop(0),
-pingEvent(0),
-timerEvent(0),
-readEvent(0),
-writeEvent(0),
+reactor(0),
+uring(0),
+uringState(0),
+flushQueued(false),
+ssl(0),
+tlsReady(false),
+tlsKernelSend(false),
+tlsKernelReceive(false),
+lastActivity(0),
+wheel(0),
+wheelDeadline(0),
+pingEnabled(false),
+nextPing(0),
+closeAt(0),
 debugL(0),
+debugHandlers(0),
 refCount(0) {
+    // Inactive until acceptConnection sets them up, but always safe to stop.
+    ev_init(&timerEvent, 0);
+    ev_init(&readEvent, 0);
+    ev_init(&writeEvent, 0);
 }
 
 ConnectionInstance::~ConnectionInstance() {
@@ -70,32 +143,177 @@ ConnectionInstance::~ConnectionInstance() {
     if (debugL) {
         lua_close(debugL);
     }
+    delete debugHandlers;
+    delete inflater;
+    delete uringState;
+    if (ssl)
+        TLS::release(ssl);
+    statQueuedBytes -= queuedBytes;
+}
+
+/*
+ * Any of these left at 0, as in a config from before they existed, turns that limit off. Without send_queue_high a
+ * connection is never congested, so the stall and global limits can't apply either.
+ */
+void ConnectionInstance::configureSendQueue() {
+    sendQueueLow = static_cast<size_t> (StartupConfig::getDouble("send_queue_low"));
+    sendQueueHigh = static_cast<size_t> (StartupConfig::getDouble("send_queue_high"));
+    sendQueueMax = static_cast<size_t> (StartupConfig::getDouble("send_queue_max"));
+    sendQueueStall = StartupConfig::getDouble("send_queue_stall");
+    sendQueueGlobalMax = static_cast<size_t> (StartupConfig::getDouble("send_queue_global_max"));
+    fragmentSize = static_cast<size_t> (StartupConfig::getDouble("fragment_size"));
 }
 
 bool ConnectionInstance::send(MessagePtr message) {
-    if (closed || writeQueue.size() > MAX_SEND_QUEUE_ITEMS)
+    if (closed)
+        return false;
+
+    if (inflater && message->length() >= Websocket::Deflate::threshold())
+        message = message->deflated();
+
+    if (reactor && !reactor->isCurrent()) {
+        reactor->addCommand(RCMD_SEND, this, message);
+        return true;
+    }
+
+    // Already being closed for falling behind.
+    if (congested && delayClose)
         return false;
 
-    writeQueue.push_back(message);
-    ev_io_start(loop, writeEvent);
+    // A connection that is behind only needs the newest of a run of superseding frames.
+    if (congested && message->supersedeKey() && supersede(message))
+        return true;
+
+    if (sendQueueMax && queuedBytes + message->length() > sendQueueMax) {
+        dropSlowConsumer("exceeded the send queue limit");
+        return false;
+    } else if (congested && sendQueueGlobalMax && statQueuedBytes > sendQueueGlobalMax) {
+        dropSlowConsumer("was behind while outbound memory is over its limit");
+        return false;
+    }
+
+    queueMessage(message);
+    if (!congested && sendQueueHigh && queuedBytes > sendQueueHigh) {
+        congested = true;
+        congestedSince = ev_now(loop);
+        // Gives the wheel a deadline for sendQueueStall.
+        Server::scheduleConnection(this);
+    }
     return true;
 }
 
+/*
+ * Replaces the queued frame that has the same supersede key with the new one, moving it to the back of the queue so
+ * that it stays in order with everything else sent after it. Frames that are being written are left alone.
+ */
+bool ConnectionInstance::supersede(MessagePtr& message) {
+    for (auto i = writeQueue.begin() + pinnedFrames(); i != writeQueue.end(); ++i) {
+        if ((*i)->supersedeKey() != message->supersedeKey())
+            continue;
+        queuedBytes -= (*i)->length();
+        statQueuedBytes -= (*i)->length();
+        writeQueue.erase(i);
+        queueMessage(message);
+        ++statSuperseded;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Closing from here could run Lua in the middle of whatever is sending, so the connection is closed from the timing
+ * wheel instead. Nothing else is queued for it in the meantime, and frames that aren't being written are released
+ * straight away.
+ */
+void ConnectionInstance::dropSlowConsumer(const char* reason) {
+    LOG(WARNING) << "Connection " << inet_ntoa(clientAddress.sin_addr) << ":" << ntohs(clientAddress.sin_port)
+                 << " " << reason << " with " << (queuedBytes / 1024) << "kB queued and is being closed.";
+    ++statSlowConsumers;
+    congested = true;
+
+    while (writeQueue.size() > pinnedFrames()) {
+        queuedBytes -= writeQueue.back()->length();
+        statQueuedBytes -= writeQueue.back()->length();
+        writeQueue.pop_back();
+    }
+
+    delayClose = true;
+    closeAt = ev_now(loop);
+    ev_io_stop(loop, &readEvent);
+    Server::scheduleConnection(this);
+}
+
+void ConnectionInstance::popWriteQueue() {
+    size_t length = writeQueue.front()->length();
+    writeQueue.pop_front();
+    writePosition = 0;
+    queuedBytes -= length;
+    statQueuedBytes -= length;
+    if (congested && queuedBytes <= sendQueueLow)
+        congested = false;
+}
+
 bool ConnectionInstance::sendRaw(string& message) {
     if (closed)
         return false;
 
-    MessageBuffer* buffer = new MessageBuffer();
-    MessagePtr outMessage(buffer);
-    buffer->set(message.data(), message.length());
+    MessagePtr outMessage(MessageBuffer::fromRaw(message.data(), message.length()));
+
+    if (reactor && !reactor->isCurrent()) {
+        reactor->addCommand(RCMD_SEND_RAW, this, outMessage);
+        return true;
+    }
 
-    writeQueue.push_back(outMessage);
-    ev_io_start(loop, writeEvent);
+    queueMessage(outMessage);
     return true;
 }
 
+/*
+ * Frames at the front of the queue that are being written, and so can't be moved or released.
+ */
+size_t ConnectionInstance::pinnedFrames() const {
+    if (uringState && uringState->sending)
+        return uringState->header.msg_iovlen;
+    // OpenSSL wants a write it couldn't finish retried with the same frame, so its first frame never moves.
+    if (ssl && !tlsKernelSend)
+        return writeQueue.empty() ? 0 : 1;
+    return writePosition ? 1 : 0;
+}
+
+/*
+ * Where a frame goes in the queue: behind everything at least as urgent as it is, and behind any presence change
+ * unless it is a control frame. Only websocket control frames may be sent between the fragments of a message, so
+ * anything else also has to wait for the end of a fragmented message.
+ */
+size_t ConnectionInstance::queuePosition(const MessageBuffer* frame) const {
+    size_t position = writeQueue.size();
+    size_t pinned = pinnedFrames();
+    bool control = frame->priority() == PRIORITY_CONTROL;
+    while (position > pinned && writeQueue[position - 1]->priority() > frame->priority() &&
+           (control || !writeQueue[position - 1]->presence()))
+        --position;
+    if (!frame->raw()) {
+        while (position > 0 && position < writeQueue.size() && !writeQueue[position - 1]->final())
+            ++position;
+    }
+    return position;
+}
+
+void ConnectionInstance::queueMessage(MessagePtr message) {
+    MessageBuffer* frame = fragmentSize ? message->fragmented(fragmentSize) : message.get();
+    auto position = writeQueue.begin() + queuePosition(frame);
+    for (; frame; frame = frame->next()) {
+        queuedBytes += frame->length();
+        statQueuedBytes += frame->length();
+        position = writeQueue.insert(position, MessagePtr(frame)) + 1;
+    }
+    if (uring)
+        uring->queueFlush(this);
+    else
+        Server::queueFlush(this);
+}
+
 void ConnectionInstance::sendError(int error) {
-    string outstr("ERR ");
     json_t* topnode = json_object();
     json_object_set_new_nocheck(topnode, "number",
             json_integer(error)
@@ -103,17 +321,13 @@ void ConnectionInstance::sendError(int error) {
     json_object_set_new_nocheck(topnode, "message",
             json_string_nocheck(LuaConstants::getErrorMessage(error).c_str())
             );
-    const char* errstr = json_dumps(topnode, JSON_COMPACT);
-    outstr += errstr;
-    MessagePtr message(MessageBuffer::fromString(outstr));
+    MessagePtr message(MessageBuffer::fromJSON("ERR", topnode));
     send(message);
-    free((void*) errstr);
     json_decref(topnode);
-    DLOG(INFO) << "Sending error to connection: " << outstr;
+    DLOG(INFO) << "Sending error to connection: " << error;
 }
 
 void ConnectionInstance::sendError(int error, string message) {
-    string outstr("ERR ");
     json_t* topnode = json_object();
     json_object_set_new_nocheck(topnode, "number",
             json_integer(error)
@@ -122,46 +336,53 @@ void ConnectionInstance::sendError(int error, string message) {
     if (!messagenode)
         messagenode = json_string_nocheck("There was an error encoding this error message. Please report this to Kira.");
     json_object_set_new_nocheck(topnode, "message", messagenode);
-    const char* errstr = json_dumps(topnode, JSON_COMPACT);
-    outstr += errstr;
-    MessagePtr outMessage(MessageBuffer::fromString(outstr));
+    MessagePtr outMessage(MessageBuffer::fromJSON("ERR", topnode));
     send(outMessage);
-    free((void*) errstr);
     json_decref(topnode);
-    DLOG(INFO) << "Sending custom error to connection: " << outstr;
+    DLOG(INFO) << "Sending custom error to connection: " << error << " " << message;
 }
 
 void ConnectionInstance::sendDebugReply(string message) {
-    string outstr("ZZZ ");
     json_t* topnode = json_object();
     json_t* messagenode = json_string(message.c_str());
     if (!messagenode)
         messagenode = json_string_nocheck("Failed to parse the debug reply as a valid UTF-8 string.");
     json_object_set_new_nocheck(topnode, "message", messagenode);
-    const char* replystr = json_dumps(topnode, JSON_COMPACT);
-    outstr += replystr;
-    free((void*) replystr);
+    MessagePtr outMessage(MessageBuffer::fromJSON("ZZZ", topnode));
     json_decref(topnode);
-    MessagePtr outMessage(MessageBuffer::fromString(outstr));
     send(outMessage);
 }
 
 void ConnectionInstance::setDelayClose() {
+    if (closed)
+        return;
+
+    if (reactor && !reactor->isCurrent()) {
+        reactor->addCommand(RCMD_DELAY_CLOSE, this);
+        return;
+    }
+
     delayClose = true;
-    ev_io_stop(loop, readEvent);
-    ev_timer_stop(loop, timerEvent);
-    ev_timer_set(timerEvent, 1., 1.);
-    ev_timer_start(loop, timerEvent);
+    ev_io_stop(loop, &readEvent);
+    Server::scheduleConnection(this);
 }
 
-void ConnectionInstance::joinChannel(Channel* channel) {
-    ChannelPtr chan(channel);
-    channelList.insert(chan);
+void ConnectionInstance::startPing() {
+    if (closed)
+        return;
+
+    if (reactor && !reactor->isCurrent()) {
+        reactor->addCommand(RCMD_START_PING, this);
+        return;
+    }
+
+    pingEnabled = true;
+    Server::scheduleConnection(this);
 }
 
-void ConnectionInstance::leaveChannel(Channel* channel) {
-    ChannelPtr chan(channel);
-    channelList.erase(chan);
+size_t ConnectionInstance::findChannel(const Channel* channel) const {
+    chanindex_t::const_iterator i = channelIndex.find(channel);
+    return i != channelIndex.end() ? i->second : channelList.size();
 }
 
 FReturnCode ConnectionInstance::reloadIsolation(string& output) {
@@ -170,6 +391,7 @@ FReturnCode ConnectionInstance::reloadIsolation(string& output) {
     if (ret == FERR_OK) {
         lua_close(debugL);
         debugL = newstate;
+        Server::loadLuaHandlers(debugL, *debugHandlers);
     } else {
         lua_close(newstate);
     }
@@ -180,10 +402,14 @@ FReturnCode ConnectionInstance::reloadIsolation(string& output) {
 FReturnCode ConnectionInstance::isolateLua(string& output) {
     lua_State* newstate = luaL_newstate();
     FReturnCode ret = Server::loadLuaIntoState(newstate, output, true);
-    if (ret == FERR_OK)
+    if (ret == FERR_OK) {
         debugL = newstate;
-    else
+        if (!debugHandlers)
+            debugHandlers = new LuaHandlers;
+        Server::loadLuaHandlers(debugL, *debugHandlers);
+    } else {
         lua_close(newstate);
+    }
 
     return ret;
 }
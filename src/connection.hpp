@@ -28,40 +28,73 @@
 
 #include <boost/intrusive_ptr.hpp>
 #include <boost/functional/hash.hpp>
+#include <boost/intrusive/list_hook.hpp>
 #include <tr1/unordered_map>
 #include <tr1/unordered_set>
 #include <string>
 #include <deque>
+#include <vector>
+#include <atomic>
 #include <ev.h>
 #include <netinet/in.h>
 #include "websocket.hpp"
 #include "ferror.hpp"
 #include "lua_base.hpp"
 #include "messagebuffer.hpp"
+#include "readbuffer.hpp"
 
 using std::string;
 using std::tr1::unordered_map;
 using std::tr1::unordered_set;
 using std::deque;
+using std::vector;
 using boost::intrusive_ptr;
 
 struct lua_State;
+struct LuaHandlers;
 
 class Channel;
+class Reactor;
+class Uring;
+class TimingWheel;
+struct UringConnection;
+typedef struct ssl_st SSL;
+
+namespace Websocket {
+    class Inflater;
+}
+
 
+// A channel the connection is in, and the connection's slot in that channel's member list.
+struct ChannelMembership {
+    intrusive_ptr<Channel> channel;
+    size_t slot;
+};
 
-typedef unordered_set< intrusive_ptr<Channel>, boost::hash< intrusive_ptr<Channel> > > chanlist_t;
+typedef vector<ChannelMembership> chanlist_t;
+typedef unordered_map<const Channel*, size_t> chanindex_t;
 typedef unordered_set<int> intlist_t;
 typedef unordered_set<string> stringset_t;
 typedef unordered_map<string, string> stringmap_t;
 typedef unordered_map<string, double> timermap_t;
 typedef deque<MessagePtr> messagelist_t;
+typedef boost::intrusive::list_member_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink> > wheelhook_t;
 
+/**
+ * A client connection. Instances come from a slab pool and embed their event watchers, so accepting a socket and
+ * closing it again don't go through the general allocator for either.
+ */
 class ConnectionInstance : public LBase {
 public:
     ConnectionInstance();
     ~ConnectionInstance();
 
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+
+    // Reads the send queue limits from the startup config.
+    static void configureSendQueue();
+
     bool send(MessagePtr message);
     bool sendRaw(string& message);
     void sendError(int error);
@@ -69,9 +102,13 @@ public:
     void sendDebugReply(string message);
 
     void setDelayClose();
+    void startPing();
 
-    void leaveChannel(Channel* channel);
-    void joinChannel(Channel* channel);
+    // Removes the fully written frame at the front of the write queue.
+    void popWriteQueue();
+
+    // The index of channel in channelList, or channelList.size() if the connection isn't in it.
+    size_t findChannel(const Channel* channel) const;
 
     FReturnCode reloadIsolation(string& output);
     FReturnCode isolateLua(string& output);
@@ -106,9 +143,11 @@ public:
     bool identified;
     bool admin;
     bool globalModerator;
+    bool batchPresence; // Asked in IDN for presence changes as PRS frames instead of NLN, FLN and STA.
+    unsigned long long presenceListed; // Presence::sequence() when the character list was sent.
     ProtocolVersion protocol;
     struct sockaddr_in clientAddress;
-    bool closed;
+    std::atomic<bool> closed;
     bool delayClose;
 
     string statusMessage;
@@ -119,7 +158,11 @@ public:
 
     stringset_t roles;
 
+    // Maintained by Channel::join and Channel::part.
     chanlist_t channelList;
+    chanindex_t channelIndex; // Each channel's index in channelList.
+    // Maintained by ServerState, this connection's place in the online user list.
+    size_t userListSlot;
 
     stringmap_t miscMap;
     stringmap_t customKinkMap;
@@ -128,27 +171,78 @@ public:
 
 
     //Buffers
-    string readBuffer;
+    ReadBuffer readBuffer;
+    size_t handshakeScanned; //How much of readBuffer has been searched for the end of the upgrade request.
+    Websocket::Inflater* inflater; //Set when permessage-deflate was negotiated.
     messagelist_t writeQueue;
     size_t writePosition;
+    size_t queuedBytes; //Bytes of every frame in writeQueue, including what has been written of the first one.
+    bool congested; //Set at the send queue's high watermark and cleared at its low watermark.
+    ev_tstamp congestedSince;
+
+    //Stats. Written by the owning loop, read for debug output.
+    std::atomic<unsigned long long> statWriteCalls;
+    std::atomic<unsigned long long> statWriteFrames;
+
+    //Send queue limits, in bytes and seconds.
+    static size_t sendQueueLow;
+    static size_t sendQueueHigh;
+    static size_t sendQueueMax;
+    static double sendQueueStall;
+    static size_t fragmentSize; //Larger frames are sent as fragments of this size. 0 disables fragmenting.
+    static size_t sendQueueGlobalMax;
+
+    //Across every connection.
+    static std::atomic<unsigned long long> statQueuedBytes;
+    static std::atomic<unsigned long long> statSuperseded;
+    static std::atomic<unsigned long long> statSlowConsumers;
 
     //Timers
     timermap_t timers;
 
     //Event loop items
     struct ev_loop* loop;
-    ev_timer* pingEvent;
-    ev_timer* timerEvent;
-    ev_io* readEvent;
-    ev_io* writeEvent;
+    Reactor* reactor;
+    Uring* uring; //Set when the io_uring backend does this connection's I/O.
+    UringConnection* uringState;
+    ev_timer timerEvent; //Only used to finish closing the connection on the next loop iteration.
+    ev_io readEvent; //Handles both the handshake and websocket frames, depending on protocol.
+    ev_io writeEvent;
+    bool flushQueued; //Waiting for the end of the loop iteration to be written.
+    SSL* ssl; //Set when the listener terminates TLS itself.
+    bool tlsReady;
+    bool tlsKernelSend; //The kernel encrypts, so writes go straight to the socket.
+    bool tlsKernelReceive;
     ev_tstamp lastActivity;
 
+    //Pings, timeouts and delayed closes, all driven by the loop's timing wheel.
+    TimingWheel* wheel;
+    wheelhook_t wheelHook;
+    ev_tstamp wheelDeadline;
+    bool pingEnabled;
+    ev_tstamp nextPing;
+    ev_tstamp closeAt;
+
+    //Link in ServerState's unidentified list.
+    boost::intrusive::list_member_hook<> unidentifiedHook;
+
     //Lua
     struct lua_State* debugL;
+    LuaHandlers* debugHandlers;
 
 protected:
     int refCount;
 
+private:
+    void queueMessage(MessagePtr message);
+    bool supersede(MessagePtr& message);
+    size_t pinnedFrames() const;
+    size_t queuePosition(const MessageBuffer* frame) const;
+    void dropSlowConsumer(const char* reason);
+
+    friend class Reactor;
+    friend class Uring;
+
     friend inline void intrusive_ptr_release(ConnectionInstance* p)
     {
         if (__sync_sub_and_fetch(&p->refCount, 1) <= 0) {
@@ -34,6 +34,7 @@
 #include "lua_channel.hpp"
 #include "server.hpp"
 #include "server_state.hpp"
+#include "channel_directory.hpp"
 
 #include <string>
 #include <stdio.h>
@@ -110,42 +111,7 @@ int LuaChannel::sendCHA(lua_State* L) {
     GETLCON(base, L, 1, con);
     lua_pop(L, 1);
 
-    static time_t cache_time = 0;
-    static MessagePtr cached_message;
-
-    if (cache_time > time(nullptr)) {
-        con->send(cached_message);
-        return 0;
-    }
-
-    string message = "CHA ";
-    json_t* root = json_object();
-    json_t* array = json_array();
-    chanptrmap_t chans = ServerState::getChannels();
-    for (chanptrmap_t::const_iterator i = chans.begin(); i != chans.end(); ++i) {
-        if (i->second->getType() == CT_PUBLIC) {
-            json_t* channode = json_object();
-            json_object_set_new_nocheck(channode, "name",
-                                        json_string_nocheck(i->second->getName().c_str())
-            );
-            json_object_set_new_nocheck(channode, "mode",
-                                        json_string_nocheck(i->second->getModeString().c_str())
-            );
-            json_object_set_new_nocheck(channode, "characters",
-                                        json_integer(i->second->getParticipantCount())
-            );
-            json_array_append_new(array, channode);
-        }
-    }
-    json_object_set_new_nocheck(root, "channels", array);
-    const char* chanstring = json_dumps(root, JSON_COMPACT);
-    message += chanstring;
-
-    cache_time = time(nullptr) + 30;
-    cached_message = MessageBuffer::fromString(message);
-    con->send(cached_message);
-    free((void*) chanstring);
-    json_decref(root);
+    con->send(ChannelDirectory::getList(CT_PUBLIC));
     return 0;
 }
 
@@ -161,42 +127,7 @@ int LuaChannel::sendORS(lua_State* L) {
     GETLCON(base, L, 1, con);
     lua_pop(L, 1);
 
-    static time_t cache_time = 0;
-    static MessagePtr cached_message;
-
-    if (cache_time > time(nullptr)) {
-        con->send(cached_message);
-        return 0;
-    }
-
-    string message = "ORS ";
-    json_t* root = json_object();
-    json_t* array = json_array();
-    chanptrmap_t chans = ServerState::getChannels();
-    for (chanptrmap_t::const_iterator i = chans.begin(); i != chans.end(); ++i) {
-        if (i->second->getType() == CT_PUBPRIVATE) {
-            json_t* channode = json_object();
-            json_object_set_new_nocheck(channode, "name",
-                                        json_string_nocheck(i->second->getName().c_str())
-            );
-            json_t* titlenode = json_string(i->second->getTitle().c_str());
-            if (!titlenode)
-                titlenode = json_string("This channel had an invalid title. This is a safe default.");
-            json_object_set_new_nocheck(channode, "title", titlenode);
-            json_object_set_new_nocheck(channode, "characters",
-                                        json_integer(i->second->getParticipantCount())
-            );
-            json_array_append_new(array, channode);
-        }
-    }
-    json_object_set_new_nocheck(root, "channels", array);
-    const char* chanstring = json_dumps(root, JSON_COMPACT);
-    message += chanstring;
-    cache_time = time(nullptr) + 30;
-    cached_message = MessageBuffer::fromString(message);
-    con->send(cached_message);
-    free((void*) chanstring);
-    json_decref(root);
+    con->send(ChannelDirectory::getList(CT_PUBPRIVATE));
     return 0;
 }
 
@@ -346,23 +277,21 @@ int LuaChannel::destroyChannel(lua_State* L) {
     if (chan) {
         const ChannelType type = chan->getType();
         const char* channame = chan->getName().c_str();
-        const chconlist_t particpants = chan->getParticipants();
-        for (chconlist_t::const_iterator i = particpants.begin(); i != particpants.end(); ++i) {
+        // Parting swaps the last member down, so draining from the back needs no copy of the list.
+        const chmemberlist_t& members = chan->getMembers();
+        while (!members.empty()) {
+            ConnectionPtr member(members.back().connection);
             json_t* root = json_object();
             json_object_set_new_nocheck(root, "channel",
                                         json_string_nocheck(channame)
             );
             json_object_set_new_nocheck(root, "character",
-                                        json_string_nocheck((*i)->characterName.c_str())
+                                        json_string_nocheck(member->characterName.c_str())
             );
-            const char* leavestr = json_dumps(root, JSON_COMPACT);
-            string msg = "LCH ";
-            msg += leavestr;
-            free((void*) leavestr);
+            MessagePtr outMessage(MessageBuffer::fromJSON("LCH", root));
             json_decref(root);
-            MessagePtr outMessage(MessageBuffer::fromString(msg));
-            (*i)->send(outMessage);
-            chan->part((*i));
+            member->send(outMessage);
+            chan->part(member);
         }
         ServerState::removeChannel(name);
         if (type == CT_PUBLIC)
@@ -383,18 +312,13 @@ int LuaChannel::sendToAll(lua_State* L) {
 
     LBase* base = 0;
     GETLCHAN(base, L, 1, chan);
-    string message = luaL_checkstring(L, 2);
+    const char* message = luaL_checkstring(L, 2);
     if (lua_type(L, 3) != LUA_TTABLE)
         return luaL_error(L, "sendtoall expects a table as argument 3.");
 
-    json_t* json = LuaChat::luaToJson(L);
+    MessagePtr outMessage(MessageBuffer::fromLua(message, L, 3));
     lua_pop(L, 3);
-    message += " ";
-    const char* jsonstr = json_dumps(json, JSON_COMPACT);
-    message += jsonstr;
-    free((void*) jsonstr);
-    json_decref(json);
-    chan->sendToAll(message);
+    chan->sendToAll(outMessage);
     return 0;
 }
 
@@ -430,18 +354,13 @@ int LuaChannel::sendToChannel(lua_State* L) {
     LBase* base = 0;
     GETLCHAN(base, L, 1, chan);
     GETLCON(base, L, 2, con);
-    string message = luaL_checkstring(L, 3);
+    const char* message = luaL_checkstring(L, 3);
     if (lua_type(L, 4) != LUA_TTABLE)
         return luaL_error(L, "sendtochannel expects a table as argument 4.");
 
-    json_t* json = LuaChat::luaToJson(L);
+    MessagePtr outMessage(MessageBuffer::fromLua(message, L, 4));
     lua_pop(L, 4);
-    message += " ";
-    const char* jsonstr = json_dumps(json, JSON_COMPACT);
-    message += jsonstr;
-    free((void*) jsonstr);
-    json_decref(json);
-    chan->sendToChannel(con, message);
+    chan->sendToChannel(con, outMessage);
     return 0;
 }
 
@@ -487,22 +406,18 @@ int LuaChannel::sendICH(lua_State* L) {
                                 json_string_nocheck(chan->getModeString().c_str())
     );
     json_t* array = json_array();
-    const chconlist_t participants = chan->getParticipants();
-    for (chconlist_t::const_iterator i = participants.begin(); i != participants.end(); ++i) {
+    const chmemberlist_t& members = chan->getMembers();
+    for (chmemberlist_t::const_iterator i = members.begin(); i != members.end(); ++i) {
         json_t* charnode = json_object();
         json_object_set_new_nocheck(charnode, "identity",
-                                    json_string_nocheck((*i)->characterName.c_str())
+                                    json_string_nocheck(i->connection->characterName.c_str())
         );
         json_array_append_new(array, charnode);
     }
 
     json_object_set_new_nocheck(root, "users", array);
-    string msg = "ICH ";
-    const char* ichstr = json_dumps(root, JSON_COMPACT);
-    msg += ichstr;
-    MessagePtr outMessage(MessageBuffer::fromString(msg));
+    MessagePtr outMessage(MessageBuffer::fromJSON("ICH", root));
     con->send(outMessage);
-    free((void*) ichstr);
     json_decref(root);
     return 0;
 }
@@ -827,7 +742,7 @@ int LuaChannel::addMod(lua_State* L) {
         ServerState::rebuildChannelOpList();
         auto con = ServerState::getConnection(dest);
         if (con) {
-            con->roles.insert("cop");
+            ServerState::addRole(con, "cop");
         }
     }
 
@@ -853,7 +768,7 @@ int LuaChannel::removeMod(lua_State* L) {
         ServerState::rebuildChannelOpList();
         auto con = ServerState::getConnection(dest);
         if (con && !ServerState::isChannelOp(dest)) {
-            con->roles.erase("cop");
+            ServerState::removeRole(con, "cop");
         }
     }
 
@@ -937,7 +852,7 @@ int LuaChannel::getModList(lua_State* L) {
         lua_rawseti(L, -2, i++);
     }
     if (chan->getType() == CT_PUBLIC) {
-        auto scops = ServerState::getSuperCops();
+        const scopset_t& scops = ServerState::getSuperCops();
         for (auto itr = scops.begin(); itr != scops.end(); ++itr) {
             lua_pushstring(L, itr->c_str());
             lua_rawseti(L, -2, i++);
@@ -1153,13 +1068,14 @@ int LuaChannel::getBottleList(lua_State* L) {
     GETLCON(base, L, 2, con);
     lua_pop(L, 1);
 
-    const chconlist_t participants = chan->getParticipants();
+    const chmemberlist_t& members = chan->getMembers();
     lua_newtable(L);
     int n = 1;
-    for (chconlist_t::const_iterator i = participants.begin(); i != participants.end(); ++i) {
-        if (((*i)->status == "online" || (*i)->status == "looking") &&
-            ((*i)->characterNameLower != con->characterNameLower)) {
-            lua_pushstring(L, (*i)->characterName.c_str());
+    for (chmemberlist_t::const_iterator i = members.begin(); i != members.end(); ++i) {
+        const ConnectionInstance* member = i->connection;
+        if ((member->status == "online" || member->status == "looking") &&
+            (member->characterNameLower != con->characterNameLower)) {
+            lua_pushstring(L, member->characterName.c_str());
             lua_rawseti(L, -2, n++);
         }
     }
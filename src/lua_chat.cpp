@@ -30,10 +30,15 @@
 
 #include "precompiled_headers.hpp"
 #include "lua_chat.hpp"
+#include "lua_json.hpp"
 #include "server_state.hpp"
 #include "unicode_tools.hpp"
 #include "startup_config.hpp"
 #include "server.hpp"
+#include "admission.hpp"
+#include "native_command.hpp"
+#include "channel_directory.hpp"
+#include "presence.hpp"
 #include "logger_thread.hpp"
 #include <time.h>
 #include <stdio.h>
@@ -48,6 +53,7 @@ static const luaL_Reg luachat_funcs[] = {
         {"broadcastRaw",          LuaChat::broadcastRaw},
         {"broadcastOps",          LuaChat::broadcastOps},
         {"broadcastStaffCall",    LuaChat::broadcastStaffCall},
+        {"broadcastPresence",     LuaChat::broadcastPresence},
         {"getConfigBool",         LuaChat::getConfigBool},
         {"getConfigDouble",       LuaChat::getConfigDouble},
         {"getConfigString",       LuaChat::getConfigString},
@@ -80,6 +86,8 @@ static const luaL_Reg luachat_funcs[] = {
         {"logMessage",            LuaChat::logMessage},
         //{"shutdown", LuaChat::shutdown},
         {"getStats",              LuaChat::getStats},
+        {"getAdmissionStats",     LuaChat::getAdmissionStats},
+        {"getSendQueueStats",     LuaChat::getSendQueueStats},
         {"logAction",             LuaChat::logAction},
         {"toJSON",                LuaChat::toJsonString},
         {"fromJSON",              LuaChat::fromJsonString},
@@ -133,32 +141,39 @@ int LuaChat::logMessage(lua_State* L) {
     }
     lua_pop(L, 5);
 
+    addLogEntry(type, from_connection.get(), to_channel, to_connection.get(), to_character_string, body);
+    return 0;
+}
+
+void LuaChat::addLogEntry(const string& type, ConnectionInstance* from, Channel* channel, ConnectionInstance* to,
+                          const string& toCharacter, const string& body) {
+    if (Server::logger() == 0)
+        return;
+
     auto entry = new LogEntry();
     struct timeval tv{};
     gettimeofday(&tv, NULL);
     entry->time = (unsigned long long) (tv.tv_sec) * 1000 + (unsigned long long) (tv.tv_usec) / 1000;
     entry->messageType = type;
-    entry->fromAccountID = from_connection->accountID;
-    entry->fromCharacterID = from_connection->characterID;
-    entry->fromCharacter = from_connection->characterName;
-    if (to_channel) {
-        entry->toChannel = to_channel->getName();
-        entry->toChannelTitle = to_channel->getTitle();
+    entry->fromAccountID = from->accountID;
+    entry->fromCharacterID = from->characterID;
+    entry->fromCharacter = from->characterName;
+    if (channel) {
+        entry->toChannel = channel->getName();
+        entry->toChannelTitle = channel->getTitle();
     }
-    if (to_connection) {
-        entry->toAccountID = to_connection->accountID;
-        entry->toCharacterID = to_connection->characterID;
-        entry->toCharacter = to_connection->characterName;
-    } else if (to_character_string.length()) {
-        entry->toCharacter = to_character_string;
+    if (to) {
+        entry->toAccountID = to->accountID;
+        entry->toCharacterID = to->characterID;
+        entry->toCharacter = to->characterName;
+    } else if (toCharacter.length()) {
+        entry->toCharacter = toCharacter;
     }
     if (body.length()) {
         entry->messageBody = body;
     }
     Server::logger()->addLogEntry(entry);
     Server::logger()->sendWakeup();
-
-    return 0;
 }
 
 /**
@@ -172,16 +187,10 @@ int LuaChat::broadcast(lua_State* L) {
     if (lua_type(L, 2) != LUA_TTABLE)
         return luaL_error(L, "broadcast requires a table as the second argument.");
 
-    string message = luaL_checkstring(L, 1);
-    message += " ";
-    json_t* json = luaToJson(L);
-    const char* jsonstr = json_dumps(json, JSON_COMPACT);
-    message += jsonstr;
-    free((void*) jsonstr);
-    json_decref(json);
+    const char* message = luaL_checkstring(L, 1);
+    MessagePtr outMessage(MessageBuffer::fromLua(message, L, 2));
     lua_pop(L, 2);
-    MessagePtr outMessage(MessageBuffer::fromString(message));
-    const conptrmap_t conmap = ServerState::getConnections();
+    const conptrmap_t& conmap = ServerState::getConnections();
     for (conptrmap_t::const_iterator i = conmap.begin(); i != conmap.end(); ++i) {
         ((*i).second)->send(outMessage);
     }
@@ -198,7 +207,7 @@ int LuaChat::broadcastRaw(lua_State* L) {
     string message = luaL_checkstring(L, 1);
     lua_pop(L, 1);
     MessagePtr outMessage(MessageBuffer::fromString(message));
-    const conptrmap_t conmap = ServerState::getConnections();
+    const conptrmap_t& conmap = ServerState::getConnections();
     for (conptrmap_t::const_iterator i = conmap.begin(); i != conmap.end(); ++i) {
         ((*i).second)->send(outMessage);
     }
@@ -210,26 +219,12 @@ int LuaChat::broadcastOps(lua_State* L) {
     if (lua_type(L, 2) != LUA_TTABLE)
         return luaL_error(L, "broadcastOps requires a table as the second argument.");
 
-    string message = luaL_checkstring(L, 1);
-    message += " ";
-    json_t* json = luaToJson(L);
-    const char* jsonstr = json_dumps(json, JSON_COMPACT);
-    message += jsonstr;
-    free((void*) jsonstr);
-    json_decref(json);
+    const char* message = luaL_checkstring(L, 1);
+    MessagePtr outMessage(MessageBuffer::fromLua(message, L, 2));
     lua_pop(L, 2);
-    MessagePtr outMessage(MessageBuffer::fromString(message));
-    const oplist_t ops = ServerState::getOpList();
-    for (oplist_t::const_iterator i = ops.begin(); i != ops.end(); ++i) {
-        string name(*i);
-        int length = name.length();
-        for (int x = 0; x < length; ++x) {
-            name[x] = tolower(name[x]);
-        }
-        ConnectionPtr con = ServerState::getConnection(name);
-        if (con != 0) {
-            con->send(outMessage);
-        }
+    const conptrlist_t& ops = ServerState::getOnlineOps();
+    for (conptrlist_t::const_iterator i = ops.begin(); i != ops.end(); ++i) {
+        (*i)->send(outMessage);
     }
     return 0;
 }
@@ -239,25 +234,50 @@ int LuaChat::broadcastStaffCall(lua_State* L) {
     if (lua_type(L, 2) != LUA_TTABLE)
         return luaL_error(L, "broadcastStaffCall requires a table as the second argument.");
 
-    string message = luaL_checkstring(L, 1);
-    message += " ";
-    json_t* json = luaToJson(L);
-    const char* jsonstr = json_dumps(json, JSON_COMPACT);
-    message += jsonstr;
-    free((void*) jsonstr);
-    json_decref(json);
+    const char* message = luaL_checkstring(L, 1);
+    MessagePtr outMessage(MessageBuffer::fromLua(message, L, 2));
     lua_pop(L, 2);
-    MessagePtr outMessage(MessageBuffer::fromString(message));
-    auto targets = ServerState::getStaffCallTargets();
-    for (auto i = targets.begin(); i != targets.end(); ++i) {
-        ConnectionPtr con(*i);
-        if (con != 0) {
-            con->send(outMessage);
-        }
+    const conptrset_t& targets = ServerState::getStaffCallTargets();
+    for (conptrset_t::const_iterator i = targets.begin(); i != targets.end(); ++i) {
+        (*i)->send(outMessage);
     }
     return 0;
 }
 
+static string presenceField(lua_State* L, int index, const char* name) {
+    lua_getfield(L, index, name);
+    string value;
+    if (lua_type(L, -1) == LUA_TSTRING)
+        value = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    return value;
+}
+
+/**
+ * Broadcasts a presence change. These are coalesced and sent out once per presence tick.
+ * @param string NLN, FLN or STA
+ * @param table json, as it would be passed to broadcast
+ * @returns Nothing.
+ */
+int LuaChat::broadcastPresence(lua_State* L) {
+    luaL_checkany(L, 2);
+    if (lua_type(L, 2) != LUA_TTABLE)
+        return luaL_error(L, "broadcastPresence requires a table as the second argument.");
+
+    string prefix = luaL_checkstring(L, 1);
+    if (prefix == "NLN")
+        Presence::online(presenceField(L, 2, "identity"), presenceField(L, 2, "gender"), presenceField(L, 2, "status"));
+    else if (prefix == "FLN")
+        Presence::offline(presenceField(L, 2, "character"));
+    else if (prefix == "STA")
+        Presence::status(presenceField(L, 2, "character"), presenceField(L, 2, "status"),
+                         presenceField(L, 2, "statusmsg"));
+    else
+        return luaL_error(L, "broadcastPresence only takes NLN, FLN or STA.");
+    lua_pop(L, 2);
+    return 0;
+}
+
 int LuaChat::addToStaffCallTargets(lua_State* L) {
     luaL_checkany(L, 1);
 
@@ -368,52 +388,17 @@ int LuaChat::sendUserList(lua_State* L) {
     LBase* base = 0;
     GETLCON(base, L, 1, con);
     string prefix = luaL_checkstring(L, 2);
-    prefix += " ";
     int split = luaL_checkinteger(L, 3);
     lua_pop(L, 3);
 
-    conptrmap_t cons = ServerState::getConnections();
-    int n = 0;
-    json_t* rootnode = json_object();
-    json_t* arraynode = json_array();
-    for (conptrmap_t::const_iterator i = cons.begin(); i != cons.end(); ++i) {
-        json_t* cha = json_array();
-        json_array_append_new(cha,
-                              json_string_nocheck(i->second->characterName.c_str())
-        );
-        json_array_append_new(cha,
-                              json_string_nocheck(i->second->gender.c_str())
-        );
-        json_array_append_new(cha,
-                              json_string_nocheck(i->second->status.c_str())
-        );
-        json_t* status = json_string(i->second->statusMessage.c_str());
-        if (!status)
-            status = json_string_nocheck("");
-        json_array_append_new(cha, status);
-
-        json_array_append_new(arraynode, cha);
-        if ((++n % split) == 0) {
-            json_object_set_new_nocheck(rootnode, "characters", arraynode);
-            string s = prefix;
-            const char* message = json_dumps(rootnode, JSON_COMPACT);
-            s += message;
-            MessagePtr outMessage(MessageBuffer::fromString(s));
-            con->send(outMessage);
-            free((void*) message);
-            json_decref(rootnode);
-            arraynode = json_array();
-            rootnode = json_object();
-        }
+    if (split < 1)
+        return luaL_error(L, "sendUserList requires a chunk size of at least one.");
+
+    const vector<MessagePtr>& frames = ServerState::getUserListFrames(prefix, split);
+    for (vector<MessagePtr>::const_iterator i = frames.begin(); i != frames.end(); ++i) {
+        con->send(*i);
     }
-    json_object_set_new_nocheck(rootnode, "characters", arraynode);
-    string s = prefix;
-    const char* message = json_dumps(rootnode, JSON_COMPACT);
-    s += message;
-    MessagePtr outMessage(MessageBuffer::fromString(s));
-    con->send(outMessage);
-    free((void*) message);
-    json_decref(rootnode);
+    con->presenceListed = Presence::sequence();
     return 0;
 }
 
@@ -424,7 +409,7 @@ int LuaChat::sendUserList(lua_State* L) {
 int LuaChat::getOpList(lua_State* L) {
     lua_newtable(L);
     int n = 1;
-    const oplist_t ops = ServerState::getOpList();
+    const oplist_t& ops = ServerState::getOpList();
     for (oplist_t::const_iterator i = ops.begin(); i != ops.end(); ++i) {
         lua_pushstring(L, i->c_str());
         lua_rawseti(L, -2, n++);
@@ -742,7 +727,6 @@ int LuaChat::sendStaffCalls(lua_State* L) {
     const staffcallmap_t calls = ServerState::getStaffCalls();
     for (staffcallmap_t::const_iterator i = calls.begin(); i != calls.end(); ++i) {
         StaffCallRecord r = i->second;
-        string message("SFC ");
         json_t* rootnode = json_object();
         json_object_set_new_nocheck(rootnode, "action",
                                     json_string_nocheck("report")
@@ -771,11 +755,8 @@ int LuaChat::sendStaffCalls(lua_State* L) {
                                         json_integer(r.logid)
             );
         }
-        const char* sfcstring = json_dumps(rootnode, JSON_COMPACT);
-        message += sfcstring;
-        MessagePtr outMessage(MessageBuffer::fromString(message));
+        MessagePtr outMessage(MessageBuffer::fromJSON("SFC", rootnode));
         con->send(outMessage);
-        free((void*) sfcstring);
         json_decref(rootnode);
     }
     return 0;
@@ -795,20 +776,23 @@ int LuaChat::isChanOp(lua_State* L) {
 }
 
 /**
- * Escapes '<' '>' and '&' in a string and returns the string.
- *
- * This is expensive to do, as the string must be converted from UTF-8 to UTF-16/32 and back to UTF-8
- * after having escaped the characters.
+ * Escapes '<' '>' and '&' in a string and returns the string. Invalid UTF-8 is replaced with U+FFFD.
  * @param string message
  * @returns [string] html escaped string.
  */
 int LuaChat::escapeHTML(lua_State* L) {
     luaL_checkany(L, 1);
 
-    string message = luaL_checkstring(L, 1);
-    lua_pop(L, 1);
+    size_t length;
+    const char* message = luaL_checklstring(L, 1, &length);
+    lua_settop(L, 1);
 
-    lua_pushstring(L, UnicodeTools::escapeHTML(message).c_str());
+    // Most messages need no escaping, and are returned as the same Lua string.
+    string escaped;
+    if (UnicodeTools::escapeHTML(message, length, escaped)) {
+        lua_pop(L, 1);
+        lua_pushlstring(L, escaped.data(), escaped.length());
+    }
     return 1;
 }
 
@@ -831,6 +815,9 @@ int LuaChat::reload(lua_State* L) {
     ServerState::loadBans();
     ServerState::loadOps();
     StartupConfig::init();
+    NativeCommand::configure();
+    ChannelDirectory::configure();
+    Presence::configure();
     Server::parseLBList();
     return 0;
 }
@@ -870,6 +857,30 @@ int LuaChat::getStats(lua_State* L) {
     return 7;
 }
 
+/**
+ * Returns the listener's admission counters.
+ * @returns [number] Admitted connections, [number] Times accepting was deferred, [number] Connections rejected for
+ * their address, [number] Connections closed by the io_uring backend because the global bucket was empty.
+ */
+int LuaChat::getAdmissionStats(lua_State* L) {
+    lua_pushnumber(L, Admission::getAccepted());
+    lua_pushnumber(L, Admission::getDeferred());
+    lua_pushnumber(L, Admission::getRejected());
+    lua_pushnumber(L, Admission::getDropped());
+    return 4;
+}
+
+/**
+ * Returns outbound queue counters across every connection.
+ * @returns [number] Bytes queued, [number] Frames superseded by newer ones, [number] Slow consumers disconnected.
+ */
+int LuaChat::getSendQueueStats(lua_State* L) {
+    lua_pushnumber(L, ConnectionInstance::statQueuedBytes);
+    lua_pushnumber(L, ConnectionInstance::statSuperseded);
+    lua_pushnumber(L, ConnectionInstance::statSlowConsumers);
+    return 3;
+}
+
 /**
  * Logs an action to the action log.
  * @param LUD connection
@@ -942,15 +953,11 @@ int LuaChat::toJsonString(lua_State* L) {
  * @returns lua table containing the contents of the json string.
  */
 int LuaChat::fromJsonString(lua_State* L) {
-    luaL_checkany(L, 1);
-    string message = luaL_checkstring(L, 1);
-    lua_pop(L, 1);
+    size_t length = 0;
+    const char* message = luaL_checklstring(L, 1, &length);
 
-    json_t* n = json_loads(message.c_str(), 0, 0);
-    if (!n)
-        n = json_object();
-    jsonToLua(L, n);
-    json_decref(n);
+    if (!LuaJSON::decode(L, message, length))
+        lua_newtable(L);
     return 1;
 }
 
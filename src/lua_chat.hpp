@@ -31,6 +31,9 @@
 #include "fjson.hpp"
 #include <string>
 
+class Channel;
+class ConnectionInstance;
+
 using std::string;
 
 class LuaChat {
@@ -81,6 +84,8 @@ public:
     static int sendStaffCalls(lua_State* L);
     static int broadcastStaffCall(lua_State* L);
 
+    static int broadcastPresence(lua_State* L);
+
     static int addToStaffCallTargets(lua_State* L);
 
     static int isChanOp(lua_State* L);
@@ -91,6 +96,8 @@ public:
     static int shutdown(lua_State* L);
 
     static int getStats(lua_State* L);
+    static int getAdmissionStats(lua_State* L);
+    static int getSendQueueStats(lua_State* L);
 
     static int logAction(lua_State* L);
 
@@ -98,6 +105,9 @@ public:
     static int fromJsonString(lua_State* L);
 
     static int logMessage(lua_State* L);
+    // What s.logMessage does, for native code. to and channel may be null, toCharacter and body empty.
+    static void addLogEntry(const string& type, ConnectionInstance* from, Channel* channel, ConnectionInstance* to,
+                            const string& toCharacter, const string& body);
 
     static json_t* luaToJson(lua_State* L);
     static void jsonToLua(lua_State* L, json_t* json);
@@ -43,6 +43,8 @@ static const luaL_Reg luaconnection_funcs[] = {
         {"getIPCount",             LuaConnection::getIPCount},
         {"getByAccount",           LuaConnection::getByAccount},
         {"getByAccountID",         LuaConnection::getByAccountID},
+        {"getByIP",                LuaConnection::getByIP},
+        {"getByRole",              LuaConnection::getByRole},
         {"getName",                LuaConnection::getName},
         {"getChannels",            LuaConnection::getChannels},
         {"getChannelCount",        LuaConnection::getChannelCount},
@@ -91,6 +93,15 @@ int LuaConnection::openConnectionLib(lua_State* L) {
     return 0;
 }
 
+static void pushConnectionList(lua_State* L, const conptrlist_t& cons) {
+    lua_createtable(L, cons.size(), 0);
+    int n = 1;
+    for (conptrlist_t::const_iterator i = cons.begin(); i != cons.end(); ++i) {
+        lua_pushlightuserdata(L, i->get());
+        lua_rawseti(L, -2, n++);
+    }
+}
+
 /**
  * Returns a connection object for a named connection.
  * @param string name
@@ -138,16 +149,7 @@ int LuaConnection::getByAccount(lua_State* L) {
     GETLCON(base, L, 1, con);
     lua_pop(L, 1);
 
-    lua_newtable(L);
-    int n = 1;
-    const conptrmap_t cons = ServerState::getConnections();
-    for (conptrmap_t::const_iterator i = cons.begin(); i != cons.end(); ++i) {
-        if (i->second->accountID == con->accountID) {
-            lua_pushlightuserdata(L, i->second.get());
-            lua_rawseti(L, -2, n++);
-        }
-    }
-
+    pushConnectionList(L, ServerState::getConnectionsByAccount(con->accountID));
     return 1;
 }
 
@@ -162,16 +164,38 @@ int LuaConnection::getByAccountID(lua_State* L) {
     long accountid = (long) luaL_checkinteger(L, 1);
     lua_pop(L, 1);
 
-    lua_newtable(L);
-    int n = 1;
-    const conptrmap_t cons = ServerState::getConnections();
-    for (conptrmap_t::const_iterator i = cons.begin(); i != cons.end(); ++i) {
-        if (i->second->accountID == accountid) {
-            lua_pushlightuserdata(L, i->second.get());
-            lua_rawseti(L, -2, n++);
-        }
-    }
+    pushConnectionList(L, ServerState::getConnectionsByAccount(accountid));
+    return 1;
+}
+
+/**
+ * Returns a list of connections that come from the same address as the provided connection.
+ * @param LUD connection
+ * @returns [table of LUD] connections from the same address, including provided.
+ */
+int LuaConnection::getByIP(lua_State* L) {
+    luaL_checkany(L, 1);
+
+    LBase* base = 0;
+    GETLCON(base, L, 1, con);
+    lua_pop(L, 1);
+
+    pushConnectionList(L, ServerState::getConnectionsByIP(con));
+    return 1;
+}
+
+/**
+ * Returns a list of the online connections that hold a role.
+ * @param string role
+ * @returns [table of LUD] connections with the role.
+ */
+int LuaConnection::getByRole(lua_State* L) {
+    luaL_checkany(L, 1);
 
+    string role = luaL_checkstring(L, 1);
+    lua_pop(L, 1);
+
+    pushConnectionList(L, ServerState::getConnectionsByRole(role));
     return 1;
 }
 
@@ -230,7 +254,7 @@ int LuaConnection::getChannels(lua_State* L) {
     lua_newtable(L);
     int i = 1;
     for (chanlist_t::const_iterator itr = con->channelList.begin(); itr != con->channelList.end(); ++itr) {
-        lua_pushlightuserdata(L, (*itr).get());
+        lua_pushlightuserdata(L, itr->channel.get());
         lua_rawseti(L, -2, i++);
     }
     return 1;
@@ -248,16 +272,10 @@ int LuaConnection::send(lua_State* L) {
 
     LBase* base = 0;
     GETLCON(base, L, 1, con);
-    string message = luaL_checkstring(L, 2);
-    message += " ";
-    json_t* json = LuaChat::luaToJson(L);
-    const char* jsonstr = json_dumps(json, JSON_COMPACT);
-    message += jsonstr;
-    free((void*) jsonstr);
-    json_decref(json);
+    const char* message = luaL_checkstring(L, 2);
+    MessagePtr outMessage(MessageBuffer::fromLua(message, L, 3));
     lua_pop(L, 3);
 
-    MessagePtr outMessage(MessageBuffer::fromString(message));
     con->send(outMessage);
     return 0;
 }
@@ -406,7 +424,7 @@ int LuaConnection::setAccountID(lua_State* L) {
     long accountid = luaL_checkinteger(L, 2);
     lua_pop(L, 2);
 
-    con->accountID = accountid;
+    ServerState::setAccountID(con, accountid);
     return 0;
 }
 
@@ -445,9 +463,9 @@ int LuaConnection::setAdmin(lua_State* L) {
 
     con->admin = newflag;
     if (newflag)
-        con->roles.insert("admin");
+        ServerState::addRole(con, "admin");
     else
-        con->roles.erase("admin");
+        ServerState::removeRole(con, "admin");
     return 0;
 }
 
@@ -479,9 +497,9 @@ int LuaConnection::setGlobalModerator(lua_State* L) {
 
     con->globalModerator = newflag;
     if (newflag)
-        con->roles.insert("global");
+        ServerState::addRole(con, "global");
     else
-        con->roles.erase("global");
+        ServerState::removeRole(con, "global");
     return 0;
 }
 
@@ -543,7 +561,7 @@ int LuaConnection::addRole(lua_State* L) {
 
     lua_pop(L, 2);
 
-    con->roles.insert(role);
+    ServerState::addRole(con, role);
 
     return 0;
 }
@@ -557,7 +575,7 @@ int LuaConnection::removeRole(lua_State* L) {
 
     lua_pop(L, 2);
 
-    con->roles.erase(role);
+    ServerState::removeRole(con, role);
     return 0;
 }
 
@@ -769,6 +787,7 @@ int LuaConnection::setGender(lua_State* L) {
     lua_pop(L, 2);
 
     con->gender = gender;
+    ServerState::userListChanged(con);
     return 0;
 }
 
@@ -906,6 +925,7 @@ int LuaConnection::setStatus(lua_State* L) {
     con->status = status;
     if (setmessage)
         con->statusMessage = statusmessage;
+    ServerState::userListChanged(con);
 
     return 0;
 }
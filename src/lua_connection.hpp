@@ -42,6 +42,10 @@ public:
 
     static int getByAccountID(lua_State* L);
 
+    static int getByIP(lua_State* L);
+
+    static int getByRole(lua_State* L);
+
     static int getConnectionIDs(lua_State* L);
 
     static int getName(lua_State* L);
@@ -0,0 +1,680 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "precompiled_headers.hpp"
+
+#include "lua_json.hpp"
+
+#include <math.h>
+#include <string>
+
+// Deeper documents are rejected rather than risking the C stack.
+#define JSON_MAX_DEPTH 256
+
+namespace {
+
+    /*
+     * The length of the multibyte UTF-8 sequence at p, or 0 if it is invalid. Overlong forms, surrogates and anything
+     * past U+10FFFF are invalid, as they are to jansson.
+     */
+    size_t utf8Sequence(const char* p, const char* end) {
+        unsigned char c = *p;
+        size_t count;
+        unsigned char low = 0x80;
+        unsigned char high = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            count = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            count = 2;
+            if (c == 0xE0)
+                low = 0xA0;
+            else if (c == 0xED)
+                high = 0x9F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            count = 3;
+            if (c == 0xF0)
+                low = 0x90;
+            else if (c == 0xF4)
+                high = 0x8F;
+        } else {
+            return 0;
+        }
+        if (static_cast<size_t> (end - p) <= count)
+            return 0;
+        unsigned char second = p[1];
+        if (second < low || second > high)
+            return 0;
+        for (size_t i = 2; i <= count; ++i) {
+            if ((static_cast<unsigned char> (p[i]) & 0xC0) != 0x80)
+                return 0;
+        }
+        return count + 1;
+    }
+
+    bool validUTF8(const char* p, size_t length) {
+        const char* end = p + length;
+        while (p < end) {
+            if (static_cast<unsigned char> (*p) < 0x80) {
+                ++p;
+                continue;
+            }
+            size_t sequence = utf8Sequence(p, end);
+            if (!sequence)
+                return false;
+            p += sequence;
+        }
+        return true;
+    }
+
+    /*
+     * Recursive descent over the input. Values are pushed as soon as they are parsed, so the only copies made are of
+     * strings containing escapes, and of numbers for strtod.
+     */
+    class Decoder {
+    public:
+
+        Decoder(lua_State* L, const char* json, size_t length, std::string& scratch)
+        :
+        L(L),
+        p(json),
+        end(json + length),
+        depth(0),
+        scratch(scratch) { }
+
+        bool document() {
+            skipSpace();
+            if (p == end)
+                return false;
+            if (*p == '[') {
+                // jsonToLua only looks at the members of objects.
+                if (!array())
+                    return false;
+                lua_pop(L, 1);
+                lua_newtable(L);
+            } else if (*p != '{' || !object()) {
+                return false;
+            }
+            skipSpace();
+            return p == end;
+        }
+
+    private:
+
+        void skipSpace() {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+                ++p;
+        }
+
+        bool literal(const char* word, size_t length) {
+            if (static_cast<size_t> (end - p) < length || memcmp(p, word, length))
+                return false;
+            p += length;
+            return true;
+        }
+
+        // Pushes the value, unless it is null. pushed says which.
+        bool value(bool& pushed) {
+            pushed = true;
+            if (p == end)
+                return false;
+            switch (*p) {
+                case '{':
+                    return object();
+                case '[':
+                    return array();
+                case '"':
+                    return stringValue();
+                case 't':
+                    if (!literal("true", 4))
+                        return false;
+                    lua_pushboolean(L, 1);
+                    return true;
+                case 'f':
+                    if (!literal("false", 5))
+                        return false;
+                    lua_pushboolean(L, 0);
+                    return true;
+                case 'n':
+                    pushed = false;
+                    return literal("null", 4);
+                default:
+                    return number();
+            }
+        }
+
+        bool object() {
+            if (++depth > JSON_MAX_DEPTH || !lua_checkstack(L, 4))
+                return false;
+            ++p;
+            lua_newtable(L);
+            skipSpace();
+            if (p < end && *p == '}') {
+                ++p;
+                --depth;
+                return true;
+            }
+            while (true) {
+                if (p == end || *p != '"')
+                    return false;
+                const char* key;
+                size_t keyLength;
+                if (!stringContents(key, keyLength))
+                    return false;
+                skipSpace();
+                if (p == end || *p != ':')
+                    return false;
+                ++p;
+                skipSpace();
+                if (p < end && *p == '[') {
+                    lua_pushliteral(L, "array_");
+                    lua_pushlstring(L, key, keyLength);
+                    lua_concat(L, 2);
+                } else {
+                    lua_pushlstring(L, key, keyLength);
+                }
+                bool pushed;
+                if (!value(pushed))
+                    return false;
+                if (pushed)
+                    lua_rawset(L, -3);
+                else
+                    lua_pop(L, 1);
+                skipSpace();
+                if (p == end)
+                    return false;
+                if (*p == '}') {
+                    ++p;
+                    --depth;
+                    return true;
+                }
+                if (*p != ',')
+                    return false;
+                ++p;
+                skipSpace();
+            }
+        }
+
+        // Nulls leave a hole, as they do in jsonToLua.
+        bool array() {
+            if (++depth > JSON_MAX_DEPTH || !lua_checkstack(L, 4))
+                return false;
+            ++p;
+            lua_newtable(L);
+            skipSpace();
+            if (p < end && *p == ']') {
+                ++p;
+                --depth;
+                return true;
+            }
+            int index = 1;
+            while (true) {
+                bool pushed;
+                if (!value(pushed))
+                    return false;
+                if (pushed)
+                    lua_rawseti(L, -2, index);
+                ++index;
+                skipSpace();
+                if (p == end)
+                    return false;
+                if (*p == ']') {
+                    ++p;
+                    --depth;
+                    return true;
+                }
+                if (*p != ',')
+                    return false;
+                ++p;
+                skipSpace();
+            }
+        }
+
+        bool stringValue() {
+            const char* contents;
+            size_t length;
+            if (!stringContents(contents, length))
+                return false;
+            lua_pushlstring(L, contents, length);
+            return true;
+        }
+
+        /*
+         * Points contents at the decoded string. That is the input itself unless the string has escapes, in which
+         * case it is decoded into scratch and only valid until the next string.
+         */
+        bool stringContents(const char*& contents, size_t& length) {
+            const char* start = ++p;
+            while (true) {
+                if (p == end)
+                    return false;
+                unsigned char c = *p;
+                if (c == '"') {
+                    contents = start;
+                    length = p - start;
+                    ++p;
+                    return true;
+                } else if (c == '\\') {
+                    break;
+                } else if (c < 0x20) {
+                    return false;
+                } else if (c < 0x80) {
+                    ++p;
+                } else if (!utf8()) {
+                    return false;
+                }
+            }
+
+            scratch.assign(start, p - start);
+            while (true) {
+                if (p == end)
+                    return false;
+                unsigned char c = *p;
+                if (c == '"') {
+                    contents = scratch.data();
+                    length = scratch.length();
+                    ++p;
+                    return true;
+                } else if (c == '\\') {
+                    if (!escape())
+                        return false;
+                } else if (c < 0x20) {
+                    return false;
+                } else if (c < 0x80) {
+                    scratch += c;
+                    ++p;
+                } else {
+                    const char* sequence = p;
+                    if (!utf8())
+                        return false;
+                    scratch.append(sequence, p - sequence);
+                }
+            }
+        }
+
+        bool utf8() {
+            size_t length = utf8Sequence(p, end);
+            p += length;
+            return length != 0;
+        }
+
+        bool hex4(unsigned int& value) {
+            if (end - p < 4)
+                return false;
+            value = 0;
+            for (int i = 0; i < 4; ++i) {
+                char c = *p++;
+                value <<= 4;
+                if (c >= '0' && c <= '9')
+                    value |= c - '0';
+                else if (c >= 'a' && c <= 'f')
+                    value |= c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F')
+                    value |= c - 'A' + 10;
+                else
+                    return false;
+            }
+            return true;
+        }
+
+        bool escape() {
+            if (end - p < 2)
+                return false;
+            char c = p[1];
+            p += 2;
+            switch (c) {
+                case '"':
+                case '\\':
+                case '/':
+                    scratch += c;
+                    return true;
+                case 'b':
+                    scratch += '\b';
+                    return true;
+                case 'f':
+                    scratch += '\f';
+                    return true;
+                case 'n':
+                    scratch += '\n';
+                    return true;
+                case 'r':
+                    scratch += '\r';
+                    return true;
+                case 't':
+                    scratch += '\t';
+                    return true;
+                case 'u':
+                    break;
+                default:
+                    return false;
+            }
+
+            unsigned int code;
+            if (!hex4(code) || code == 0)
+                return false;
+            if (code >= 0xDC00 && code <= 0xDFFF) {
+                return false;
+            } else if (code >= 0xD800 && code <= 0xDBFF) {
+                unsigned int trail;
+                if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+                    return false;
+                p += 2;
+                if (!hex4(trail) || trail < 0xDC00 || trail > 0xDFFF)
+                    return false;
+                code = 0x10000 + ((code - 0xD800) << 10) + (trail - 0xDC00);
+            }
+
+            if (code < 0x80) {
+                scratch += static_cast<char> (code);
+            } else if (code < 0x800) {
+                scratch += static_cast<char> (0xC0 | (code >> 6));
+                scratch += static_cast<char> (0x80 | (code & 0x3F));
+            } else if (code < 0x10000) {
+                scratch += static_cast<char> (0xE0 | (code >> 12));
+                scratch += static_cast<char> (0x80 | ((code >> 6) & 0x3F));
+                scratch += static_cast<char> (0x80 | (code & 0x3F));
+            } else {
+                scratch += static_cast<char> (0xF0 | (code >> 18));
+                scratch += static_cast<char> (0x80 | ((code >> 12) & 0x3F));
+                scratch += static_cast<char> (0x80 | ((code >> 6) & 0x3F));
+                scratch += static_cast<char> (0x80 | (code & 0x3F));
+            }
+            return true;
+        }
+
+        static bool digit(const char* at, const char* end) {
+            return at < end && *at >= '0' && *at <= '9';
+        }
+
+        /*
+         * Integers are pushed with lua_pushinteger and everything else with lua_pushnumber, as jansson would have
+         * typed them. Like jansson, integers that overflow and reals that are out of range are errors.
+         */
+        bool number() {
+            const char* start = p;
+            bool real = false;
+            if (*p == '-')
+                ++p;
+            if (!digit(p, end))
+                return false;
+            if (*p == '0') {
+                ++p;
+            } else {
+                while (digit(p, end))
+                    ++p;
+            }
+            if (p < end && *p == '.') {
+                real = true;
+                ++p;
+                if (!digit(p, end))
+                    return false;
+                while (digit(p, end))
+                    ++p;
+            }
+            if (p < end && (*p == 'e' || *p == 'E')) {
+                real = true;
+                ++p;
+                if (p < end && (*p == '+' || *p == '-'))
+                    ++p;
+                if (!digit(p, end))
+                    return false;
+                while (digit(p, end))
+                    ++p;
+            }
+
+            // The input isn't terminated, so strtoll and strtod get a copy.
+            scratch.assign(start, p - start);
+            errno = 0;
+            if (real) {
+                double number = strtod(scratch.c_str(), 0);
+                if (errno == ERANGE && isinf(number))
+                    return false;
+                lua_pushnumber(L, number);
+            } else {
+                long long number = strtoll(scratch.c_str(), 0, 10);
+                if (errno == ERANGE)
+                    return false;
+                lua_pushinteger(L, number);
+            }
+            return true;
+        }
+
+        lua_State* L;
+        const char* p;
+        const char* end;
+        int depth;
+        std::string& scratch;
+    };
+}
+
+namespace {
+
+    /*
+     * Writes Lua values the way luaToJson and json_dumps with JSON_COMPACT would have. Lua strings are C strings to
+     * jansson, so they end at the first zero byte, and ones that aren't valid UTF-8 are written as "". Entries whose
+     * key isn't valid UTF-8, or whose value is a NaN or infinite number, are left out. Keys that only differ after
+     * that, and non-string keys, which all become "", are written once each rather than merged, which parsers read
+     * the same way because the last one wins. Tables nested too deeply to be anything but a cycle become null.
+     */
+    class Encoder {
+    public:
+
+        Encoder(lua_State* L, std::string& output)
+        :
+        L(L),
+        out(output),
+        depth(0) { }
+
+        void table(int index, bool array) {
+            out += array ? '[' : '{';
+            bool first = true;
+            lua_pushnil(L);
+            while (lua_next(L, index)) {
+                const char* key = "";
+                size_t keyLength = 0;
+                if (lua_type(L, -2) == LUA_TSTRING)
+                    key = cString(-2, keyLength);
+                bool valueArray = false;
+                if (lua_type(L, -1) == LUA_TTABLE && keyLength >= 6 && !memcmp(key, "array_", 6)) {
+                    valueArray = true;
+                    key += 6;
+                    keyLength -= 6;
+                }
+                if (!encodable() || (!array && !validUTF8(key, keyLength))) {
+                    lua_pop(L, 1);
+                    continue;
+                }
+                if (!first)
+                    out += ',';
+                first = false;
+                if (!array) {
+                    string(key, keyLength);
+                    out += ':';
+                }
+                value(valueArray);
+                lua_pop(L, 1);
+            }
+            out += array ? ']' : '}';
+        }
+
+    private:
+
+        const char* cString(int index, size_t& length) {
+            const char* value = lua_tolstring(L, index, &length);
+            const char* zero = static_cast<const char*> (memchr(value, 0, length));
+            if (zero)
+                length = zero - value;
+            return value;
+        }
+
+        bool encodable() {
+            if (lua_type(L, -1) != LUA_TNUMBER)
+                return true;
+            return isfinite(lua_tonumber(L, -1));
+        }
+
+        void value(bool array) {
+            switch (lua_type(L, -1)) {
+                case LUA_TBOOLEAN:
+                    if (lua_toboolean(L, -1))
+                        out.append("true", 4);
+                    else
+                        out.append("false", 5);
+                    break;
+                case LUA_TNUMBER:
+                    number(lua_tonumber(L, -1));
+                    break;
+                case LUA_TSTRING: {
+                    size_t length;
+                    const char* value = cString(-1, length);
+                    if (validUTF8(value, length))
+                        string(value, length);
+                    else
+                        out.append("\"\"", 2);
+                    break;
+                }
+                case LUA_TTABLE:
+                    if (depth < JSON_MAX_DEPTH && lua_checkstack(L, 4)) {
+                        ++depth;
+                        table(lua_gettop(L), array);
+                        --depth;
+                    } else {
+                        out.append("null", 4);
+                    }
+                    break;
+                default:
+                    out.append("null", 4);
+                    break;
+            }
+        }
+
+        /*
+         * Every Lua number was a jansson real, written with %.17g and without a trailing ".0". Whole numbers below
+         * 10^15 come out of %.17g as plain digits, so those skip snprintf.
+         */
+        void number(double value) {
+            char buffer[32];
+            if (value == floor(value) && fabs(value) < 1e15 && !(value == 0 && signbit(value))) {
+                long long whole = static_cast<long long> (value);
+                unsigned long long digits = whole < 0 ? -static_cast<unsigned long long> (whole) : whole;
+                char* end = buffer + sizeof (buffer);
+                char* start = end;
+                do {
+                    *--start = '0' + digits % 10;
+                    digits /= 10;
+                } while (digits);
+                if (whole < 0)
+                    *--start = '-';
+                out.append(start, end - start);
+            } else {
+                int length = snprintf(buffer, sizeof (buffer), "%.17g", value);
+                char* exponent = static_cast<char*> (memchr(buffer, 'e', length));
+                if (!exponent) {
+                    out.append(buffer, length);
+                    return;
+                }
+                // jansson drops the exponent's plus sign and leading zeros.
+                char* end = buffer + length;
+                char* digits = exponent + 1;
+                if (*digits == '-')
+                    ++digits;
+                char* significant = digits;
+                if (*significant == '+')
+                    ++significant;
+                while (significant + 1 < end && *significant == '0')
+                    ++significant;
+                out.append(buffer, digits - buffer);
+                out.append(significant, end - significant);
+            }
+        }
+
+        void string(const char* value, size_t length) {
+            static const char hex[] = "0123456789ABCDEF";
+            out += '"';
+            const char* run = value;
+            const char* end = value + length;
+            for (const char* p = value; p < end; ++p) {
+                unsigned char c = *p;
+                if (c >= 0x20 && c != '"' && c != '\\')
+                    continue;
+                out.append(run, p - run);
+                run = p + 1;
+                switch (c) {
+                    case '"':
+                        out.append("\\\"", 2);
+                        break;
+                    case '\\':
+                        out.append("\\\\", 2);
+                        break;
+                    case '\b':
+                        out.append("\\b", 2);
+                        break;
+                    case '\f':
+                        out.append("\\f", 2);
+                        break;
+                    case '\n':
+                        out.append("\\n", 2);
+                        break;
+                    case '\r':
+                        out.append("\\r", 2);
+                        break;
+                    case '\t':
+                        out.append("\\t", 2);
+                        break;
+                    default: {
+                        char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+                        out.append(escaped, 6);
+                        break;
+                    }
+                }
+            }
+            out.append(run, end - run);
+            out += '"';
+        }
+
+        lua_State* L;
+        std::string& out;
+        int depth;
+    };
+}
+
+bool LuaJSON::decode(lua_State* L, const char* json, size_t length) {
+    static thread_local std::string scratch;
+    int top = lua_gettop(L);
+    Decoder decoder(L, json, length, scratch);
+    if (!decoder.document()) {
+        lua_settop(L, top);
+        return false;
+    }
+    return true;
+}
+
+void LuaJSON::encode(lua_State* L, int index, std::string& output) {
+    if (lua_type(L, index) != LUA_TTABLE) {
+        output.append("{}", 2);
+        return;
+    }
+    Encoder encoder(L, output);
+    encoder.table(LUA_ABSINDEX(L, index), false);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LUA_JSON_H
+#define LUA_JSON_H
+
+#include <stddef.h>
+#include <string>
+#include "flua.hpp"
+
+/**
+ * Converts between JSON and Lua tables directly, without building a jansson tree in between.
+ *
+ * decode matches LuaChat::jsonToLua on the tree json_loads would have made: arrays nested in objects are stored
+ * under "array_" followed by their key, nulls are left out, and a top level array becomes an empty table. Input that
+ * json_loads would reject, including invalid UTF-8 and \u0000, is rejected too.
+ *
+ * encode writes what json_dumps would have made of LuaChat::luaToJson's tree, so tables under "array_" keys become
+ * arrays and numbers are written without a trailing ".0".
+ */
+class LuaJSON {
+public:
+    // Pushes the table and returns true, or returns false with the stack unchanged.
+    static bool decode(lua_State* L, const char* json, size_t length);
+    // Appends the table at index as compact JSON. Anything other than a table is written as an empty object.
+    static void encode(lua_State* L, int index, std::string& output);
+private:
+
+    LuaJSON() { }
+
+    ~LuaJSON() { }
+};
+
+#endif //LUA_JSON_H
@@ -29,6 +29,9 @@
 #include "lua_constants.hpp"
 #include "server_state.hpp"
 #include "server.hpp"
+#include "native_command.hpp"
+#include "lua_json.hpp"
+#include "presence.hpp"
 
 #define LUATESTING_MODULE_NAME "testing"
 
@@ -38,6 +41,11 @@ static const luaL_Reg luatesting_funcs[] = {
         {"createConnection", LuaTesting::createConnection},
         {"removeConnection", LuaTesting::removeConnection},
         {"killChannel",      LuaTesting::killChannel},
+        {"runNative",        LuaTesting::runNative},
+        {"resetTimers",      LuaTesting::resetTimers},
+        {"setPolicyHooks",   LuaTesting::setPolicyHooks},
+        {"takeSent",         LuaTesting::takeSent},
+        {"setPresenceTick",  LuaTesting::setPresenceTick},
         {NULL, NULL}
 };
 
@@ -77,11 +85,23 @@ int LuaTesting::runTests(lua_State* L) {
     return 0;
 }
 
+/**
+ * Creates an identified connection without a socket.
+ * @param string character name
+ * @param boolean? true to queue what is sent to it, for takeSent
+ * @returns [LUD] connection
+ */
 int LuaTesting::createConnection(lua_State* L) {
     luaL_checkany(L, 1);
 
     string charName = luaL_checkstring(L, 1);
-    lua_pop(L, 1);
+    bool open = false;
+    if (lua_gettop(L) == 2) {
+        open = lua_toboolean(L, 2);
+        lua_pop(L, 2);
+    } else {
+        lua_pop(L, 1);
+    }
 
     auto con = new ConnectionInstance();
     con->characterName = charName;
@@ -89,7 +109,7 @@ int LuaTesting::createConnection(lua_State* L) {
     con->identified = true;
     con->accountID = 1;
     con->characterID = 2;
-    con->closed = true;
+    con->closed = !open;
     auto conPtr = ConnectionPtr(con);
     ServerState::addConnection(charName, conPtr);
 
@@ -102,6 +122,9 @@ int LuaTesting::removeConnection(lua_State* L) {
 
     string charName = luaL_checkstring(L, 1);
     lua_pop(L, 1);
+    ConnectionPtr con = ServerState::getConnection(charName);
+    if (con)
+        con->closed = true;
     ServerState::removeConnection(charName);
 
     return 0;
@@ -114,12 +137,134 @@ int LuaTesting::killChannel(lua_State* L) {
     lua_pop(L, 1);
     ChannelPtr chan = ServerState::getChannel(chanName);
     if (chan) {
-        const chconlist_t particpants = chan->getParticipants();
-        for (chconlist_t::const_iterator i = particpants.begin(); i != particpants.end(); ++i) {
-            chan->part(*i);
+        const chmemberlist_t members = chan->getMembers();
+        for (chmemberlist_t::const_iterator i = members.begin(); i != members.end(); ++i) {
+            chan->part(i->connection);
         }
         ServerState::removeChannel(chanName);
     }
 
+    return 0;
+}
+
+/**
+ * Runs a command through its NativeCommand handler, as Server::dispatchMessage would with native_commands enabled.
+ * @param LUD connection
+ * @param string command
+ * @param table arguments
+ * @returns [number] error code
+ */
+int LuaTesting::runNative(lua_State* L) {
+    luaL_checkany(L, 3);
+
+    LBase* base = 0;
+    GETLCON(base, L, 1, con);
+    string command = luaL_checkstring(L, 2);
+    string payload;
+    LuaJSON::encode(L, 3, payload);
+    lua_pop(L, 3);
+
+    FReturnCode ret = FERR_OK;
+    switch (CommandTable::find(command.data(), command.length())) {
+        case CMD_MSG:
+            ret = NativeCommand::MessageCommand(con, payload);
+            break;
+        case CMD_LRP:
+            ret = NativeCommand::AdCommand(con, payload);
+            break;
+        case CMD_PRI:
+            ret = NativeCommand::PrivateMessageCommand(con, payload);
+            break;
+        case CMD_TPN:
+            ret = NativeCommand::TypingCommand(con, payload);
+            break;
+        default:
+            return luaL_error(L, "There is no native handler for '%s'.", command.c_str());
+    }
+
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+/**
+ * Clears a connection's flood timers, and unless told not to, its ad timers in every channel.
+ * @param LUD connection
+ * @param boolean? true to leave the ad timers alone
+ */
+int LuaTesting::resetTimers(lua_State* L) {
+    luaL_checkany(L, 1);
+
+    LBase* base = 0;
+    GETLCON(base, L, 1, con);
+    bool keepAdTimers = false;
+    if (lua_gettop(L) == 2) {
+        keepAdTimers = lua_toboolean(L, 2);
+        lua_pop(L, 2);
+    } else {
+        lua_pop(L, 1);
+    }
+
+    con->timers.clear();
+    if (keepAdTimers)
+        return 0;
+    const chanptrmap_t& channels = ServerState::getChannels();
+    for (chanptrmap_t::const_iterator i = channels.begin(); i != channels.end(); ++i) {
+        i->second->setTimerEntry(con, -1);
+    }
+
+    return 0;
+}
+
+/**
+ * Overrides native_policy_hooks.
+ * @param boolean call policy hooks for blacklisted messages
+ * @param boolean call policy hooks for hellbanned characters
+ */
+int LuaTesting::setPolicyHooks(lua_State* L) {
+    luaL_checkany(L, 2);
+
+    NativeCommand::blacklistHook = lua_toboolean(L, 1);
+    NativeCommand::hellbanHook = lua_toboolean(L, 2);
+    lua_pop(L, 2);
+
+    return 0;
+}
+
+/**
+ * Empties the queue of a connection made with createConnection(name, true).
+ * @param LUD connection
+ * @returns [table] the command of each queued frame, in the order they would be written
+ */
+int LuaTesting::takeSent(lua_State* L) {
+    luaL_checkany(L, 1);
+
+    LBase* base = 0;
+    GETLCON(base, L, 1, con);
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    int n = 1;
+    while (!con->writeQueue.empty()) {
+        const MessageBuffer* frame = con->writeQueue.front().get();
+        size_t length = frame->length() - (frame->payload() - frame->buffer());
+        lua_pushlstring(L, reinterpret_cast<const char*> (frame->payload()), length < 3 ? length : 3);
+        lua_rawseti(L, -2, n++);
+        con->popWriteQueue();
+    }
+    return 1;
+}
+
+/**
+ * Overrides presence_tick. Changing it to 0 sends what was collected.
+ * @param number seconds
+ */
+int LuaTesting::setPresenceTick(lua_State* L) {
+    luaL_checkany(L, 1);
+
+    Presence::tick = luaL_checknumber(L, 1);
+    lua_pop(L, 1);
+    if (!Presence::coalescing())
+        Presence::flush();
+
     return 0;
 }
\ No newline at end of file
@@ -41,4 +41,14 @@ public:
     static int removeConnection(lua_State* L);
 
     static int killChannel(lua_State* L);
+
+    static int runNative(lua_State* L);
+
+    static int resetTimers(lua_State* L);
+
+    static int setPolicyHooks(lua_State* L);
+
+    static int takeSent(lua_State* L);
+
+    static int setPresenceTick(lua_State* L);
 };
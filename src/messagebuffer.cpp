@@ -27,12 +27,219 @@
 
 #include "messagebuffer.hpp"
 #include "websocket.hpp"
+#include "websocket_deflate.hpp"
+#include "fjson.hpp"
+#include "lua_json.hpp"
+#include "logging.hpp"
+#include <string.h>
+#include <new>
 
 
-MessageBuffer* MessageBuffer::fromString(string& message) {
-    string buffer;
-    Websocket::Hybi::sendText(message, buffer);
-    MessageBuffer* messageBuffer = new MessageBuffer();
-    messageBuffer->set(buffer.data(), buffer.length());
+MessageBuffer* MessageBuffer::allocate(size_t length) {
+    void* storage = ::operator new(sizeof (MessageBuffer) + length);
+    return new(storage) MessageBuffer(length);
+}
+
+MessageBuffer::~MessageBuffer() {
+    if (deflated_ && deflated_ != this)
+        intrusive_ptr_release(deflated_);
+    if (fragments_ && fragments_ != this)
+        intrusive_ptr_release(fragments_);
+    if (next_)
+        intrusive_ptr_release(next_);
+}
+
+MessagePriority MessageBuffer::priorityOf(const char* command, size_t length) {
+    static const char* const control[] = {"ERR", "PIN", "IDN", 0};
+    static const char* const direct[] = {"PRI", "TPN", "SYS", "BRO", "RTB", "SFC", "ZZZ", 0};
+    static const char* const bulk[] = {"LIS", "NLN", "FLN", "STA", "PRS", "FRL", "IGN", "ADL", "CHA", "ORS", "CDS", "KID",
+                                       "PRD", "FKS", 0};
+    if (length < 3)
+        return PRIORITY_CHANNEL;
+    for (int i = 0; control[i]; ++i) {
+        if (!memcmp(command, control[i], 3))
+            return PRIORITY_CONTROL;
+    }
+    for (int i = 0; direct[i]; ++i) {
+        if (!memcmp(command, direct[i], 3))
+            return PRIORITY_DIRECT;
+    }
+    for (int i = 0; bulk[i]; ++i) {
+        if (!memcmp(command, bulk[i], 3))
+            return PRIORITY_BULK;
+    }
+    return PRIORITY_CHANNEL;
+}
+
+bool MessageBuffer::presenceOf(const char* command, size_t length) {
+    static const char* const presence[] = {"NLN", "FLN", "STA", "PRS", 0};
+    if (length < 3)
+        return false;
+    for (int i = 0; presence[i]; ++i) {
+        if (!memcmp(command, presence[i], 3))
+            return true;
+    }
+    return false;
+}
+
+MessageBuffer* MessageBuffer::fromText(const char* prefix, size_t prefixLength, const char* text, size_t textLength) {
+    size_t payloadLength = prefixLength + textLength;
+    size_t headerLength = Websocket::Hybi::frameHeaderSize(payloadLength);
+    MessageBuffer* messageBuffer = allocate(headerLength + payloadLength);
+    uint8_t* out = messageBuffer->data();
+    Websocket::Hybi::writeTextHeader(payloadLength, out);
+    messageBuffer->headerLength_ = headerLength;
+    if (prefixLength) {
+        messageBuffer->priority_ = priorityOf(prefix, prefixLength);
+        messageBuffer->presence_ = presenceOf(prefix, prefixLength);
+    } else {
+        messageBuffer->priority_ = priorityOf(text, textLength);
+        messageBuffer->presence_ = presenceOf(text, textLength);
+    }
+    out += headerLength;
+    if (prefixLength)
+        memcpy(out, prefix, prefixLength);
+    if (textLength)
+        memcpy(out + prefixLength, text, textLength);
+    return messageBuffer;
+}
+
+MessageBuffer* MessageBuffer::fromString(const string& message) {
+    return fromText(0, 0, message.data(), message.length());
+}
+
+static int dumpToString(const char* buffer, size_t size, void* data) {
+    static_cast<string*> (data)->append(buffer, size);
+    return 0;
+}
+
+/**
+ * The length of the dump isn't known until it is finished, so it is written into a scratch buffer that keeps its
+ * capacity between calls, and then copied once into the exactly sized frame.
+ */
+MessageBuffer* MessageBuffer::fromJSON(const char* prefix, const json_t* json) {
+    static thread_local string scratch;
+    scratch.clear();
+    scratch.append(prefix);
+    scratch.push_back(' ');
+    if (json_dump_callback(json, dumpToString, &scratch, JSON_COMPACT) != 0) {
+        LOG(WARNING) << "Failed to serialize a " << prefix << " message.";
+    }
+    MessageBuffer* messageBuffer = fromText(0, 0, scratch.data(), scratch.length());
+    if (!strcmp(prefix, "STA"))
+        messageBuffer->supersedeBy(prefix, json_string_value(json_object_get(json, "character")));
+    return messageBuffer;
+}
+
+/**
+ * Like fromJSON, but the table is written out as it is walked instead of being converted to a jansson tree first.
+ */
+MessageBuffer* MessageBuffer::fromLua(const char* prefix, lua_State* L, int index) {
+    static thread_local string scratch;
+    scratch.clear();
+    scratch.append(prefix);
+    scratch.push_back(' ');
+    LuaJSON::encode(L, index, scratch);
+    MessageBuffer* messageBuffer = fromText(0, 0, scratch.data(), scratch.length());
+    if (!strcmp(prefix, "STA") && lua_type(L, index) == LUA_TTABLE) {
+        lua_getfield(L, index, "character");
+        if (lua_type(L, -1) == LUA_TSTRING)
+            messageBuffer->supersedeBy(prefix, lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    return messageBuffer;
+}
+
+// Status changes replace the character's previous status.
+void MessageBuffer::supersedeBy(const char* prefix, const char* character) {
+    if (!character)
+        return;
+    static thread_local string key;
+    static std::tr1::hash<string> hasher;
+    key.assign(prefix);
+    key.append(character);
+    supersedeKey_ = hasher(key) | 1;
+}
+
+MessageBuffer* MessageBuffer::fromRaw(const char* data, size_t length) {
+    MessageBuffer* messageBuffer = allocate(length);
+    memcpy(messageBuffer->data(), data, length);
     return messageBuffer;
 }
+
+MessageBuffer* MessageBuffer::fromHandshake(const char* acceptKey, const string& extensions) {
+    MessageBuffer* messageBuffer = allocate(Websocket::Hybi::handshakeResponseSize(extensions.length()));
+    Websocket::Hybi::writeHandshakeResponse(acceptKey, extensions, messageBuffer->data());
+    return messageBuffer;
+}
+
+/**
+ * Broadcasts may be sent from more than one thread, so the first compressed result to be stored wins and the others
+ * are thrown away.
+ */
+MessageBuffer* MessageBuffer::deflated() {
+    MessageBuffer* current = __atomic_load_n(&deflated_, __ATOMIC_ACQUIRE);
+    if (current)
+        return current;
+    if (!headerLength_)
+        return this;
+
+    static thread_local string compressed;
+    MessageBuffer* result = this;
+    size_t payloadLength = length_ - headerLength_;
+    if (Websocket::Deflate::compress(buffer() + headerLength_, payloadLength, compressed) &&
+        compressed.length() < payloadLength) {
+        size_t headerLength = Websocket::Hybi::frameHeaderSize(compressed.length());
+        result = allocate(headerLength + compressed.length());
+        Websocket::Hybi::writeTextHeader(compressed.length(), result->data(), true);
+        memcpy(result->data() + headerLength, compressed.data(), compressed.length());
+        result->headerLength_ = headerLength;
+        result->supersedeKey_ = supersedeKey_;
+        result->priority_ = priority_;
+        result->presence_ = presence_;
+        intrusive_ptr_add_ref(result);
+    }
+
+    if (!__sync_bool_compare_and_swap(&deflated_, 0, result)) {
+        if (result != this)
+            intrusive_ptr_release(result);
+    }
+    return deflated_;
+}
+
+/**
+ * Like deflated(), the first chain to be stored wins. Each fragment holds a reference on the next, and this buffer
+ * holds one on the first.
+ */
+MessageBuffer* MessageBuffer::fragmented(size_t size) {
+    MessageBuffer* current = __atomic_load_n(&fragments_, __ATOMIC_ACQUIRE);
+    if (current)
+        return current;
+    size_t payloadLength = length_ - headerLength_;
+    if (!headerLength_ || payloadLength <= size)
+        return this;
+
+    bool compressed = Websocket::Hybi::isCompressed(buffer());
+    const uint8_t* payload = buffer() + headerLength_;
+    MessageBuffer* head = 0;
+    MessageBuffer** tail = &head;
+    for (size_t offset = 0; offset < payloadLength; offset += size) {
+        size_t chunk = payloadLength - offset < size ? payloadLength - offset : size;
+        size_t headerLength = Websocket::Hybi::frameHeaderSize(chunk);
+        bool final = offset + chunk == payloadLength;
+        MessageBuffer* fragment = allocate(headerLength + chunk);
+        Websocket::Hybi::writeFragmentHeader(chunk, offset == 0, final, compressed, fragment->data());
+        memcpy(fragment->data() + headerLength, payload + offset, chunk);
+        fragment->headerLength_ = headerLength;
+        fragment->priority_ = priority_;
+        fragment->presence_ = presence_;
+        fragment->final_ = final;
+        intrusive_ptr_add_ref(fragment);
+        *tail = fragment;
+        tail = &fragment->next_;
+    }
+
+    if (!__sync_bool_compare_and_swap(&fragments_, 0, head))
+        intrusive_ptr_release(head);
+    return fragments_;
+}
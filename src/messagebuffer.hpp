@@ -27,62 +27,151 @@
 #define	MESSAGEBUFFER_HPP
 
 #include <stddef.h>
+#include <stdint.h>
 #include <boost/intrusive_ptr.hpp>
 #include <string>
 
 using std::string;
 using boost::intrusive_ptr;
 
-class StreamedList;
+struct json_t;
+struct lua_State;
 
+/**
+ * Outgoing frames are queued in this order. Frames only overtake less urgent ones, so each class stays in order, and
+ * character lists and presence changes share a class so that neither can get ahead of the other. Presence changes
+ * are also never overtaken by anything but control frames; see MessageBuffer::presence().
+ */
+enum MessagePriority {
+    PRIORITY_CONTROL, // Errors, pings, and websocket control frames.
+    PRIORITY_DIRECT, // Private messages and system messages.
+    PRIORITY_CHANNEL,
+    PRIORITY_BULK, // Lists and presence.
+    PRIORITY_COUNT
+};
+
+/**
+ * A complete outgoing frame. The object and its bytes share a single allocation sized exactly for the frame, so a
+ * broadcast costs one allocation no matter how many connections it is queued on.
+ */
 class MessageBuffer {
 public:
+    // Text frame containing message.
+    static MessageBuffer* fromString(const string& message);
+    // Text frame containing "<prefix> <json>".
+    static MessageBuffer* fromJSON(const char* prefix, const json_t* json);
+    // Text frame containing "<prefix> <json>", with the JSON written straight from the Lua table at index.
+    static MessageBuffer* fromLua(const char* prefix, lua_State* L, int index);
+    // Bytes that are already framed, or that belong to the handshake.
+    static MessageBuffer* fromRaw(const char* data, size_t length);
+    // The 101 response to a websocket upgrade request.
+    static MessageBuffer* fromHandshake(const char* acceptKey, const string& extensions);
 
-    MessageBuffer()
-    :
-    length_(0),
-    buffer_(0),
-    refCount(0) { }
+    const size_t length() const {
+        return length_;
+    }
+    const uint8_t* buffer() const {
+        return reinterpret_cast<const uint8_t*> (this + 1);
+    }
+    // The frame without its websocket header.
+    const uint8_t* payload() const {
+        return buffer() + headerLength_;
+    }
 
-    ~MessageBuffer() {
-        if (buffer_) {
-            delete[] buffer_;
-        }
+    MessagePriority priority() const {
+        return priority_;
     }
 
-    inline void set(const char* source, size_t inLength) {
-        if (buffer_) {
-            delete[] buffer_;
-            buffer_ = 0;
-        }
-        buffer_ = new uint8_t[inLength];
-        memcpy(buffer_, source, inLength);
-        length_ = inLength;
+    // NLN, FLN, STA and PRS frames. Messages, channel joins and private messages queued after one of them can be from
+    // the character it announces, so only control frames may overtake it.
+    bool presence() const {
+        return presence_;
     }
 
-    static MessageBuffer* fromString(string& message);
-    
-    const size_t length() const {
-        return length_;
+    // Raw buffers are already framed, and are websocket control frames or the handshake.
+    bool raw() const {
+        return !headerLength_;
     }
-    const uint8_t* buffer() const {
-        return buffer_;
+
+    // False for all but the last fragment of a message.
+    bool final() const {
+        return final_;
     }
+
+    // The next fragment of the same message.
+    MessageBuffer* next() const {
+        return next_;
+    }
+
+    // Non-zero for frames made stale by any later frame with the same key, such as a character's status. A connection
+    // that is behind on writes only needs to send the newest of them.
+    uint64_t supersedeKey() const {
+        return supersedeKey_;
+    }
+
+    // The permessage-deflate form of this frame, compressed the first time it is asked for and then shared by every
+    // connection that negotiated the extension. Raw buffers and frames that don't shrink are returned unchanged.
+    MessageBuffer* deflated();
+
+    // The first of a chain of continuation frames carrying this frame's payload in pieces of at most size bytes.
+    // Built once and shared like deflated(). Frames that are small enough are returned unchanged.
+    MessageBuffer* fragmented(size_t size);
 private:
+
+    MessageBuffer(size_t length)
+    :
+    length_(length),
+    headerLength_(0),
+    supersedeKey_(0),
+    priority_(PRIORITY_CONTROL),
+    presence_(false),
+    final_(true),
+    deflated_(0),
+    fragments_(0),
+    next_(0),
+    refCount(0) { }
+
+    ~MessageBuffer();
+
+    MessageBuffer(const MessageBuffer&) = delete;
+    MessageBuffer& operator=(const MessageBuffer&) = delete;
+
+    static MessageBuffer* allocate(size_t length);
+    static MessagePriority priorityOf(const char* command, size_t length);
+    static bool presenceOf(const char* command, size_t length);
+    static MessageBuffer* fromText(const char* prefix, size_t prefixLength, const char* text, size_t textLength);
+    void supersedeBy(const char* prefix, const char* character);
+
+    static void operator delete(void* p) {
+        ::operator delete(p);
+    }
+
+    uint8_t* data() {
+        return reinterpret_cast<uint8_t*> (this + 1);
+    }
+
     size_t length_;
-    uint8_t* buffer_;
-    //StreamedList* list;
+    // Zero for raw buffers.
+    size_t headerLength_;
+    uint64_t supersedeKey_;
+    MessagePriority priority_;
+    bool presence_;
+    bool final_;
+    MessageBuffer* deflated_;
+    MessageBuffer* fragments_;
+    MessageBuffer* next_;
 
-    volatile size_t refCount;
+    // Broadcast buffers are shared between reactor threads.
+    int refCount;
 
     friend inline void intrusive_ptr_release(MessageBuffer* p) {
-        if ((--p->refCount) <= 0) {
+        if (__sync_sub_and_fetch(&p->refCount, 1) <= 0) {
             delete p;
         }
     }
 
     friend inline void intrusive_ptr_add_ref(MessageBuffer* p) {
-        ++p->refCount;
+        __sync_fetch_and_add(&p->refCount, 1);
     }
 };
 
@@ -33,9 +33,23 @@
 #include "server.hpp"
 #include "startup_config.hpp"
 #include "server_state.hpp"
+#include "channel.hpp"
+#include "logger_thread.hpp"
+#include "lua_chat.hpp"
+#include "unicode_tools.hpp"
 
 #include <google/profiler.h>
 
+bool NativeCommand::nativeCommands[CMD_COUNT];
+vector<string> NativeCommand::blacklist;
+bool NativeCommand::blacklistHook = false;
+bool NativeCommand::hellbanHook = false;
+double NativeCommand::messageMax = 0;
+double NativeCommand::privateMax = 0;
+double NativeCommand::adMax = 0;
+double NativeCommand::messageFlood = 0;
+double NativeCommand::adFlood = 0;
+
 FReturnCode NativeCommand::DebugCommand(ConnectionPtr& con, string& payload) {
     if (con->admin != true)
         return FERR_NOT_ADMIN;
@@ -87,6 +101,12 @@ FReturnCode NativeCommand::DebugCommand(ConnectionPtr& con, string& payload) {
         string statusmessage = "Status: ";
         if (con->debugL)
             statusmessage += "Running isolated. ";
+        unsigned long long writeCalls = con->statWriteCalls;
+        unsigned long long writeFrames = con->statWriteFrames;
+        char writebuffer[128];
+        snprintf(&writebuffer[0], sizeof(writebuffer), "Sent %llu frames in %llu writes (%.2f per write). ",
+                 writeFrames, writeCalls, writeCalls ? (double) writeFrames / writeCalls : 0.);
+        statusmessage += &writebuffer[0];
         //statusmessage += "Connected from: ";
         con->sendDebugReply(statusmessage);
     } else if (command == "reload") {
@@ -198,6 +218,9 @@ FReturnCode NativeCommand::IdentCommand(ConnectionPtr& con, string& payload) {
         if(!json_is_string(tempnode))
             goto fail;
         request->clientVersion = json_string_value(tempnode);
+        tempnode = json_object_get(topnode, "presence");
+        if (json_is_string(tempnode) && !strcmp(json_string_value(tempnode), "batch"))
+            con->batchPresence = true;
         tempnode = nullptr;
     } else {
         json_decref(topnode);
@@ -278,7 +301,7 @@ FReturnCode NativeCommand::SearchCommand(intrusive_ptr< ConnectionInstance >& co
 
     typedef unordered_set<ConnectionPtr> clist_t;
     clist_t tosearch;
-    const conptrmap_t cons = ServerState::getConnections();
+    const conptrmap_t& cons = ServerState::getConnections();
     for (conptrmap_t::const_iterator i = cons.begin(); i != cons.end(); ++i) {
         if ((i->second != con) && (i->second->kinkList.size() != 0) && (i->second->status == "online" || i->second->status == "looking"))
             tosearch.insert(i->second);
@@ -336,14 +359,229 @@ FReturnCode NativeCommand::SearchCommand(intrusive_ptr< ConnectionInstance >& co
     }
     json_object_set_new_nocheck(newroot, "characters", chararray);
     json_object_set_new_nocheck(newroot, "kinks", kinksnode);
-    string message("FKS ");
-    const char* fksstr = json_dumps(newroot, JSON_COMPACT);
-    message += fksstr;
-    free((void*) fksstr);
+    MessagePtr outMessage(MessageBuffer::fromJSON("FKS", newroot));
     json_decref(newroot);
-    MessagePtr outMessage(MessageBuffer::fromString(message));
     con->send(outMessage);
     json_decref(rootnode);
     //DLOG(INFO) << "Finished search.";
     return FERR_OK;
 }
+
+void NativeCommand::configure() {
+    for (int i = 0; i < CMD_COUNT; ++i)
+        nativeCommands[i] = false;
+    vector<string> commands;
+    StartupConfig::getStringList("native_commands", commands);
+    for (vector<string>::const_iterator i = commands.begin(); i != commands.end(); ++i) {
+        CommandId id = CommandTable::find(i->data(), i->length());
+        if (id == CMD_MSG || id == CMD_LRP || id == CMD_PRI || id == CMD_TPN)
+            nativeCommands[id] = true;
+        else
+            LOG(WARNING) << "There is no native handler for '" << *i << "', it will be handled by Lua.";
+    }
+
+    blacklistHook = false;
+    hellbanHook = false;
+    vector<string> hooks;
+    StartupConfig::getStringList("native_policy_hooks", hooks);
+    for (vector<string>::const_iterator i = hooks.begin(); i != hooks.end(); ++i) {
+        if (*i == "blacklist")
+            blacklistHook = true;
+        else if (*i == "hellban")
+            hellbanHook = true;
+        else
+            LOG(WARNING) << "Unknown native policy hook condition '" << *i << "'.";
+    }
+
+    blacklist.clear();
+    StartupConfig::getStringList("blacklist_phrases", blacklist);
+    messageMax = StartupConfig::getDouble("msg_max");
+    privateMax = StartupConfig::getDouble("priv_max");
+    adMax = StartupConfig::getDouble("lfrp_max");
+    messageFlood = StartupConfig::getDouble("msg_flood");
+    adFlood = StartupConfig::getDouble("lfrp_flood");
+}
+
+static string lowerName(const char* name) {
+    string lower(name);
+    for (string::iterator i = lower.begin(); i != lower.end(); ++i)
+        *i = tolower(*i);
+    return lower;
+}
+
+static json_t* escapedMessage(const char* message) {
+    string escaped;
+    if (UnicodeTools::escapeHTML(message, strlen(message), escaped))
+        message = escaped.c_str();
+    json_t* node = json_string(message);
+    if (!node)
+        node = json_string_nocheck("");
+    return node;
+}
+
+// The "msg" timer shared by MSG, LRP and PRI, as u.checkUpdateTimer keeps it.
+bool NativeCommand::throttled(ConnectionPtr& con) {
+    static string timerName("msg");
+    double time = Server::getEventTime();
+    double& timer = con->timers[timerName];
+    if (timer > (time - messageFlood))
+        return true;
+    timer = time;
+    return false;
+}
+
+// The channel's LRP timer, as c.checkUpdateTimer keeps it.
+static bool channelThrottled(ChannelPtr& chan, ConnectionPtr& con, double timeout) {
+    double time = Server::getEventTime();
+    if (chan->getTimerEntry(con) > (time - timeout))
+        return true;
+    chan->setTimerEntry(con, time);
+    return false;
+}
+
+/**
+ * Checks the message against the blacklist and the sender against hellbans. Either one silently drops the message,
+ * unless its policy hook is enabled.
+ */
+FReturnCode NativeCommand::filter(ConnectionPtr& con, CommandId id, const char* message, string& payload, bool& drop) {
+    static string hellban("hellban");
+    drop = true;
+    if (id != CMD_PRI) {
+        for (vector<string>::const_iterator i = blacklist.begin(); i != blacklist.end(); ++i) {
+            if (strstr(message, i->c_str()))
+                return blacklistHook ? Server::runLuaPolicy(con.get(), id, "blacklist", payload) : FERR_OK;
+        }
+    }
+    if (con->miscMap.find(hellban) != con->miscMap.end())
+        return hellbanHook ? Server::runLuaPolicy(con.get(), id, "hellban", payload) : FERR_OK;
+    drop = false;
+    return FERR_OK;
+}
+
+FReturnCode NativeCommand::channelMessage(ConnectionPtr& con, string& payload, CommandId id) {
+    json_t* rootnode = json_loads(payload.c_str(), 0, 0);
+    if (!rootnode)
+        return FERR_BAD_SYNTAX;
+    const char* channelName = json_string_value(json_object_get(rootnode, "channel"));
+    const char* message = json_string_value(json_object_get(rootnode, "message"));
+    if (!channelName || !message) {
+        json_decref(rootnode);
+        return FERR_BAD_SYNTAX;
+    }
+
+    FReturnCode ret = FERR_OK;
+    bool ad = id == CMD_LRP;
+    double length = strlen(message);
+    string lowerChannel = lowerName(channelName);
+    ChannelPtr chan;
+    bool drop = false;
+    if (throttled(con)) {
+        ret = FERR_THROTTLE_MESSAGE;
+    } else if (!(chan = ServerState::getChannel(lowerChannel))) {
+        ret = FERR_CHANNEL_NOT_FOUND;
+    } else if (ad && chan->getMode() == CMM_CHAT_ONLY) {
+        ret = FERR_CHAT_ONLY;
+    } else if (!ad && chan->getMode() == CMM_ADS_ONLY) {
+        ret = FERR_ADS_ONLY;
+    } else if (ad && channelThrottled(chan, con, adFlood)) {
+        ret = FERR_THROTTLE_AD;
+    } else if (ad ? length > adMax : (length > messageMax ||
+            (chan->getType() != CT_PUBLIC && length > privateMax))) {
+        ret = FERR_MESSAGE_TOO_LONG;
+    } else if (!chan->inChannel(con)) {
+        ret = FERR_NOT_IN_CHANNEL;
+    } else {
+        ret = filter(con, id, message, payload, drop);
+    }
+
+    if (ret == FERR_OK && !drop) {
+        LuaChat::addLogEntry(ad ? "message_ad" : "message", con.get(), chan.get(), 0, string(), message);
+        json_t* outnode = json_object();
+        json_object_set_new_nocheck(outnode, "channel", json_string_nocheck(chan->getName().c_str()));
+        json_object_set_new_nocheck(outnode, "character", json_string_nocheck(con->characterName.c_str()));
+        json_object_set_new_nocheck(outnode, "message", escapedMessage(message));
+        MessagePtr outMessage(MessageBuffer::fromJSON(ad ? "LRP" : "MSG", outnode));
+        json_decref(outnode);
+        chan->sendToChannel(con, outMessage);
+    }
+    json_decref(rootnode);
+    return ret;
+}
+
+FReturnCode NativeCommand::MessageCommand(ConnectionPtr& con, string& payload) {
+    return channelMessage(con, payload, CMD_MSG);
+}
+
+FReturnCode NativeCommand::AdCommand(ConnectionPtr& con, string& payload) {
+    return channelMessage(con, payload, CMD_LRP);
+}
+
+FReturnCode NativeCommand::PrivateMessageCommand(ConnectionPtr& con, string& payload) {
+    json_t* rootnode = json_loads(payload.c_str(), 0, 0);
+    if (!rootnode)
+        return FERR_BAD_SYNTAX;
+    const char* recipient = json_string_value(json_object_get(rootnode, "recipient"));
+    const char* message = json_string_value(json_object_get(rootnode, "message"));
+    if (!recipient || !message) {
+        json_decref(rootnode);
+        return FERR_BAD_SYNTAX;
+    }
+
+    FReturnCode ret = FERR_OK;
+    string lowerRecipient = lowerName(recipient);
+    ConnectionPtr target;
+    bool drop = false;
+    if (throttled(con)) {
+        ret = FERR_THROTTLE_MESSAGE;
+    } else if (strlen(message) > privateMax) {
+        ret = FERR_MESSAGE_TOO_LONG;
+    } else if (!(target = ServerState::getConnection(lowerRecipient))) {
+        ret = FERR_USER_NOT_FOUND;
+    } else {
+        ret = filter(con, CMD_PRI, message, payload, drop);
+    }
+
+    if (ret == FERR_OK && !drop) {
+        LuaChat::addLogEntry("message_private", con.get(), 0, target.get(), string(), message);
+        json_t* outnode = json_object();
+        json_object_set_new_nocheck(outnode, "character", json_string_nocheck(con->characterName.c_str()));
+        json_object_set_new_nocheck(outnode, "message", escapedMessage(message));
+        json_object_set_new_nocheck(outnode, "recipient", json_string_nocheck(recipient));
+        MessagePtr outMessage(MessageBuffer::fromJSON("PRI", outnode));
+        json_decref(outnode);
+        target->send(outMessage);
+    }
+    json_decref(rootnode);
+    return ret;
+}
+
+FReturnCode NativeCommand::TypingCommand(ConnectionPtr& con, string& payload) {
+    json_t* rootnode = json_loads(payload.c_str(), 0, 0);
+    if (!rootnode)
+        return FERR_BAD_SYNTAX;
+    json_t* characternode = json_object_get(rootnode, "character");
+    json_t* statusnode = json_object_get(rootnode, "status");
+    if (!characternode || !statusnode || json_typeof(characternode) == JSON_NULL ||
+        json_typeof(statusnode) == JSON_NULL) {
+        json_decref(rootnode);
+        return FERR_BAD_SYNTAX;
+    }
+
+    // Anything but a known status is ignored.
+    const char* character = json_string_value(characternode);
+    const char* status = json_string_value(statusnode);
+    if (character && status && (!strcmp(status, "clear") || !strcmp(status, "paused") || !strcmp(status, "typing"))) {
+        string lowerCharacter = lowerName(character);
+        ConnectionPtr target = ServerState::getConnection(lowerCharacter);
+        if (target) {
+            json_t* outnode = json_object();
+            json_object_set_new_nocheck(outnode, "character", json_string_nocheck(con->characterName.c_str()));
+            json_object_set_new_nocheck(outnode, "status", json_string_nocheck(status));
+            MessagePtr outMessage(MessageBuffer::fromJSON("TPN", outnode));
+            json_decref(outnode);
+            target->send(outMessage);
+        }
+    }
+    json_decref(rootnode);
+    return FERR_OK;
+}
@@ -28,9 +28,12 @@
 
 #include <boost/intrusive_ptr.hpp>
 #include <string>
+#include <vector>
 #include "ferror.hpp"
+#include "command_table.hpp"
 
 using std::string;
+using std::vector;
 using boost::intrusive_ptr;
 class ConnectionInstance;
 
@@ -39,7 +42,45 @@ public:
     static FReturnCode DebugCommand(intrusive_ptr<ConnectionInstance>& con, string& payload);
     static FReturnCode IdentCommand(intrusive_ptr<ConnectionInstance>& con, string& payload);
     static FReturnCode SearchCommand(intrusive_ptr<ConnectionInstance>& con, string& payload);
+
+    /*
+     * The message commands below do what their handlers in main.lua do, without entering Lua. Each one is only used
+     * for the commands listed in native_commands, and only for connections that aren't running an isolated Lua state.
+     * Messages that hit the blacklist, or that come from a hellbanned character, are dropped like main.lua drops them,
+     * unless the condition is listed in native_policy_hooks. Then policy.<command>(con, args, condition) is called in
+     * Lua, and its return value is the result of the command.
+     */
+    static void configure();
+
+    static bool handles(CommandId id) {
+        return nativeCommands[id];
+    }
+
+    static FReturnCode MessageCommand(intrusive_ptr<ConnectionInstance>& con, string& payload);
+    static FReturnCode AdCommand(intrusive_ptr<ConnectionInstance>& con, string& payload);
+    static FReturnCode PrivateMessageCommand(intrusive_ptr<ConnectionInstance>& con, string& payload);
+    static FReturnCode TypingCommand(intrusive_ptr<ConnectionInstance>& con, string& payload);
 private:
+    friend class LuaTesting;
+
+    NativeCommand() { }
+
+    ~NativeCommand() { }
+
+    static FReturnCode channelMessage(intrusive_ptr<ConnectionInstance>& con, string& payload, CommandId id);
+    static bool throttled(intrusive_ptr<ConnectionInstance>& con);
+    static FReturnCode filter(intrusive_ptr<ConnectionInstance>& con, CommandId id, const char* message,
+                              string& payload, bool& drop);
+
+    static bool nativeCommands[CMD_COUNT];
+    static vector<string> blacklist;
+    static bool blacklistHook;
+    static bool hellbanHook;
+    static double messageMax;
+    static double privateMax;
+    static double adMax;
+    static double messageFlood;
+    static double adFlood;
 };
 
 #endif //NATIVE_EVENT_H
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "precompiled_headers.hpp"
+
+#include <algorithm>
+#include "presence.hpp"
+#include "fjson.hpp"
+#include "logging.hpp"
+#include "server_state.hpp"
+#include "startup_config.hpp"
+
+// Entries per PRS frame, so that a reconnect storm doesn't become a single frame big enough to trip send_queue_max.
+#define PRESENCE_BATCH_ENTRIES 250
+
+double Presence::tick = 0;
+unsigned long long Presence::lastSequence = 0;
+struct ev_loop* Presence::loop = 0;
+ev_timer Presence::timer;
+std::vector<PresenceChange> Presence::changes;
+std::tr1::unordered_map<string, size_t> Presence::pending;
+
+static string lowerName(const string& character) {
+    string lname = character;
+    int size = lname.size();
+    for (int i = 0; i < size; ++i) {
+        lname[i] = (char) tolower(lname[i]);
+    }
+    return lname;
+}
+
+static json_t* statusMessageString(const string& statusMessage) {
+    json_t* node = json_string(statusMessage.c_str());
+    if (!node)
+        node = json_string_nocheck("");
+    return node;
+}
+
+static MessagePtr onlineFrame(const PresenceChange& change) {
+    json_t* root = json_object();
+    json_object_set_new_nocheck(root, "identity", json_string_nocheck(change.character.c_str()));
+    json_object_set_new_nocheck(root, "status", json_string_nocheck("online"));
+    json_object_set_new_nocheck(root, "gender", json_string_nocheck(change.gender.c_str()));
+    MessagePtr message(MessageBuffer::fromJSON("NLN", root));
+    json_decref(root);
+    return message;
+}
+
+static MessagePtr offlineFrame(const PresenceChange& change) {
+    json_t* root = json_object();
+    json_object_set_new_nocheck(root, "character", json_string_nocheck(change.character.c_str()));
+    MessagePtr message(MessageBuffer::fromJSON("FLN", root));
+    json_decref(root);
+    return message;
+}
+
+static MessagePtr statusFrame(const PresenceChange& change) {
+    json_t* root = json_object();
+    json_object_set_new_nocheck(root, "character", json_string_nocheck(change.character.c_str()));
+    json_object_set_new_nocheck(root, "status", json_string_nocheck(change.status.c_str()));
+    json_object_set_new_nocheck(root, "statusmsg", statusMessageString(change.statusMessage));
+    MessagePtr message(MessageBuffer::fromJSON("STA", root));
+    json_decref(root);
+    return message;
+}
+
+/**
+ * Appends the frames a client without batched presence needs to get from the state before a change to the state after.
+ * A character that went offline and came back within the tick only gets its new status.
+ */
+static void appendLegacyMessages(const PresenceChange& change, std::vector<MessagePtr>& messages) {
+    if (!change.online) {
+        if (change.wasOnline)
+            messages.push_back(offlineFrame(change));
+        return;
+    }
+    if (!change.wasOnline) {
+        messages.push_back(onlineFrame(change));
+        if (change.status == "online" && change.statusMessage.empty())
+            return;
+    }
+    messages.push_back(statusFrame(change));
+}
+
+/**
+ * A PRS frame for the changes from begin up to end, or nothing if none of them has an entry.
+ */
+static MessagePtr batchFrame(std::vector<PresenceChange>::const_iterator begin,
+                             std::vector<PresenceChange>::const_iterator end) {
+    json_t* root = 0;
+    for (std::vector<PresenceChange>::const_iterator i = begin; i != end; ++i) {
+        if (!i->online && !i->wasOnline)
+            continue;
+
+        if (!root) {
+            root = json_object();
+            json_object_set_new_nocheck(root, "online", json_array());
+            json_object_set_new_nocheck(root, "offline", json_array());
+            json_object_set_new_nocheck(root, "status", json_array());
+        }
+        if (!i->online) {
+            json_array_append_new(json_object_get(root, "offline"), json_string_nocheck(i->character.c_str()));
+        } else {
+            json_t* entry = json_array();
+            json_array_append_new(entry, json_string_nocheck(i->character.c_str()));
+            if (!i->wasOnline)
+                json_array_append_new(entry, json_string_nocheck(i->gender.c_str()));
+            json_array_append_new(entry, json_string_nocheck(i->status.c_str()));
+            json_array_append_new(entry, statusMessageString(i->statusMessage));
+            json_array_append_new(json_object_get(root, i->wasOnline ? "status" : "online"), entry);
+        }
+    }
+    if (!root)
+        return MessagePtr();
+    MessagePtr message(MessageBuffer::fromJSON("PRS", root));
+    json_decref(root);
+    return message;
+}
+
+static bool bySequence(const PresenceChange& left, const PresenceChange& right) {
+    return left.sequence < right.sequence;
+}
+
+static bool sequenceBefore(unsigned long long sequence, const PresenceChange& change) {
+    return sequence < change.sequence;
+}
+
+void Presence::configure() {
+    tick = StartupConfig::getDouble("presence_tick");
+    if (!coalescing())
+        flush();
+    if (tick > 0)
+        LOG(INFO) << "Coalescing presence changes every " << tick << " seconds.";
+    else
+        LOG(INFO) << "Broadcasting presence changes as they happen.";
+}
+
+void Presence::start(struct ev_loop* eventLoop) {
+    loop = eventLoop;
+    ev_timer_init(&timer, Presence::timerCallback, 0., 0.);
+}
+
+void Presence::stop() {
+    if (!loop)
+        return;
+    ev_timer_stop(loop, &timer);
+    loop = 0;
+    changes.clear();
+    pending.clear();
+}
+
+PresenceChange& Presence::change(const string& character, bool online) {
+    string lname = lowerName(character);
+    std::tr1::unordered_map<string, size_t>::const_iterator i = pending.find(lname);
+    if (i != pending.end()) {
+        changes[i->second].sequence = ++lastSequence;
+        return changes[i->second];
+    }
+
+    if (changes.empty()) {
+        ev_timer_set(&timer, tick, 0.);
+        ev_timer_start(loop, &timer);
+    }
+    pending[lname] = changes.size();
+    changes.push_back(PresenceChange());
+    PresenceChange& change = changes.back();
+    change.character = character;
+    change.wasOnline = online;
+    change.online = online;
+    change.sequence = ++lastSequence;
+    return change;
+}
+
+/**
+ * Only a character that comes back within the tick they went offline in, which clients only see as a status change,
+ * waits for the tick.
+ */
+void Presence::online(const string& character, const string& gender, const string& status) {
+    bool reconnect = coalescing() && pending.find(lowerName(character)) != pending.end();
+    PresenceChange event;
+    event.wasOnline = false;
+    event.sequence = 0;
+    PresenceChange& change = reconnect ? Presence::change(character, false) : event;
+    change.character = character;
+    change.online = true;
+    change.gender = gender;
+    change.status = status;
+    change.statusMessage.clear();
+    if (!coalescing())
+        broadcast(onlineFrame(change));
+    else if (!reconnect)
+        announce(change);
+}
+
+void Presence::offline(const string& character) {
+    PresenceChange event;
+    PresenceChange& change = coalescing() ? Presence::change(character, true) : event;
+    change.online = false;
+    if (!coalescing()) {
+        change.character = character;
+        broadcast(offlineFrame(change));
+    }
+}
+
+void Presence::status(const string& character, const string& status, const string& statusMessage) {
+    PresenceChange event;
+    PresenceChange& change = coalescing() ? Presence::change(character, true) : event;
+    change.character = character;
+    change.status = status;
+    change.statusMessage = statusMessage;
+    if (!coalescing())
+        broadcast(statusFrame(change));
+}
+
+void Presence::broadcast(MessagePtr message) {
+    const conptrmap_t& cons = ServerState::getConnections();
+    for (conptrmap_t::const_iterator i = cons.begin(); i != cons.end(); ++i) {
+        i->second->send(message);
+    }
+}
+
+// Sends a single change to every connection in the form it asked for, outside of the tick.
+void Presence::announce(const PresenceChange& change) {
+    std::vector<MessagePtr> legacy;
+    appendLegacyMessages(change, legacy);
+    std::vector<PresenceChange> single(1, change);
+    MessagePtr batched = batchFrame(single.begin(), single.end());
+
+    const conptrmap_t& cons = ServerState::getConnections();
+    for (conptrmap_t::const_iterator i = cons.begin(); i != cons.end(); ++i) {
+        if (i->second->batchPresence) {
+            i->second->send(batched);
+            continue;
+        }
+        for (std::vector<MessagePtr>::const_iterator m = legacy.begin(); m != legacy.end(); ++m) {
+            i->second->send(*m);
+        }
+    }
+}
+
+void Presence::flush() {
+    if (changes.empty())
+        return;
+    if (loop)
+        ev_timer_stop(loop, &timer);
+
+    // By each character's last change, so what a connection listed during the tick hasn't seen is a suffix.
+    std::vector<PresenceChange> sorted;
+    sorted.swap(changes);
+    pending.clear();
+    std::sort(sorted.begin(), sorted.end(), bySequence);
+
+    std::vector<MessagePtr> legacy;
+    std::vector<size_t> legacyStart; // For each change, its first legacy frame.
+    std::vector<size_t> batchStart; // For each PRS frame, its first change.
+    int entries = 0;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        legacyStart.push_back(legacy.size());
+        appendLegacyMessages(sorted[i], legacy);
+        if (!sorted[i].online && !sorted[i].wasOnline)
+            continue;
+        if (!entries)
+            batchStart.push_back(i);
+        if (++entries == PRESENCE_BATCH_ENTRIES)
+            entries = 0;
+    }
+    legacyStart.push_back(legacy.size());
+    std::vector<MessagePtr> batched;
+    for (size_t b = 0; b < batchStart.size(); ++b) {
+        size_t end = b + 1 < batchStart.size() ? batchStart[b + 1] : sorted.size();
+        batched.push_back(batchFrame(sorted.begin() + batchStart[b], sorted.begin() + end));
+    }
+
+    const conptrmap_t& cons = ServerState::getConnections();
+    for (conptrmap_t::const_iterator i = cons.begin(); i != cons.end(); ++i) {
+        size_t first = std::upper_bound(sorted.begin(), sorted.end(), i->second->presenceListed, sequenceBefore) -
+                sorted.begin();
+        if (!i->second->batchPresence) {
+            for (size_t m = legacyStart[first]; m < legacy.size(); ++m) {
+                i->second->send(legacy[m]);
+            }
+            continue;
+        }
+        for (size_t b = 0; b < batched.size(); ++b) {
+            size_t end = b + 1 < batchStart.size() ? batchStart[b + 1] : sorted.size();
+            if (end <= first)
+                continue;
+            if (batchStart[b] >= first) {
+                i->second->send(batched[b]);
+                continue;
+            }
+            MessagePtr partial = batchFrame(sorted.begin() + first, sorted.begin() + end);
+            if (partial)
+                i->second->send(partial);
+        }
+    }
+}
+
+void Presence::timerCallback(struct ev_loop* loop, ev_timer* w, int revents) {
+    flush();
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FSERV_PRESENCE_H
+#define FSERV_PRESENCE_H
+
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+#include <ev.h>
+#include "messagebuffer.hpp"
+
+using std::string;
+
+struct PresenceChange {
+    string character;
+    string gender;
+    string status;
+    string statusMessage;
+    bool wasOnline; // Before the first change this tick.
+    bool online; // After the last change this tick.
+    unsigned long long sequence; // Of the last change this tick.
+};
+
+/**
+ * Coalesces the NLN, FLN and STA broadcasts.
+ *
+ * Changes are collected for presence_tick seconds and reduced to the net change for each character, so a character
+ * that reconnects or changes status several times within a tick costs one entry instead of a broadcast per event.
+ * A character that wasn't online when the tick started is announced at once instead, since anything they send goes
+ * out straight away and must not reach anyone before their NLN.
+ * Each tick is serialized once and the same frames are queued on every connection: connections that asked for
+ * batched presence in IDN get PRS frames, and all others get the NLN, FLN and STA frames left after reduction.
+ *
+ * A connection sent the character list partway through a tick already has the changes made before that, so flush only
+ * sends it the ones made since. A character changed both before and after is sent whole.
+ *
+ * A tick of zero turns coalescing off and every change is broadcast as it happens, as before.
+ *
+ * Only used from the main loop thread.
+ */
+class Presence {
+public:
+    static void configure();
+    static void start(struct ev_loop* loop);
+    static void stop();
+
+    static void online(const string& character, const string& gender, const string& status);
+    static void offline(const string& character);
+    static void status(const string& character, const string& status, const string& statusMessage);
+
+    static void flush();
+
+    // Numbers the changes within a tick. Compared with ConnectionInstance::presenceListed.
+    static unsigned long long sequence() {
+        return lastSequence;
+    }
+private:
+    friend class LuaTesting;
+
+    Presence() { }
+
+    ~Presence() { }
+
+    static bool coalescing() {
+        return loop && tick > 0;
+    }
+
+    static PresenceChange& change(const string& character, bool online);
+    static void broadcast(MessagePtr message);
+    static void announce(const PresenceChange& change);
+    static void timerCallback(struct ev_loop* loop, ev_timer* w, int revents);
+
+    static double tick;
+    static unsigned long long lastSequence;
+    static struct ev_loop* loop;
+    static ev_timer timer;
+    static std::vector<PresenceChange> changes;
+    static std::tr1::unordered_map<string, size_t> pending; // character name lower, index into changes
+};
+
+#endif //FSERV_PRESENCE_H
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "precompiled_headers.hpp"
+
+#include "reactor.hpp"
+#include "logging.hpp"
+#include "server.hpp"
+#include "uring.hpp"
+#include "timing_wheel.hpp"
+
+thread_local Reactor* Reactor::current = nullptr;
+deque<ReactorEvent> Reactor::eventQueue;
+pthread_mutex_t Reactor::eventMutex = PTHREAD_MUTEX_INITIALIZER;
+
+Reactor::Reactor(unsigned int id)
+:
+reactorID(id),
+doRun(false),
+reactor_loop(nullptr),
+reactor_async(nullptr),
+reactor_listen(nullptr),
+reactor_uring(nullptr),
+reactor_wheel(nullptr),
+reactor_flush(nullptr),
+reactorThread() {
+}
+
+Reactor::~Reactor() {
+}
+
+void Reactor::startThread() {
+    if (doRun) {
+        LOG(WARNING) << "Attempting to start reactor " << reactorID << " while it is already running.";
+        return;
+    }
+    doRun = true;
+
+    // Everything the state thread may touch is created before the thread starts so that commands can be queued as
+    // soon as the first connection is accepted.
+    reactor_loop = ev_loop_new(EVFLAG_AUTO);
+    reactor_async = new ev_async;
+    ev_async_init(reactor_async, Reactor::processQueue);
+    reactor_async->data = this;
+    ev_async_start(reactor_loop, reactor_async);
+    reactor_wheel = new TimingWheel(reactor_loop, Server::connectionWheelCallback);
+    reactor_flush = Server::startFlushStage(reactor_loop);
+
+    int listensock = Server::bindAndListen();
+    if (Server::useUring())
+        reactor_uring = Uring::create(reactor_loop, listensock);
+    if (!reactor_uring)
+        reactor_listen = Server::startListener(reactor_loop, listensock);
+
+    pthread_attr_t reactorAttr;
+    pthread_attr_init(&reactorAttr);
+    pthread_attr_setdetachstate(&reactorAttr, PTHREAD_CREATE_JOINABLE);
+    pthread_create(&reactorThread, &reactorAttr, &Reactor::runThread, this);
+}
+
+void Reactor::stopThread() {
+    DLOG(INFO) << "Stopping reactor " << reactorID << ".";
+    doRun = false;
+    ev_async_send(reactor_loop, reactor_async);
+    pthread_join(reactorThread, 0);
+
+    if (reactor_listen) {
+        close(reactor_listen->fd);
+        Server::stopListener(reactor_loop, reactor_listen);
+        reactor_listen = nullptr;
+    }
+    delete reactor_uring;
+    reactor_uring = nullptr;
+    delete reactor_wheel;
+    reactor_wheel = nullptr;
+    Server::stopFlushStage(reactor_loop, reactor_flush);
+    reactor_flush = nullptr;
+
+    ev_async_stop(reactor_loop, reactor_async);
+    delete reactor_async;
+    reactor_async = nullptr;
+
+    ev_loop_destroy(reactor_loop);
+    reactor_loop = nullptr;
+}
+
+void* Reactor::runThread(void* param) {
+    auto instance = (Reactor*) param;
+    instance->runner();
+    pthread_exit(NULL);
+}
+
+void Reactor::runner() {
+    DLOG(INFO) << "Reactor " << reactorID << ": Starting.";
+    current = this;
+    ev_loop(reactor_loop, 0);
+    current = nullptr;
+    DLOG(INFO) << "Reactor " << reactorID << ": Ending.";
+}
+
+void Reactor::processQueue(struct ev_loop* loop, ev_async* w, int revents) {
+    Reactor* instance = static_cast<Reactor*> (w->data);
+    if (!instance->doRun) {
+        ev_unloop(loop, EVUNLOOP_ONE);
+        return;
+    }
+
+    deque<ReactorCommand> commands;
+    MUT_LOCK(instance->commandMutex);
+    commands.swap(instance->commandQueue);
+    MUT_UNLOCK(instance->commandMutex);
+
+    for (auto& command : commands) {
+        ConnectionPtr& con = command.connection;
+        switch (command.type) {
+            case RCMD_SEND:
+                con->send(command.message);
+                break;
+            case RCMD_SEND_RAW:
+                if (!con->closed)
+                    con->queueMessage(command.message);
+                break;
+            case RCMD_DELAY_CLOSE:
+                con->setDelayClose();
+                break;
+            case RCMD_START_PING:
+                con->startPing();
+                break;
+        }
+    }
+}
+
+void Reactor::addCommand(ReactorCommandType type, ConnectionInstance* connection, MessagePtr message) {
+    ReactorCommand command;
+    command.type = type;
+    command.connection = connection;
+    command.message = message;
+    MUT_LOCK(commandMutex);
+    commandQueue.push_back(command);
+    MUT_UNLOCK(commandMutex);
+    ev_async_send(reactor_loop, reactor_async);
+}
+
+void Reactor::addEvent(ReactorEventType type, ConnectionInstance* connection) {
+    string command;
+    string payload;
+    addEvent(type, connection, command, payload);
+}
+
+void Reactor::addEvent(ReactorEventType type, ConnectionInstance* connection, string& command, string& payload) {
+    MUT_LOCK(eventMutex);
+    eventQueue.push_back(ReactorEvent());
+    ReactorEvent& event = eventQueue.back();
+    event.type = type;
+    event.connection = connection;
+    event.command.swap(command);
+    event.payload.swap(payload);
+    MUT_UNLOCK(eventMutex);
+    Server::sendReactorWakeup();
+}
+
+void Reactor::getEvents(deque<ReactorEvent>& events) {
+    MUT_LOCK(eventMutex);
+    events.swap(eventQueue);
+    MUT_UNLOCK(eventMutex);
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FSERV_REACTOR_H
+#define FSERV_REACTOR_H
+
+#include <string>
+#include <deque>
+#include <atomic>
+#include <ev.h>
+#include "fthread.hpp"
+#include "connection.hpp"
+#include "messagebuffer.hpp"
+
+class Uring;
+class TimingWheel;
+
+using std::string;
+using std::deque;
+
+/**
+ * Work handed from the state thread to the reactor that owns a connection.
+ */
+enum ReactorCommandType {
+    RCMD_SEND,
+    RCMD_SEND_RAW,
+    RCMD_DELAY_CLOSE,
+    RCMD_START_PING
+};
+
+struct ReactorCommand {
+    ReactorCommandType type;
+    ConnectionPtr connection;
+    MessagePtr message;
+};
+
+/**
+ * Work handed from a reactor back to the state thread.
+ */
+enum ReactorEventType {
+    REVT_ACCEPTED,
+    REVT_MESSAGE,
+    REVT_CLOSED
+};
+
+struct ReactorEvent {
+    ReactorEventType type;
+    ConnectionPtr connection;
+    string command;
+    string payload;
+};
+
+/**
+ * An I/O thread with its own event loop and SO_REUSEPORT listener.
+ *
+ * Connections accepted by a reactor have all of their socket work (handshake, websocket framing, writes, pings and
+ * timeouts) done on that reactor's loop. Complete frames are passed to the state thread as events, and anything the
+ * state thread wants done to a connection is passed back as a command. Lua and ServerState are only ever touched
+ * from the state thread.
+ */
+class Reactor {
+public:
+    Reactor(unsigned int id);
+    ~Reactor();
+
+    void startThread();
+    void stopThread();
+
+    bool isCurrent() const {
+        return current == this;
+    }
+
+    unsigned int id() const {
+        return reactorID;
+    }
+
+    TimingWheel* wheel() const {
+        return reactor_wheel;
+    }
+
+    void addCommand(ReactorCommandType type, ConnectionInstance* connection, MessagePtr message = MessagePtr());
+
+    static void addEvent(ReactorEventType type, ConnectionInstance* connection);
+    static void addEvent(ReactorEventType type, ConnectionInstance* connection, string& command, string& payload);
+    static void getEvents(deque<ReactorEvent>& events);
+
+    // The reactor running on the calling thread, or null on the state thread.
+    static thread_local Reactor* current;
+
+private:
+    static void* runThread(void* param);
+    static void processQueue(struct ev_loop* loop, ev_async* w, int revents);
+
+    void runner();
+
+    unsigned int reactorID;
+    std::atomic<bool> doRun;
+    struct ev_loop* reactor_loop;
+    ev_async* reactor_async;
+    ev_io* reactor_listen;
+    Uring* reactor_uring;
+    TimingWheel* reactor_wheel;
+    ev_check* reactor_flush;
+    pthread_t reactorThread;
+
+    deque<ReactorCommand> commandQueue;
+    pthread_mutex_t commandMutex = PTHREAD_MUTEX_INITIALIZER;
+
+    static deque<ReactorEvent> eventQueue;
+    static pthread_mutex_t eventMutex;
+};
+
+#endif //FSERV_REACTOR_H
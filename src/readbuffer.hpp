@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef READBUFFER_HPP
+#define READBUFFER_HPP
+
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * Per connection input buffer.
+ *
+ * Data is received directly into the free space at the tail, and parsers consume from the head by advancing an
+ * offset. Unread data is only moved when the tail runs out of room, so consuming a frame never copies what is left
+ * behind it.
+ */
+class ReadBuffer {
+public:
+
+    ReadBuffer()
+    :
+    buffer_(0),
+    capacity_(0),
+    start_(0),
+    end_(0) { }
+
+    ~ReadBuffer() {
+        if (buffer_) {
+            delete[] buffer_;
+        }
+    }
+
+    const char* data() const {
+        return buffer_ + start_;
+    }
+
+    size_t size() const {
+        return end_ - start_;
+    }
+
+    /**
+     * Makes at least minimum bytes writable at the tail and returns a pointer to them. available is set to the
+     * actual number of writable bytes.
+     */
+    inline char* reserve(size_t minimum, size_t& available) {
+        if (capacity_ - end_ < minimum) {
+            size_t used = end_ - start_;
+            if (capacity_ - used >= minimum) {
+                memmove(buffer_, buffer_ + start_, used);
+            } else {
+                size_t newCapacity = capacity_ ? capacity_ * 2 : minimum;
+                while (newCapacity - used < minimum)
+                    newCapacity *= 2;
+                char* newBuffer = new char[newCapacity];
+                if (buffer_) {
+                    memcpy(newBuffer, buffer_ + start_, used);
+                    delete[] buffer_;
+                }
+                buffer_ = newBuffer;
+                capacity_ = newCapacity;
+            }
+            start_ = 0;
+            end_ = used;
+        }
+        available = capacity_ - end_;
+        return buffer_ + end_;
+    }
+
+    inline void commit(size_t length) {
+        end_ += length;
+    }
+
+    inline void consume(size_t length) {
+        start_ += length;
+        if (start_ >= end_) {
+            start_ = 0;
+            end_ = 0;
+        }
+    }
+
+    inline void clear() {
+        start_ = 0;
+        end_ = 0;
+    }
+
+private:
+    ReadBuffer(const ReadBuffer&);
+    ReadBuffer& operator=(const ReadBuffer&);
+
+    char* buffer_;
+    size_t capacity_;
+    size_t start_;
+    size_t end_;
+};
+
+#endif //READBUFFER_HPP
@@ -40,8 +40,17 @@
 #include "lua_connection.hpp"
 #include "lua_constants.hpp"
 #include "lua_http.hpp"
+#include "lua_json.hpp"
 #include "lua_testing.hpp"
 #include "server_state.hpp"
+#include "reactor.hpp"
+#include "uring.hpp"
+#include "admission.hpp"
+#include "channel_directory.hpp"
+#include "presence.hpp"
+#include "timing_wheel.hpp"
+#include "tls.hpp"
+#include "websocket_deflate.hpp"
 #include "md5.hpp"
 
 #include <time.h>
@@ -53,39 +62,57 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include <google/malloc_extension.h>
 
 struct ev_loop* Server::server_loop = nullptr;
 ev_async* Server::server_async = nullptr;
 ev_async* Server::http_async = nullptr;
+ev_async* Server::reactor_async = nullptr;
 ev_timer* Server::server_timer = nullptr;
 ev_io* Server::server_listen = nullptr;
 ev_io* Server::rtb_listen = nullptr;
 ev_prepare* Server::server_prepare = nullptr;
+Uring* Server::server_uring = nullptr;
+TimingWheel* Server::server_wheel = nullptr;
+ev_check* Server::server_flush = nullptr;
+thread_local deque<ConnectionPtr> Server::flushQueue;
+MessagePtr Server::pingMessage;
 ChatLogThread* Server::chatLogger = nullptr;
+std::vector<Reactor*> Server::reactors;
 std::tr1::unordered_set<uint32_t> Server::validLBs;
+pthread_mutex_t Server::lbMutex = PTHREAD_MUTEX_INITIALIZER;
 
 lua_State* Server::sL = nullptr;
+LuaHandlers Server::luaHandlers;
 ev_tstamp Server::luaTimer = 0;
 double Server::luaTimeout = 0;
 double Server::luaRepeatTimeout = 0;
 bool Server::luaInTimeout = false;
 bool Server::luaCanTimeout = true;
 
-unsigned long long Server::statAcceptedConnections = 0;
+int Server::acceptBudget = 0;
+
+std::atomic<unsigned long long> Server::statAcceptedConnections(0);
 unsigned long long Server::statStartTime = 0;
 
 // 15 seconds
 #define BIND_RETRY_TIMEOUT 15000000
-#define MAX_WAITING_FOR_ACCEPT 20
 #define CONNECTION_TIMEOUT_PERIOD 120.
 #define CONNECTION_TIMEOUT_PERIOD_IDENT 30.
 #define CONNECTION_PING_TIME CONNECTION_TIMEOUT_PERIOD/4.
+#define CONNECTION_DELAY_CLOSE 1.
 // This is 1MB
 #define MAX_CONNECTION_READ_BUFFER 0x100000
 // This is 8kB
 #define MAX_HANDSHAKE_READ_BUFFER 0x2000
+// Free space made available at the tail of the read buffer before each recv. This is 8kB
+#define MIN_READ_SPACE 0x2000
+// The most queued messages handed to a single writev call.
+#define MAX_WRITE_IOVECS 64
+// Used when listen_backlog isn't set.
+#define DEFAULT_LISTEN_BACKLOG 20
 //This is the number of Lua instructions to run before checking for a timeout.
 #define LUA_TIMEOUT_COUNT 5000000
 
@@ -93,15 +120,23 @@ unsigned long long Server::statStartTime = 0;
 struct sockaddr_in client_addr;
 struct sockaddr_in rtb_addr_allow;
 
+static void sock_keepalive(int socket) {
+    static const int dokeepalive = 1;
+    setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &dokeepalive, sizeof(dokeepalive));
+}
+
 static void sock_nonblock(int socket) {
     int flags = 0;
     flags = fcntl(socket, F_GETFL, 0);
     if (flags != -1)
         fcntl(socket, F_SETFL, flags | O_NONBLOCK);
-    static const int dokeepalive = 1;
-    setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &dokeepalive, sizeof(dokeepalive));
+    sock_keepalive(socket);
 }
 
+/*
+ * Reads for both stages of a connection. Until the websocket handshake has completed the protocol is unknown and the
+ * data goes to processHandshake, after that to processMessages. TLS connections finish their TLS handshake first.
+ */
 void Server::connectionReadCallback(struct ev_loop* loop, ev_io* w, int revents) {
     ConnectionPtr con(static_cast<ConnectionInstance*> (w->data));
 
@@ -112,17 +147,26 @@ void Server::connectionReadCallback(struct ev_loop* loop, ev_io* w, int revents)
         prepareShutdownConnection(con.get());
         close(w->fd);
     } else if (revents & EV_READ) {
-        if (con->readBuffer.size() > MAX_CONNECTION_READ_BUFFER) {
+        if (con->ssl && !con->tlsReady) {
+            processTLSHandshake(loop, con, w->fd);
+            return;
+        }
+
+        bool handshake = con->protocol == PROTOCOL_UNKNOWN;
+        size_t limit = handshake ? MAX_HANDSHAKE_READ_BUFFER : MAX_CONNECTION_READ_BUFFER;
+        if (con->readBuffer.size() > limit) {
             LOG(WARNING) << "Connection " << inet_ntoa(con->clientAddress.sin_addr) << ":"
                          << ntohs(con->clientAddress.sin_port) <<
-                         " exceeded the maximum read buffer size of " << (MAX_CONNECTION_READ_BUFFER / 1024)
+                         " exceeded the maximum read buffer size of " << (limit / 1024)
                          << "kB and is being closed.";
             prepareShutdownConnection(con.get());
             close(w->fd);
+            return;
         }
-        char recvbuffer[8192];
-        bzero(&recvbuffer[0], sizeof(recvbuffer));
-        int received = recv(w->fd, &recvbuffer[0], sizeof(recvbuffer), 0);
+        size_t available = 0;
+        char* recvbuffer = con->readBuffer.reserve(MIN_READ_SPACE, available);
+        bool tlsRead = con->ssl && !con->tlsKernelReceive;
+        ssize_t received = tlsRead ? TLS::read(con->ssl, recvbuffer, available) : recv(w->fd, recvbuffer, available, 0);
         if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             return;
         } else if (received <= 0) {
@@ -131,77 +175,177 @@ void Server::connectionReadCallback(struct ev_loop* loop, ev_io* w, int revents)
             close(w->fd);
         } else {
             con->lastActivity = ev_now(loop);
-            con->readBuffer.append(&recvbuffer[0], received);
-
-            string message;
-            WebSocketResult ret = WS_RESULT_ERROR;
-            int repeat = 10;
-            while (--repeat && con->readBuffer.size()) {
-                switch (con->protocol) {
-                    case PROTOCOL_HYBI:
-                        ret = Websocket::Hybi::receive(con.get(), con->readBuffer, message);
-                        break;
-                    default:
-                        break;
-                }
-
-                if (ret == WS_RESULT_INCOMPLETE || ret == WS_RESULT_PING_PONG)
-                    return;
-                else if (ret == WS_RESULT_ERROR || ret == WS_RESULT_CLOSE) {
-                    //DLOG(INFO) << "Closing connection because it requested a WS close or caused a WS error.";
-                    prepareShutdownConnection(con.get());
-                    close(w->fd);
-                    return;
-                } else {
-                    // Smallest valid message size is 3 characters long.
-                    size_t message_size = message.size();
-                    if (message_size < 3) {
-                        //DLOG(INFO) << "Closing connection because it sent a message that was too short.";
-                        prepareShutdownConnection(con.get());
-                        close(w->fd);
-                        return;
-                    }
-
-                    string command(message.substr(0, 3));
-                    string payload;
-                    if (message_size > 4)
-                        payload = message.substr(4);
-
-                    //DLOG(INFO) << "Command '" << command << "' payload'" << payload << "'";
-                    FReturnCode errorcode = FERR_FATAL_INTERNAL;
-                    if (command == "PIN") {
-                        errorcode = FERR_OK;
-                    } else if (command == "IDN") {
-                        errorcode = NativeCommand::IdentCommand(con, payload);
-                        if (errorcode != FERR_OK)
-                            con->setDelayClose();
-                    } else if (command == "FKS") {
-                        errorcode = NativeCommand::SearchCommand(con, payload);
-                    } else if (command == "ZZZ") {
-                        errorcode = NativeCommand::DebugCommand(con, payload);
-                    } else if (command == "VAR") {
-                        errorcode = runLuaEvent(con.get(), command, payload);
-                    } else {
-                        if (!con->identified) {
-                            errorcode = FERR_REQUIRES_IDENT;
-                        } else {
-                            errorcode = runLuaEvent(con.get(), command, payload);
-                        }
-                    }
-
-                    if (errorcode == FERR_REQUIRES_IDENT || errorcode == FERR_FATAL_INTERNAL) {
-                        //DLOG(INFO) << "Delay closing connection because it sent a command that requires ident or caused a fatal internal error.";
-                        con->setDelayClose();
-                        con->sendError(errorcode);
-                    } else if (errorcode != FERR_OK) {
-                        con->sendError(errorcode);
-                    }
-                }
+            con->readBuffer.commit(received);
+            if (handshake)
+                processHandshake(loop, con, w->fd);
+            else
+                processMessages(loop, con, w->fd);
+            // OpenSSL may have read more than it returned, and the socket won't tell us about it again.
+            if (tlsRead && !con->closed && TLS::pending(con->ssl))
+                ev_feed_event(loop, w, EV_READ);
+        }
+    }
+}
+
+/*
+ * Continues the TLS handshake from whichever watcher the socket was waiting on.
+ */
+void Server::processTLSHandshake(struct ev_loop* loop, ConnectionPtr& con, int fd) {
+    ev_io_stop(loop, &con->writeEvent);
+    switch (TLS::handshake(con.get())) {
+        case TLS_WANT_READ:
+            return;
+        case TLS_WANT_WRITE:
+            ev_io_start(loop, &con->writeEvent);
+            return;
+        case TLS_DONE:
+            con->lastActivity = ev_now(loop);
+            if (con->writeQueue.size())
+                queueFlush(con.get());
+            if (TLS::pending(con->ssl))
+                ev_feed_event(loop, &con->readEvent, EV_READ);
+            return;
+        case TLS_ERROR:
+        default:
+            prepareShutdownConnection(con.get());
+            close(fd);
+            return;
+    }
+}
+
+/*
+ * Parses and hands off the complete messages in a connection's read buffer.
+ */
+void Server::processMessages(struct ev_loop* loop, ConnectionPtr& con, int fd) {
+    string command;
+    string payload;
+    WebSocketResult ret = WS_RESULT_ERROR;
+    int repeat = 10;
+    while (--repeat && con->readBuffer.size()) {
+        switch (con->protocol) {
+            case PROTOCOL_HYBI:
+                ret = Websocket::Hybi::receive(con.get(), con->readBuffer, command, payload);
+                break;
+            default:
+                break;
+        }
+
+        if (ret == WS_RESULT_INCOMPLETE || ret == WS_RESULT_PING_PONG)
+            return;
+        else if (ret == WS_RESULT_ERROR || ret == WS_RESULT_CLOSE) {
+            //DLOG(INFO) << "Closing connection because it requested a WS close or caused a WS error.";
+            prepareShutdownConnection(con.get());
+            close(fd);
+            return;
+        } else {
+            // Smallest valid message size is 3 characters long.
+            if (command.size() < 3) {
+                //DLOG(INFO) << "Closing connection because it sent a message that was too short.";
+                prepareShutdownConnection(con.get());
+                close(fd);
+                return;
             }
+
+            if (con->reactor)
+                Reactor::addEvent(REVT_MESSAGE, con.get(), command, payload);
+            else
+                dispatchMessage(con, command, payload);
         }
     }
 }
 
+/*
+ * Entry point for the io_uring backend, which has already received the data into one of its own buffers.
+ */
+void Server::connectionReceived(struct ev_loop* loop, ConnectionPtr& con, int fd, const char* data, size_t length) {
+    if (con->closed)
+        return;
+
+    bool handshake = con->protocol == PROTOCOL_UNKNOWN;
+    size_t limit = handshake ? MAX_HANDSHAKE_READ_BUFFER : MAX_CONNECTION_READ_BUFFER;
+    if (con->readBuffer.size() > limit) {
+        LOG(WARNING) << "Connection " << inet_ntoa(con->clientAddress.sin_addr) << ":"
+                     << ntohs(con->clientAddress.sin_port) <<
+                     " exceeded the maximum read buffer size of " << (limit / 1024) << "kB and is being closed.";
+        prepareShutdownConnection(con.get());
+        close(fd);
+        return;
+    }
+
+    size_t available = 0;
+    char* recvbuffer = con->readBuffer.reserve(length, available);
+    memcpy(recvbuffer, data, length);
+    con->lastActivity = ev_now(loop);
+    con->readBuffer.commit(length);
+    if (handshake)
+        processHandshake(loop, con, fd);
+    else
+        processMessages(loop, con, fd);
+}
+
+/*
+ * Runs a single complete websocket message. For connections owned by a reactor this is called from
+ * processReactorWakeup, otherwise it is called directly from connectionReadCallback.
+ */
+void Server::dispatchMessage(ConnectionPtr& con, string& command, string& payload) {
+    //DLOG(INFO) << "Command '" << command << "' payload'" << payload << "'";
+    FReturnCode errorcode = FERR_FATAL_INTERNAL;
+    CommandId id = CommandTable::find(command.data(), command.length());
+    switch (id) {
+        case CMD_PIN:
+            errorcode = FERR_OK;
+            break;
+        case CMD_IDN:
+            errorcode = NativeCommand::IdentCommand(con, payload);
+            if (errorcode != FERR_OK)
+                con->setDelayClose();
+            break;
+        case CMD_FKS:
+            errorcode = NativeCommand::SearchCommand(con, payload);
+            break;
+        case CMD_ZZZ:
+            errorcode = NativeCommand::DebugCommand(con, payload);
+            break;
+        case CMD_VAR:
+            errorcode = runLuaEvent(con.get(), id, command, payload);
+            break;
+        case CMD_MSG:
+        case CMD_LRP:
+        case CMD_PRI:
+        case CMD_TPN:
+            // Isolated connections keep running main.lua's handlers, so that changes to them can be tried out.
+            if (!con->identified) {
+                errorcode = FERR_REQUIRES_IDENT;
+            } else if (!NativeCommand::handles(id) || con->debugL) {
+                errorcode = runLuaEvent(con.get(), id, command, payload);
+            } else if (id == CMD_MSG) {
+                errorcode = NativeCommand::MessageCommand(con, payload);
+            } else if (id == CMD_LRP) {
+                errorcode = NativeCommand::AdCommand(con, payload);
+            } else if (id == CMD_PRI) {
+                errorcode = NativeCommand::PrivateMessageCommand(con, payload);
+            } else {
+                errorcode = NativeCommand::TypingCommand(con, payload);
+            }
+            break;
+        default:
+            if (!con->identified) {
+                errorcode = FERR_REQUIRES_IDENT;
+            } else {
+                errorcode = runLuaEvent(con.get(), id, command, payload);
+            }
+            break;
+    }
+
+    if (errorcode == FERR_REQUIRES_IDENT || errorcode == FERR_FATAL_INTERNAL) {
+        //DLOG(INFO) << "Delay closing connection because it sent a command that requires ident or caused a fatal internal error.";
+        con->setDelayClose();
+        con->sendError(errorcode);
+    } else if (errorcode != FERR_OK) {
+        con->sendError(errorcode);
+    }
+}
+
 void Server::connectionWriteCallback(struct ev_loop* loop, ev_io* w, int revents) {
     ConnectionPtr con(static_cast<ConnectionInstance*> (w->data));
 
@@ -213,80 +357,213 @@ void Server::connectionWriteCallback(struct ev_loop* loop, ev_io* w, int revents
         prepareShutdownConnection(con.get());
         close(w->fd);
     } else if (revents & EV_WRITE) {
-        while (con->writeQueue.size()) {
-            MessagePtr outMessage = con->writeQueue.front();
-            int len = outMessage->length() - con->writePosition;
-            int sent = send(w->fd, outMessage->buffer() + con->writePosition, len, 0);
-            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                return;
-            } else if (sent <= 0) {
-                prepareShutdownConnection(con.get());
-                close(w->fd);
-                return;
-            } else if (sent != len) {
-                // We've properly filled the buffer, come back later.
-                con->writePosition += sent;
-                return;
-            } else {
-                con->writeQueue.pop_front();
-                con->writePosition = 0;
+        if (con->ssl && !con->tlsReady)
+            processTLSHandshake(loop, con, w->fd);
+        else if (writeConnection(con.get()))
+            ev_io_stop(loop, w);
+    }
+}
+
+/*
+ * Writes as much of a connection's queue as the socket will take. Returns true once the queue is empty, and false if
+ * the socket is full or the connection had to be closed. TLS connections without kernel TLS write through OpenSSL,
+ * one frame per call.
+ */
+bool Server::writeConnection(ConnectionInstance* con) {
+    int fd = con->writeEvent.fd;
+    if (con->ssl && !con->tlsReady)
+        return false;
+    bool tlsWrite = con->ssl && !con->tlsKernelSend;
+    int maxFrames = tlsWrite ? 1 : MAX_WRITE_IOVECS;
+    struct iovec iov[MAX_WRITE_IOVECS];
+    while (con->writeQueue.size()) {
+        // Gather as much of the queue as we can into one call. Only the first message can be partially sent.
+        int count = 0;
+        size_t len = 0;
+        for (auto i = con->writeQueue.begin(); i != con->writeQueue.end() && count < maxFrames; ++i) {
+            size_t offset = count ? 0 : con->writePosition;
+            iov[count].iov_base = (void*) ((*i)->buffer() + offset);
+            iov[count].iov_len = (*i)->length() - offset;
+            len += iov[count].iov_len;
+            ++count;
+        }
+
+        ssize_t sent = tlsWrite ? TLS::write(con->ssl, iov[0].iov_base, iov[0].iov_len) : writev(fd, &iov[0], count);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        } else if (sent <= 0) {
+            prepareShutdownConnection(con);
+            close(fd);
+            return false;
+        }
+
+        ++con->statWriteCalls;
+        size_t remaining = sent;
+        while (remaining) {
+            size_t left = con->writeQueue.front()->length() - con->writePosition;
+            if (remaining < left) {
+                con->writePosition += remaining;
+                break;
             }
+            remaining -= left;
+            con->popWriteQueue();
+            ++con->statWriteFrames;
+        }
+
+        if (static_cast<size_t> (sent) != len) {
+            // We've properly filled the buffer, come back later.
+            return false;
         }
-        ev_io_stop(loop, w);
     }
+    return true;
 }
 
 /*
- * This function does timeouts for connections. It is also used to close connections. This is done to
- * avoid a possible race condition where multiple events are queued for a single item, and the first
- * triggers a close. Deleting the object pointed to by w->data would cause a crash when the next event
- * handler tried to use it. This is accomplished by stopping a connections events, setting con->closed,
- * and setting a timer that expires almost immediately. By the time a connection gets here, the socket is
- * already closed if con->closed is set!
- *
- * The above applies even to the function itself if the connection is not marked closed, and must reschedule
- * a new trigger on the next loop to avoid the race condition.
+ * Connections that were sent something are written to once, at the end of the loop iteration, instead of each
+ * waiting a full iteration for the kernel to report them writable. The write watcher is only started for those whose
+ * socket buffer filled up.
+ */
+void Server::queueFlush(ConnectionInstance* con) {
+    if (con->flushQueued || ev_is_active(&con->writeEvent))
+        return;
+    con->flushQueued = true;
+    flushQueue.push_back(ConnectionPtr(con));
+}
+
+void Server::flushCallback(struct ev_loop* loop, ev_check* w, int revents) {
+    deque<ConnectionPtr> connections;
+    connections.swap(flushQueue);
+    for (auto& con : connections) {
+        con->flushQueued = false;
+        if (con->closed || ev_is_active(&con->writeEvent))
+            continue;
+        if (!writeConnection(con.get()) && !con->closed)
+            ev_io_start(loop, &con->writeEvent);
+    }
+}
+
+/*
+ * The flush stage runs after every other watcher of the iteration, so that it sees everything they queued.
+ */
+ev_check* Server::startFlushStage(struct ev_loop* loop) {
+    ev_check* flush = new ev_check;
+    ev_check_init(flush, Server::flushCallback);
+    ev_set_priority(flush, EV_MINPRI);
+    ev_check_start(loop, flush);
+    return flush;
+}
+
+void Server::stopFlushStage(struct ev_loop* loop, ev_check* flush) {
+    ev_check_stop(loop, flush);
+    delete flush;
+}
+
+/*
+ * Connections are only ever cleaned up from here. This avoids a possible race condition where multiple events are
+ * queued for a single item, and the first triggers a close. Deleting the object pointed to by w->data would cause a
+ * crash when the next event handler tried to use it. prepareShutdownConnection stops the connection's events, sets
+ * con->closed, and sets this timer to expire almost immediately. By the time a connection gets here its socket is
+ * already closed.
  *
  * This should be the only way a connection can be closed and cleaned up.
  */
 void Server::connectionTimerCallback(struct ev_loop* loop, ev_timer* w, int revents) {
     ConnectionPtr con(static_cast<ConnectionInstance*> (w->data));
-    if (con->closed) {
-        DLOG(INFO) << "Shutting down a connection marked as preclosed.";
-        //sendClosing(con);
-        shutdownConnection(con.get());
-        if (con->identified)
-            ServerState::removeConnection(con->characterNameLower);
-        else
-            ServerState::removedUnidentified(con);
+    if (!con->closed)
+        return;
 
+    DLOG(INFO) << "Shutting down a connection marked as preclosed.";
+    //sendClosing(con);
+    shutdownConnection(con.get());
+    if (con->reactor)
+        Reactor::addEvent(REVT_CLOSED, con.get());
+    else if (con->identified)
+        ServerState::removeConnection(con->characterNameLower);
+    else
+        ServerState::removedUnidentified(con);
+}
+
+/*
+ * Called by the timing wheel for the first of a connection's delayed close, idle timeout and next ping. Activity
+ * doesn't move the connection on the wheel, so this may find that nothing is due yet and only reschedule it.
+ */
+void Server::connectionWheelCallback(ConnectionInstance* con, ev_tstamp now) {
+    if (con->closed)
         return;
-    } else if (con->delayClose) {
-        DLOG(INFO) << "Closing a connection marked for delay close.";
-        close(con->writeEvent->fd);
-        prepareShutdownConnection(con.get());
+
+    if (con->delayClose) {
+        if (now >= con->closeAt) {
+            DLOG(INFO) << "Closing a connection marked for delay close.";
+            close(con->writeEvent.fd);
+            prepareShutdownConnection(con);
+            return;
+        }
+    } else if (now > connectionTimeout(con)) {
+        prepareShutdownConnection(con);
+        close(con->readEvent.fd);
+        return;
+    } else if (con->congested && ConnectionInstance::sendQueueStall > 0 &&
+               now - con->congestedSince >= ConnectionInstance::sendQueueStall) {
+        LOG(WARNING) << "Connection " << inet_ntoa(con->clientAddress.sin_addr) << ":"
+                     << ntohs(con->clientAddress.sin_port) << " stayed over the send queue high watermark for "
+                     << ConnectionInstance::sendQueueStall << " seconds and is being closed.";
+        ++ConnectionInstance::statSlowConsumers;
+        prepareShutdownConnection(con);
+        close(con->readEvent.fd);
         return;
+    } else if (con->pingEnabled && now >= con->nextPing) {
+        // Clients that have talked to us recently are known to be alive, and don't need a ping.
+        if (now - con->lastActivity >= CONNECTION_PING_TIME) {
+            con->send(pingMessage);
+            con->nextPing = now + CONNECTION_PING_TIME;
+        } else {
+            con->nextPing = con->lastActivity + CONNECTION_PING_TIME;
+        }
     }
+    scheduleConnection(con);
+}
 
-    ev_tstamp now = ev_now(loop);
-    ev_tstamp timeout = con->lastActivity + (con->protocol != PROTOCOL_UNKNOWN ? CONNECTION_TIMEOUT_PERIOD
-                                                                               : CONNECTION_TIMEOUT_PERIOD_IDENT);
-    if (now > timeout) {
-        //HACK: Have to cheat to get the FD here.
-        prepareShutdownConnection(con.get());
-        close(con->readEvent->fd);
-    } else {
-        w->repeat = timeout - now;
-        ev_timer_again(loop, w);
+ev_tstamp Server::connectionTimeout(ConnectionInstance* con) {
+    return con->lastActivity + (con->protocol != PROTOCOL_UNKNOWN ? CONNECTION_TIMEOUT_PERIOD
+                                                                  : CONNECTION_TIMEOUT_PERIOD_IDENT);
+}
+
+/*
+ * Puts a connection on its loop's timing wheel for whichever comes first of its delayed close, its idle timeout and
+ * its next ping. Must be called from the connection's loop.
+ */
+void Server::scheduleConnection(ConnectionInstance* con) {
+    if (!con->wheel || con->closed)
+        return;
+
+    ev_tstamp now = ev_now(con->loop);
+    if (con->delayClose) {
+        if (!con->closeAt)
+            con->closeAt = now + CONNECTION_DELAY_CLOSE;
+        con->wheel->schedule(con, con->closeAt);
+        return;
     }
+
+    ev_tstamp when = connectionTimeout(con);
+    if (con->pingEnabled) {
+        if (!con->nextPing)
+            con->nextPing = now + CONNECTION_PING_TIME;
+        if (con->nextPing < when)
+            when = con->nextPing;
+    }
+    if (con->congested && ConnectionInstance::sendQueueStall > 0 &&
+        con->congestedSince + ConnectionInstance::sendQueueStall < when)
+        when = con->congestedSince + ConnectionInstance::sendQueueStall;
+    con->wheel->schedule(con, when);
 }
 
 bool Server::parseLBList() {
     bool allValid = true;
-    validLBs.clear();
     std::vector<std::string> lbs;
     StartupConfig::getStringList("load_balancers", lbs);
     struct in_addr address{};
+    MUT_LOCK(lbMutex);
+    validLBs.clear();
     for(auto& lb : lbs) {
         auto valid = inet_pton(AF_INET, lb.c_str(), &address);
         if(valid != 1) {
@@ -296,125 +573,175 @@ bool Server::parseLBList() {
         }
         validLBs.insert(address.s_addr);
     }
+    MUT_UNLOCK(lbMutex);
     return allValid;
 }
 
-void Server::handshakeCallback(struct ev_loop* loop, ev_io* w, int revents) {
-    ConnectionPtr con(static_cast<ConnectionInstance*> (w->data));
-
-    if (con->closed)
-        return;
+// The list can be reloaded from Lua while reactors are handshaking.
+bool Server::isValidLB(uint32_t address) {
+    MUT_LOCK(lbMutex);
+    bool valid = validLBs.count(address) > 0;
+    MUT_UNLOCK(lbMutex);
+    return valid;
+}
 
-    if (revents & EV_ERROR) {
-        prepareShutdownConnection(con.get());
-        close(w->fd);
-    } else if (revents & EV_READ) {
-        if (con->readBuffer.size() > MAX_HANDSHAKE_READ_BUFFER) {
-            LOG(WARNING) << "Connection " << inet_ntoa(con->clientAddress.sin_addr) << ":"
-                         << ntohs(con->clientAddress.sin_port) <<
-                         " exceeded the maximum handshake buffer size of " << (MAX_HANDSHAKE_READ_BUFFER / 1024)
-                         << "kB and is being closed.";
-            prepareShutdownConnection(con.get());
-            close(w->fd);
-        }
-        char recvbuffer[8192];
-        bzero(&recvbuffer[0], sizeof(recvbuffer));
-        int received = recv(w->fd, &recvbuffer[0], sizeof(recvbuffer), 0);
-        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+void Server::processHandshake(struct ev_loop* loop, ConnectionPtr& con, int fd) {
+    MessageBuffer* response = 0;
+    string ip;
+    bool deflate = false;
+    ProtocolVersion ver = Websocket::Acceptor::accept(con->readBuffer.data(), con->readBuffer.size(),
+                                                      con->handshakeScanned, response, ip, deflate);
+    MessagePtr responsePtr(response);
+    switch (ver) {
+        case PROTOCOL_HYBI:
+            break;
+        case PROTOCOL_INCOMPLETE:
             return;
-        } else if (received <= 0) {
+        case PROTOCOL_UNKNOWN:
+        case PROTOCOL_BAD:
+        default:
             prepareShutdownConnection(con.get());
-            close(w->fd);
-        } else {
-            con->lastActivity = ev_now(loop);
-            con->readBuffer.append(&recvbuffer[0], received);
-
-            string buffer;
-            string ip;
-            ProtocolVersion ver = Websocket::Acceptor::accept(con->readBuffer, buffer, ip);
-            switch (ver) {
-                case PROTOCOL_HYBI:
-                    break;
-                case PROTOCOL_INCOMPLETE:
-                    return;
-                case PROTOCOL_UNKNOWN:
-                case PROTOCOL_BAD:
-                default:
-                    prepareShutdownConnection(con.get());
-                    close(w->fd);
-                    return;
+            close(fd);
+            return;
 
-            }
-            if(validLBs.count(con->clientAddress.sin_addr.s_addr) > 0) {
-                // Copy real IP into client address struct
-                if (inet_pton(AF_INET, ip.c_str(), &con->clientAddress.sin_addr) != 1) {
-                    LOG(WARNING) << "Could not determine the endpoint address from the TLS proxy.";
-                    prepareShutdownConnection(con.get());
-                    close(w->fd);
-                    return;
-                }
-                LOG(INFO) << "Accepted connection from TLS proxy for endpoint: "
-                          << inet_ntoa(con->clientAddress.sin_addr);
-            }
-            con->sendRaw(buffer);
-            con->protocol = ver;
-            con->readBuffer.clear();
-            ev_io* read = new ev_io;
-            ev_io_init(read, Server::connectionReadCallback, w->fd, EV_READ);
-            read->data = con.get();
-            ev_io_stop(loop, w);
-            delete con->readEvent;
-            ev_io_start(server_loop, read);
-            con->readEvent = read;
+    }
+    if(isValidLB(con->clientAddress.sin_addr.s_addr)) {
+        // Copy real IP into client address struct
+        if (inet_pton(AF_INET, ip.c_str(), &con->clientAddress.sin_addr) != 1) {
+            LOG(WARNING) << "Could not determine the endpoint address from the TLS proxy.";
+            prepareShutdownConnection(con.get());
+            close(fd);
+            return;
         }
+        LOG(INFO) << "Accepted connection from TLS proxy for endpoint: "
+                  << inet_ntoa(con->clientAddress.sin_addr);
     }
+    con->send(responsePtr);
+    con->protocol = ver;
+    if (deflate)
+        con->inflater = new Websocket::Inflater();
+    con->readBuffer.clear();
 }
 
+/*
+ * Drains the listen backlog, up to accept_budget connections per readiness event. When the global admission bucket
+ * runs dry the listener is paused until it refills, and whatever is left waits in the backlog.
+ */
 void Server::listenCallback(struct ev_loop* loop, ev_io* w, int revents) {
     if (!(revents & EV_READ))
         return;
 
     //DLOG(INFO) << "Listen callback.";
 
-    int socklen = sizeof(client_addr);
-    int newfd = accept(w->fd, (sockaddr*) &client_addr, (socklen_t*) &socklen);
-    if (newfd > 0) {
-        ++statAcceptedConnections;
-        {
-            char ntopbuf[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &(client_addr.sin_addr), &ntopbuf[0], INET_ADDRSTRLEN);
-            LOG(INFO) << "Incoming connection from: " << &ntopbuf[0] << ":" << ntohs(client_addr.sin_port);
+    ev_tstamp now = ev_now(loop);
+    for (int i = 0; i < acceptBudget; ++i) {
+        double wait = 0;
+        if (!Admission::acquire(now, wait)) {
+            Admission::countDeferred();
+            ev_timer* resume = static_cast<ev_timer*> (w->data);
+            ev_io_stop(loop, w);
+            ev_timer_set(resume, wait, 0.);
+            ev_timer_start(loop, resume);
+            return;
+        }
+
+        // Reactors accept concurrently, so this can't use the shared client_addr.
+        struct sockaddr_in accept_addr;
+        socklen_t socklen = sizeof(accept_addr);
+        int newfd = accept4(w->fd, (sockaddr*) &accept_addr, &socklen, SOCK_NONBLOCK);
+        if (newfd < 0) {
+            Admission::release();
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG(WARNING) << "Failed to accept a connection: " << strerror(errno);
+            return;
         }
-        sock_nonblock(newfd);
-        ConnectionPtr newcon(new ConnectionInstance);
+
+        if (Admission::admit(accept_addr.sin_addr.s_addr, now) != ADMISSION_ACCEPT) {
+            close(newfd);
+            continue;
+        }
+        ConnectionPtr newcon = acceptConnection(loop, newfd, accept_addr, 0);
+        if (!newcon->closed)
+            ev_io_start(loop, &newcon->readEvent);
+    }
+}
+
+void Server::listenResumeCallback(struct ev_loop* loop, ev_timer* w, int revents) {
+    ev_io_start(loop, static_cast<ev_io*> (w->data));
+}
+
+/*
+ * The listener's resume timer is kept in its data pointer.
+ */
+ev_io* Server::startListener(struct ev_loop* loop, int fd) {
+    ev_io* listen = new ev_io;
+    ev_timer* resume = new ev_timer;
+    ev_io_init(listen, Server::listenCallback, fd, EV_READ);
+    ev_timer_init(resume, Server::listenResumeCallback, 0., 0.);
+    listen->data = resume;
+    resume->data = listen;
+    ev_io_start(loop, listen);
+    return listen;
+}
+
+void Server::stopListener(struct ev_loop* loop, ev_io* listen) {
+    ev_timer* resume = static_cast<ev_timer*> (listen->data);
+    ev_timer_stop(loop, resume);
+    delete resume;
+    ev_io_stop(loop, listen);
+    delete listen;
+}
+
+/*
+ * Creates the connection and its watchers for a newly accepted socket. The read watcher is left for the caller to
+ * start, as the io_uring backend does its reads without it.
+ */
+ConnectionPtr Server::acceptConnection(struct ev_loop* loop, int newfd, struct sockaddr_in& accept_addr, Uring* uring) {
+    ++statAcceptedConnections;
+    {
+        char ntopbuf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(accept_addr.sin_addr), &ntopbuf[0], INET_ADDRSTRLEN);
+        DLOG(INFO) << "Incoming connection from: " << &ntopbuf[0] << ":" << ntohs(accept_addr.sin_port);
+    }
+    sock_keepalive(newfd);
+    ConnectionPtr newcon(new ConnectionInstance);
+    memcpy(&(newcon->clientAddress), &accept_addr, sizeof(accept_addr));
+    newcon->lastActivity = ev_now(loop);
+
+    newcon->loop = loop;
+    newcon->uring = uring;
+    newcon->reactor = Reactor::current;
+    if (newcon->reactor)
+        Reactor::addEvent(REVT_ACCEPTED, newcon.get());
+    else
         ServerState::addUnidentified(newcon);
-        memcpy(&(newcon->clientAddress), &client_addr, sizeof(client_addr));
-
-        newcon->loop = loop;
-
-        ev_timer* ping = new ev_timer;
-        ev_timer_init(ping, Server::pingCallback, CONNECTION_PING_TIME, CONNECTION_PING_TIME);
-        ping->data = newcon.get();
-        newcon->pingEvent = ping;
-
-        ev_timer* timeout = new ev_timer;
-        ev_timer_init(timeout, Server::connectionTimerCallback, CONNECTION_TIMEOUT_PERIOD_IDENT,
-                      CONNECTION_TIMEOUT_PERIOD_IDENT);
-        timeout->data = newcon.get();
-        ev_timer_start(server_loop, timeout);
-        newcon->timerEvent = timeout;
-
-        ev_io* read = new ev_io;
-        ev_io_init(read, Server::handshakeCallback, newfd, EV_READ);
-        read->data = newcon.get();
-        ev_io_start(server_loop, read);
-        newcon->readEvent = read;
-
-        ev_io* write = new ev_io;
-        ev_io_init(write, Server::connectionWriteCallback, newfd, EV_WRITE);
-        write->data = newcon.get();
-        newcon->writeEvent = write;
+
+    newcon->wheel = newcon->reactor ? newcon->reactor->wheel() : server_wheel;
+    scheduleConnection(newcon.get());
+
+    ev_timer* timeout = &newcon->timerEvent;
+    ev_timer_init(timeout, Server::connectionTimerCallback, 0., 0.);
+    timeout->data = newcon.get();
+
+    // io_uring connections keep their io watchers only for the file descriptor used when closing.
+    ev_io* read = &newcon->readEvent;
+    ev_io_init(read, Server::connectionReadCallback, newfd, EV_READ);
+    read->data = newcon.get();
+
+    ev_io* write = &newcon->writeEvent;
+    ev_io_init(write, Server::connectionWriteCallback, newfd, EV_WRITE);
+    write->data = newcon.get();
+
+    if (TLS::enabled() && !uring) {
+        newcon->ssl = TLS::accept(newfd);
+        if (!newcon->ssl) {
+            prepareShutdownConnection(newcon.get());
+            close(newfd);
+        }
     }
+    return newcon;
 }
 
 void Server::rtbCallback(struct ev_loop* loop, ev_io* w, int revents) {
@@ -477,14 +804,6 @@ void Server::prepareCallback(struct ev_loop* loop, ev_prepare* w, int revents) {
     luaInTimeout = false;
 }
 
-void Server::pingCallback(struct ev_loop* loop, ev_timer* w, int revents) {
-    static string ping_command("PIN");
-    ConnectionPtr con(static_cast<ConnectionInstance*> (w->data));
-    MessagePtr outMessage(MessageBuffer::fromString(ping_command));
-    con->send(outMessage);
-    ev_timer_again(server_loop, w);
-}
-
 void Server::processWakeupCallback(struct ev_loop* loop, ev_async* w, int revents) {
     DLOG(INFO) << "Processing async wakeup.";
 
@@ -520,6 +839,31 @@ void Server::processHTTPWakeup(struct ev_loop* loop, ev_async* w, int revents) {
     }
 }
 
+void Server::processReactorWakeup(struct ev_loop* loop, ev_async* w, int revents) {
+    deque<ReactorEvent> events;
+    Reactor::getEvents(events);
+    for (auto& event : events) {
+        ConnectionPtr& con = event.connection;
+        switch (event.type) {
+            case REVT_ACCEPTED:
+                ServerState::addUnidentified(con);
+                break;
+            case REVT_MESSAGE:
+                if (!con->closed)
+                    dispatchMessage(con, event.command, event.payload);
+                break;
+            case REVT_CLOSED:
+                // The reactor has already torn down the socket side of this connection.
+                runLuaDisconnect(con.get());
+                if (con->identified)
+                    ServerState::removeConnection(con->characterNameLower);
+                else
+                    ServerState::removedUnidentified(con);
+                break;
+        }
+    }
+}
+
 /**
  * Callback format is (con, status, body, extras)
  * @param reply
@@ -529,8 +873,6 @@ FReturnCode Server::processHTTPReply(HTTPReply* reply) {
     FReturnCode ret = FERR_UNKNOWN;
 
     luaTimer = luaGetTime();
-    json_t* n = json_loads(reply->body().c_str(), 0, 0);
-
     int top = lua_gettop(sL);
     lua_getglobal(sL, "on_error");
     lua_getglobal(sL, "httpcb");
@@ -541,12 +883,8 @@ FReturnCode Server::processHTTPReply(HTTPReply* reply) {
         lua_pushnil(sL);
     }
     lua_pushinteger(sL, reply->status());
-    if (n) {
-        LuaChat::jsonToLua(sL, n);
-    } else {
+    if (!LuaJSON::decode(sL, reply->body().data(), reply->body().length()))
         lua_pushstring(sL, reply->body().c_str());
-    }
-    json_decref(n);
     lua_pushnil(sL);
     if (lua_pcall(sL, 4, 1, LUA_ABSINDEX(sL, -7))) {
         LOG(WARNING) << "Lua error while calling http_callback. Error returned was: " << lua_tostring(sL, -1);
@@ -571,60 +909,66 @@ void Server::prepareShutdownConnection(ConnectionInstance* instance) {
     if (instance->closed)
         return;
 
-    if (instance->identified) {
-        luaCanTimeout = false;
-        int top = lua_gettop(sL);
-        lua_getglobal(sL, "on_error");
-        lua_getglobal(sL, "event");
-        lua_getfield(sL, -1, "pre_disconnect");
-        lua_pushlightuserdata(sL, instance);
-        if (lua_pcall(sL, 1, 0, LUA_ABSINDEX(sL, -4))) {
-            LOG(WARNING) << "Lua error while calling pre_disconnect. Error returned was: " << lua_tostring(sL, -1);
-        }
-        lua_pop(sL, 2);
-        if (top != lua_gettop(sL)) {
-            DLOG(FATAL) << "Did not return stack to its previous condition. O: " << top << " N: " << lua_gettop(sL);
-        }
-        luaCanTimeout = true;
-
-        RedisRequest* req = new RedisRequest;
-        req->key = Redis::onlineUsersKey;
-        req->method = REDIS_SREM;
-        req->updateContext = RCONTEXT_ONLINE;
-        req->values.push(instance->characterName);
-        if (!Redis::addRequest(req))
-            delete req;
-    }
+    // Reactor owned connections notify Lua from the state thread once the socket side is gone.
+    if (!instance->reactor)
+        runLuaDisconnect(instance);
+
     instance->closed = true;
-    ev_io_stop(server_loop, instance->writeEvent);
-    ev_io_stop(server_loop, instance->readEvent);
-    ev_timer_stop(server_loop, instance->pingEvent);
-    ev_timer_stop(server_loop, instance->timerEvent);
-    ev_timer_set(instance->timerEvent, 0.001, 0.);
-    ev_timer_start(server_loop, instance->timerEvent);
+    if (instance->uring)
+        instance->uring->cancel(instance);
+    if (instance->wheel)
+        instance->wheel->cancel(instance);
+    ev_io_stop(instance->loop, &instance->writeEvent);
+    ev_io_stop(instance->loop, &instance->readEvent);
+    ev_timer_stop(instance->loop, &instance->timerEvent);
+    ev_timer_set(&instance->timerEvent, 0.001, 0.);
+    ev_timer_start(instance->loop, &instance->timerEvent);
 }
 
-void Server::shutdownConnection(ConnectionInstance* instance) {
-    ev_timer_stop(server_loop, instance->pingEvent);
-    delete instance->pingEvent;
-    instance->pingEvent = 0;
-
-    ev_timer_stop(server_loop, instance->timerEvent);
-    delete instance->timerEvent;
-    instance->timerEvent = 0;
+void Server::runLuaDisconnect(ConnectionInstance* instance) {
+    if (!instance->identified)
+        return;
 
-    ev_io_stop(server_loop, instance->readEvent);
-    delete instance->readEvent;
-    instance->readEvent = 0;
+    luaCanTimeout = false;
+    int top = lua_gettop(sL);
+    lua_getglobal(sL, "on_error");
+    lua_getglobal(sL, "event");
+    lua_getfield(sL, -1, "pre_disconnect");
+    lua_pushlightuserdata(sL, instance);
+    if (lua_pcall(sL, 1, 0, LUA_ABSINDEX(sL, -4))) {
+        LOG(WARNING) << "Lua error while calling pre_disconnect. Error returned was: " << lua_tostring(sL, -1);
+    }
+    lua_pop(sL, 2);
+    if (top != lua_gettop(sL)) {
+        DLOG(FATAL) << "Did not return stack to its previous condition. O: " << top << " N: " << lua_gettop(sL);
+    }
+    luaCanTimeout = true;
+
+    RedisRequest* req = new RedisRequest;
+    req->key = Redis::onlineUsersKey;
+    req->method = REDIS_SREM;
+    req->updateContext = RCONTEXT_ONLINE;
+    req->values.push(instance->characterName);
+    if (!Redis::addRequest(req))
+        delete req;
+}
 
-    ev_io_stop(server_loop, instance->writeEvent);
-    delete instance->writeEvent;
-    instance->writeEvent = 0;
+void Server::shutdownConnection(ConnectionInstance* instance) {
+    if (instance->wheel)
+        instance->wheel->cancel(instance);
+    ev_timer_stop(instance->loop, &instance->timerEvent);
+    ev_io_stop(instance->loop, &instance->readEvent);
+    ev_io_stop(instance->loop, &instance->writeEvent);
 }
 
 void Server::runTesting() {
     DLOG(INFO) << "Starting in testing mode.";
+    // Never run, but flood timers read the time from it.
+    server_loop = ev_default_loop(EVFLAG_AUTO);
     initLua();
+    NativeCommand::configure();
+    Presence::start(server_loop);
+    Presence::configure();
 
     luaCanTimeout = false;
     luaInTimeout = false;
@@ -649,7 +993,9 @@ void Server::runTesting() {
     }
     lua_pop(sL, 1);
 
+    Presence::stop();
     shutdownLua();
+    server_loop = 0;
 }
 
 void Server::run() {
@@ -671,10 +1017,30 @@ void Server::run() {
     if (StartupConfig::getBool("log_start"))
         loggerStart();
 
-    int listensock = bindAndListen();
-    server_listen = new ev_io;
-    ev_io_init(server_listen, Server::listenCallback, listensock, EV_READ);
-    ev_io_start(server_loop, server_listen);
+    // Without a budget the level triggered listener would never accept and never stop firing.
+    acceptBudget = static_cast<int> (StartupConfig::getDouble("accept_budget"));
+    if (acceptBudget < 1)
+        acceptBudget = 1;
+    Admission::configure();
+    NativeCommand::configure();
+    ChannelDirectory::configure();
+    Presence::start(server_loop);
+    Presence::configure();
+    if (!TLS::configure())
+        LOG(FATAL) << "TLS is enabled but could not be set up.";
+    ConnectionInstance::configureSendQueue();
+    Websocket::Deflate::configure(StartupConfig::getBool("websocket_deflate"),
+                                  static_cast<size_t> (StartupConfig::getDouble("deflate_threshold")));
+
+    if (StartupConfig::getDouble("reactor_threads") > 0) {
+        startReactors();
+    } else {
+        int listensock = bindAndListen();
+        if (useUring())
+            server_uring = Uring::create(server_loop, listensock);
+        if (!server_uring)
+            server_listen = startListener(server_loop, listensock);
+    }
 
     if (StartupConfig::getBool("enablertb")) {
         int rtbsock = bindAndListenRTB();
@@ -687,9 +1053,13 @@ void Server::run() {
 
     DLOG(INFO) << "Server stopping.";
 
-    ev_io_stop(server_loop, server_listen);
-    delete server_listen;
-    server_listen = 0;
+    if (server_listen) {
+        stopListener(server_loop, server_listen);
+        server_listen = 0;
+    }
+    delete server_uring;
+    server_uring = 0;
+    stopReactors();
 
     if (StartupConfig::getBool("enablertb")) {
         ev_io_stop(server_loop, rtb_listen);
@@ -697,11 +1067,13 @@ void Server::run() {
         rtb_listen = 0;
     }
 
+    TLS::shutdown();
     loggerStop();
     ServerState::saveChannels();
     ServerState::saveOps();
     ServerState::saveBans();
     ServerState::cleanupChannels();
+    Presence::stop();
     shutdownTimer();
     shutdownAsyncLoop();
     shutdownLua();
@@ -719,6 +1091,42 @@ void Server::sendHTTPWakeup() {
         ev_async_send(server_loop, http_async);
 }
 
+void Server::sendReactorWakeup() {
+    if (server_loop && reactor_async)
+        ev_async_send(server_loop, reactor_async);
+}
+
+/*
+ * The io_uring backend reads and writes the socket itself, so it can't be used when fserv terminates TLS.
+ */
+bool Server::useUring() {
+    if (StartupConfig::getString("io_backend") != "io_uring")
+        return false;
+    if (TLS::enabled()) {
+        LOG(WARNING) << "The io_uring backend does not support TLS. Using libev instead.";
+        return false;
+    }
+    return true;
+}
+
+void Server::startReactors() {
+    unsigned int count = static_cast<unsigned int> (StartupConfig::getDouble("reactor_threads"));
+    LOG(INFO) << "Starting " << count << " reactor threads.";
+    for (unsigned int i = 0; i < count; ++i) {
+        Reactor* reactor = new Reactor(i);
+        reactor->startThread();
+        reactors.push_back(reactor);
+    }
+}
+
+void Server::stopReactors() {
+    for (auto reactor : reactors) {
+        reactor->stopThread();
+        delete reactor;
+    }
+    reactors.clear();
+}
+
 int Server::bindAndListen() {
     struct sockaddr_in server_addr;
     int re_use = 1;
@@ -749,7 +1157,8 @@ int Server::bindAndListen() {
             break;
     }
 
-    if (listen(listensock, MAX_WAITING_FOR_ACCEPT) < 0)
+    int backlog = static_cast<int> (StartupConfig::getDouble("listen_backlog"));
+    if (listen(listensock, backlog > 0 ? backlog : DEFAULT_LISTEN_BACKLOG) < 0)
         LOG(FATAL) << "Could not listen on socket.";
 
     LOG(INFO) << "Bound and listening on socket.";
@@ -798,18 +1207,15 @@ FReturnCode Server::processLogin(ConnectionInstance* instance, string &message,
         return FERR_LOGIN_TIMED_OUT;
 
     luaTimer = luaGetTime();
-    json_t* n = json_loads(message.c_str(), 0, 0);
-    if (!n) {
-        return ret;
-    }
-
     int top = lua_gettop(sL);
     lua_getglobal(sL, "on_error");
     lua_getglobal(sL, "event");
     lua_getfield(sL, -1, "ident_callback");
     lua_pushlightuserdata(sL, instance);
-    LuaChat::jsonToLua(sL, n);
-    json_decref(n);
+    if (!LuaJSON::decode(sL, message.data(), message.length())) {
+        lua_settop(sL, top);
+        return ret;
+    }
     if (lua_pcall(sL, 2, 1, LUA_ABSINDEX(sL, -5))) {
         LOG(WARNING) << "Lua error while calling ident_callback. Error returned was: " << lua_tostring(sL, -1);
         lua_pop(sL, 3);
@@ -823,40 +1229,46 @@ FReturnCode Server::processLogin(ConnectionInstance* instance, string &message,
         if (top != lua_gettop(sL)) {
             DLOG(FATAL) << "Did not return stack to its previous condition. O: " << top << " N: " << lua_gettop(sL);
         }
-        ev_timer_start(server_loop, instance->pingEvent);
+        instance->startPing();
         return ret;
     }
 
     return ret;
 }
 
-FReturnCode Server::runLuaEvent(ConnectionInstance* instance, string &event, string &payload) {
+/*
+ * Known commands call the handler referenced when the state was loaded. Anything else is still looked up by name, in
+ * case main.lua handles commands the table doesn't know about.
+ */
+FReturnCode Server::runLuaEvent(ConnectionInstance* instance, CommandId id, string &event, string &payload) {
     luaTimer = luaGetTime();
 
-    json_t* root = json_loads(payload.c_str(), 0, 0);
-    if (!root && (payload.length() == 0)) {
-        root = json_object();
-    } else if (!root) {
-        return FERR_BAD_SYNTAX;
-    }
-
+    // The arguments are decoded first, so that bad syntax is reported before an unknown command.
     lua_State* L = instance->debugL ? instance->debugL : sL;
+    const LuaHandlers& handlers = instance->debugL ? *instance->debugHandlers : luaHandlers;
     int top = lua_gettop(L);
-    lua_getglobal(L, "on_error");
-    lua_getglobal(L, "event");
-    lua_getfield(L, -1, event.c_str());
+    if (payload.length() == 0)
+        lua_newtable(L);
+    else if (!LuaJSON::decode(L, payload.data(), payload.length()))
+        return FERR_BAD_SYNTAX;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, handlers.onError);
+    if (id != CMD_UNKNOWN) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, handlers.events[id]);
+    } else {
+        lua_getglobal(L, "event");
+        lua_getfield(L, -1, event.c_str());
+        lua_remove(L, -2);
+    }
     if (lua_type(L, -1) != LUA_TFUNCTION) {
         lua_pop(L, 3);
         if (top != lua_gettop(L)) {
             DLOG(FATAL) << "Did not return stack to its previous condition. O: " << top << " N: " << lua_gettop(L);
         }
-        json_decref(root);
         return FERR_UNKNOWN_COMMAND;
     }
     lua_pushlightuserdata(L, instance);
-    LuaChat::jsonToLua(L, root);
-    json_decref(root);
-    int ret = lua_pcall(L, 2, 1, LUA_ABSINDEX(L, -5));
+    lua_pushvalue(L, top + 1);
+    int ret = lua_pcall(L, 2, 1, top + 2);
     if (ret != 0) {
         LOG(WARNING) << "Lua error while calling command '" << event << "' with message '" << payload
                      << "'. Error return by Lua: \n" << lua_tostring(L, -1);
@@ -879,13 +1291,50 @@ FReturnCode Server::runLuaEvent(ConnectionInstance* instance, string &event, str
     return FERR_FATAL_INTERNAL;
 }
 
-void Server::runLuaRTB(string &event, string &payload) {
+/**
+ * Calls policy.<command>(con, args, condition) for a natively handled command that hit a condition listed in
+ * native_policy_hooks. Without a policy function the command does what it would have done without the hook.
+ */
+FReturnCode Server::runLuaPolicy(ConnectionInstance* instance, CommandId id, const char* condition, string& payload) {
     luaTimer = luaGetTime();
 
-    json_t* root = json_loads(payload.c_str(), 0, 0);
-    if (!root) {
-        return;
+    lua_State* L = instance->debugL ? instance->debugL : sL;
+    const LuaHandlers& handlers = instance->debugL ? *instance->debugHandlers : luaHandlers;
+    int top = lua_gettop(L);
+    if (!LuaJSON::decode(L, payload.data(), payload.length()))
+        return FERR_BAD_SYNTAX;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, handlers.onError);
+    lua_getglobal(L, "policy");
+    if (lua_type(L, -1) == LUA_TTABLE)
+        lua_getfield(L, -1, CommandTable::name(id));
+    else
+        lua_pushnil(L);
+    lua_remove(L, -2);
+    if (lua_type(L, -1) != LUA_TFUNCTION) {
+        lua_settop(L, top);
+        return FERR_OK;
+    }
+    lua_pushlightuserdata(L, instance);
+    lua_pushvalue(L, top + 1);
+    lua_pushstring(L, condition);
+    int ret = lua_pcall(L, 3, 1, top + 2);
+    FReturnCode returncode = FERR_LUA;
+    if (ret != 0) {
+        LOG(WARNING) << "Lua error while calling the " << condition << " policy for '" << CommandTable::name(id)
+                     << "' with message '" << payload << "'. Error return by Lua: \n" << lua_tostring(L, -1);
+        instance->sendError(FERR_LUA, lua_tostring(L, -1));
+    } else {
+        returncode = (int) lua_tointeger(L, -1);
+    }
+    lua_pop(L, 3);
+    if (top != lua_gettop(L)) {
+        DLOG(FATAL) << "Did not return stack to its previous condition. O: " << top << " N: " << lua_gettop(L);
     }
+    return returncode;
+}
+
+void Server::runLuaRTB(string &event, string &payload) {
+    luaTimer = luaGetTime();
 
     lua_State* L = sL;
     int top = lua_gettop(L);
@@ -897,12 +1346,13 @@ void Server::runLuaRTB(string &event, string &payload) {
         if (top != lua_gettop(L)) {
             DLOG(FATAL) << "Did not return stack to its previous condition. O: " << top << " N: " << lua_gettop(L);
         }
-        json_decref(root);
         return;
     }
 
-    LuaChat::jsonToLua(L, root);
-    json_decref(root);
+    if (!LuaJSON::decode(L, payload.data(), payload.length())) {
+        lua_pop(L, 3);
+        return;
+    }
     int ret = lua_pcall(L, 1, 1, LUA_ABSINDEX(L, -4));
     if (ret != 0) {
         LOG(WARNING) << "Lua error while calling RTB command '" << event << "' with message '" << payload
@@ -1034,6 +1484,7 @@ FReturnCode Server::reloadLuaState(string &output) {
     if (ret == FERR_OK) {
         lua_close(sL);
         sL = newstate;
+        loadLuaHandlers(sL, luaHandlers);
         LOG(WARNING) << "The global Lua state has been reloaded.";
     } else {
         lua_close(newstate);
@@ -1241,6 +1692,25 @@ void Server::initLua() {
                      << lua_typename(sL, -1);
     }
     lua_pop(sL, 1);
+    loadLuaHandlers(sL, luaHandlers);
+}
+
+/*
+ * Handlers are looked up once per state instead of once per command. Commands main.lua doesn't handle get
+ * LUA_REFNIL, which pushes nil.
+ */
+void Server::loadLuaHandlers(lua_State* L, LuaHandlers& handlers) {
+    lua_getglobal(L, "on_error");
+    handlers.onError = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_getglobal(L, "event");
+    for (int i = 0; i < CMD_COUNT; ++i) {
+        if (lua_istable(L, -1))
+            lua_getfield(L, -1, CommandTable::name(static_cast<CommandId> (i)));
+        else
+            lua_pushnil(L);
+        handlers.events[i] = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_pop(L, 1);
 }
 
 void Server::shutdownLua() {
@@ -1270,17 +1740,27 @@ void Server::initAsyncLoop() {
     server_prepare = new ev_prepare;
     ev_prepare_init(server_prepare, Server::prepareCallback);
     ev_prepare_start(server_loop, server_prepare);
+    server_wheel = new TimingWheel(server_loop, Server::connectionWheelCallback);
+    server_flush = startFlushStage(server_loop);
+    pingMessage = MessagePtr(MessageBuffer::fromString("PIN"));
     server_async = new ev_async;
     ev_async_init(server_async, Server::processWakeupCallback);
     ev_async_start(server_loop, server_async);
     http_async = new ev_async;
     ev_async_init(http_async, Server::processHTTPWakeup);
     ev_async_start(server_loop, http_async);
+    reactor_async = new ev_async;
+    ev_async_init(reactor_async, Server::processReactorWakeup);
+    ev_async_start(server_loop, reactor_async);
 }
 
 void Server::shutdownAsyncLoop() {
     DLOG(INFO) << "Shutting down event loop and async wakeup.";
 
+    ev_async_stop(server_loop, reactor_async);
+    delete reactor_async;
+    reactor_async = nullptr;
+
     ev_async_stop(server_loop, http_async);
     delete http_async;
     http_async = nullptr;
@@ -1293,6 +1773,12 @@ void Server::shutdownAsyncLoop() {
     delete server_prepare;
     server_prepare = nullptr;
 
+    delete server_wheel;
+    server_wheel = nullptr;
+
+    stopFlushStage(server_loop, server_flush);
+    server_flush = nullptr;
+
     //ev_loop_destroy(server_loop);
     server_loop = 0;
 }
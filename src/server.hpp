@@ -35,12 +35,30 @@
 #include "logger_thread.hpp"
 #include "redis.hpp"
 #include "ferror.hpp"
+#include "messagebuffer.hpp"
+#include "command_table.hpp"
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
 #include <tr1/unordered_set>
+#include <boost/intrusive_ptr.hpp>
+#include <netinet/in.h>
 
 class ConnectionInstance;
 class HTTPReply;
+class Reactor;
+class Uring;
+class TimingWheel;
+
+typedef boost::intrusive_ptr<ConnectionInstance> ConnectionPtr;
+
+// Registry references to a Lua state's on_error and event handlers, taken once its scripts have loaded.
+struct LuaHandlers {
+    int onError;
+    int events[CMD_COUNT];
+};
 
 using std::string;
 using std::tr1::unordered_set;
@@ -52,11 +70,17 @@ public:
 
     static void sendWakeup();
     static void sendHTTPWakeup();
+    static void sendReactorWakeup();
     static FReturnCode loadLuaIntoState(lua_State* tL, string& output, bool testing);
     static FReturnCode reloadLuaState(string& output);
+    static void loadLuaHandlers(lua_State* L, LuaHandlers& handlers);
+    static FReturnCode runLuaPolicy(ConnectionInstance* instance, CommandId id, const char* condition, string& payload);
     static void startShutdown();
     static double getEventTime();
     static bool parseLBList();
+    static bool isValidLB(uint32_t address);
+    static void scheduleConnection(ConnectionInstance* con);
+    static void queueFlush(ConnectionInstance* con);
 
     static unsigned long long getAcceptedConnections() {
         return statAcceptedConnections;
@@ -74,6 +98,8 @@ public:
     static void loggerStop();
 
 private:
+    friend class Reactor;
+    friend class Uring;
 
     Server() { }
 
@@ -81,21 +107,39 @@ private:
 
     static void processWakeupCallback(struct ev_loop* loop, ev_async* w, int revents);
     static void processHTTPWakeup(struct ev_loop* loop, ev_async* w, int revents);
+    static void processReactorWakeup(struct ev_loop* loop, ev_async* w, int revents);
     static void idleTasksCallback(struct ev_loop* loop, ev_timer* w, int revents);
     static void listenCallback(struct ev_loop* loop, ev_io* w, int revents);
+    static void listenResumeCallback(struct ev_loop* loop, ev_timer* w, int revents);
     static void rtbCallback(struct ev_loop* loop, ev_io* w, int revents);
-    static void handshakeCallback(struct ev_loop* loop, ev_io* w, int revents);
     static void connectionReadCallback(struct ev_loop* loop, ev_io* w, int revents);
     static void connectionWriteCallback(struct ev_loop* loop, ev_io* w, int revents);
     static void connectionTimerCallback(struct ev_loop* loop, ev_timer* w, int revents);
+    static void flushCallback(struct ev_loop* loop, ev_check* w, int revents);
     static void prepareCallback(struct ev_loop* loop, ev_prepare* w, int revents);
-    static void pingCallback(struct ev_loop* loop, ev_timer* w, int revents);
-
+    static void connectionWheelCallback(ConnectionInstance* con, ev_tstamp now);
+    static ev_tstamp connectionTimeout(ConnectionInstance* con);
+
+    static ConnectionPtr acceptConnection(struct ev_loop* loop, int newfd, struct sockaddr_in& accept_addr, Uring* uring);
+    static void processHandshake(struct ev_loop* loop, ConnectionPtr& con, int fd);
+    static void processTLSHandshake(struct ev_loop* loop, ConnectionPtr& con, int fd);
+    static void processMessages(struct ev_loop* loop, ConnectionPtr& con, int fd);
+    static bool writeConnection(ConnectionInstance* con);
+    static void connectionReceived(struct ev_loop* loop, ConnectionPtr& con, int fd, const char* data, size_t length);
+    static void dispatchMessage(ConnectionPtr& con, string& command, string& payload);
     static void prepareShutdownConnection(ConnectionInstance* instance);
     static void shutdownConnection(ConnectionInstance* instance);
+    static void runLuaDisconnect(ConnectionInstance* instance);
 
     static int bindAndListen();
+    static ev_io* startListener(struct ev_loop* loop, int fd);
+    static void stopListener(struct ev_loop* loop, ev_io* listen);
+    static ev_check* startFlushStage(struct ev_loop* loop);
+    static void stopFlushStage(struct ev_loop* loop, ev_check* flush);
     static int bindAndListenRTB();
+    static bool useUring();
+    static void startReactors();
+    static void stopReactors();
     static void initTimer();
     static void shutdownTimer();
     static void initLua();
@@ -103,7 +147,7 @@ private:
     static void initAsyncLoop();
     static void shutdownAsyncLoop();
 
-    static FReturnCode runLuaEvent(ConnectionInstance* instance, string& event, string& payload);
+    static FReturnCode runLuaEvent(ConnectionInstance* instance, CommandId id, string& event, string& payload);
     static void runLuaRTB(string& event, string& payload);
     static int luaOnError(lua_State* L1);
     static int luaError(lua_State* L1);
@@ -117,12 +161,21 @@ private:
     static struct ev_loop* server_loop;
     static ev_async* server_async;
     static ev_async* http_async;
+    static ev_async* reactor_async;
     static ev_timer* server_timer;
     static ev_io* server_listen;
     static ev_io* rtb_listen;
     static ev_prepare* server_prepare;
+    static Uring* server_uring;
+    static TimingWheel* server_wheel;
+    static ev_check* server_flush;
+    // Connections with writes waiting for this thread's flush stage.
+    static thread_local std::deque<ConnectionPtr> flushQueue;
+    // Every ping is the same frame, so they all share one buffer.
+    static MessagePtr pingMessage;
 
     static lua_State* sL;
+    static LuaHandlers luaHandlers;
     static ev_tstamp luaTimer;
     static double luaTimeout;
     static double luaRepeatTimeout;
@@ -131,10 +184,15 @@ private:
 
     static ChatLogThread* chatLogger;
 
+    static std::vector<Reactor*> reactors;
+
+    static int acceptBudget;
+
     static unordered_set<uint32_t> validLBs;
+    static pthread_mutex_t lbMutex;
 
     // Stats
-    static unsigned long long statAcceptedConnections;
+    static std::atomic<unsigned long long> statAcceptedConnections;
     static unsigned long long statStartTime;
 };
 
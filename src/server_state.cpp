@@ -26,6 +26,7 @@
 #include "precompiled_headers.hpp"
 #include "server_state.hpp"
 #include "channel.hpp"
+#include "channel_directory.hpp"
 #include "fjson.hpp"
 #include "logging.hpp"
 #include "redis.hpp"
@@ -37,9 +38,17 @@
 #include <fstream>
 
 conptrmap_t ServerState::connectionMap;
-concountmap_t ServerState::connectionCountMap;
+accountconmap_t ServerState::accountIndex;
+ipconmap_t ServerState::ipIndex;
+roleconmap_t ServerState::roleIndex;
+conptrlist_t ServerState::onlineOps;
+const conptrlist_t ServerState::emptyList;
+conptrlist_t ServerState::userList;
+vector<MessagePtr> ServerState::userListFrames;
+string ServerState::userListPrefix;
+size_t ServerState::userListSplit = 0;
 chanptrmap_t ServerState::channelMap;
-conptrlist_t ServerState::unidentifiedList;
+conlinklist_t ServerState::unidentifiedList;
 oplist_t ServerState::opList;
 banlist_t ServerState::banList;
 timeoutmap_t ServerState::timeoutList;
@@ -52,6 +61,39 @@ long ServerState::userCount = 0;
 long ServerState::maxUserCount = 0;
 long ServerState::channelSeed = 0;
 
+/*
+ * Index lists are unordered, so removal swaps the last entry into the hole instead of shifting the tail down.
+ */
+static bool unlinkConnection(conptrlist_t& list, ConnectionInstance* con) {
+    for (conptrlist_t::iterator i = list.begin(); i != list.end(); ++i) {
+        if (i->get() == con) {
+            *i = list.back();
+            list.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename Index, typename Key>
+static void unindexConnection(Index& index, const Key& key, ConnectionInstance* con) {
+    typename Index::iterator i = index.find(key);
+    if (i == index.end())
+        return;
+    unlinkConnection(i->second, con);
+    if (i->second.empty())
+        index.erase(i);
+}
+
+static string lowerName(const string& name) {
+    string lname = name;
+    int size = lname.size();
+    for (int i = 0; i < size; ++i) {
+        lname[i] = (char) tolower(lname[i]);
+    }
+    return lname;
+}
+
 bool ServerState::fsaveFile(const char* name, string& contents) {
     std::ofstream file;
     file.open(name, std::ios::trunc);
@@ -147,7 +189,7 @@ void ServerState::cleanupChannels() {
 }
 
 void ServerState::removeUnusedChannels() {
-    const chanptrmap_t chans = getChannels();
+    const chanptrmap_t& chans = getChannels();
     list<string> toremove;
     time_t timeout = time(NULL)-(60 * 60 * 24);
     for (chanptrmap_t::const_iterator i = chans.begin(); i != chans.end(); ++i) {
@@ -357,38 +399,163 @@ void ServerState::sendUserListToRedis() {
 }
 
 void ServerState::addUnidentified(ConnectionPtr con) {
-    unidentifiedList.push_back(con);
+    if (con->unidentifiedHook.is_linked())
+        return;
+    intrusive_ptr_add_ref(con.get());
+    unidentifiedList.push_back(*con);
 }
 
 void ServerState::removedUnidentified(ConnectionPtr con) {
-    unidentifiedList.remove(con);
+    if (!con->unidentifiedHook.is_linked())
+        return;
+    unidentifiedList.erase(unidentifiedList.iterator_to(*con));
+    intrusive_ptr_release(con.get());
 }
 
 void ServerState::addConnection(string& name, ConnectionPtr con) {
-    connectionCountMap[(int) con->clientAddress.sin_addr.s_addr] += 1;
-    //DLOG(INFO) << "IP " << (int)con->clientAddress.sin_addr.s_addr << " now has " << connectionCountMap[(int)con->clientAddress.sin_addr.s_addr] << " connections.";
+    // Replacing an entry in place would leave the old connection in every index.
+    if (connectionMap.find(name) != connectionMap.end()) {
+        string oldname = name;
+        removeConnection(oldname);
+    }
     connectionMap[name] = con;
+    ipIndex[(int) con->clientAddress.sin_addr.s_addr].push_back(con);
+    if (con->accountID != 0)
+        accountIndex[con->accountID].push_back(con);
+    for (stringset_t::const_iterator i = con->roles.begin(); i != con->roles.end(); ++i) {
+        roleIndex[*i].push_back(con);
+    }
+    if (isOp(con->characterName))
+        onlineOps.push_back(con);
+    con->userListSlot = userList.size();
+    userList.push_back(con);
+    invalidateUserList(con->userListSlot);
     ++userCount;
     if (userCount > maxUserCount)
         maxUserCount = userCount;
 }
 
 void ServerState::removeConnection(string& name) {
-    if (connectionMap.find(name) != connectionMap.end()) {
-        int addr = (int) connectionMap[name]->clientAddress.sin_addr.s_addr;
-        connectionCountMap[addr] -= 1;
-        //DLOG(INFO) << "IP " << addr << " now has " << connectionCountMap[addr] << " connections.";
-        if (connectionCountMap[addr] <= 0) {
-            //DLOG(INFO) << "IP " << addr << " has been removed because it no longer has any connections.";
-            connectionCountMap.erase(addr);
+    conptrmap_t::iterator entry = connectionMap.find(name);
+    if (entry != connectionMap.end()) {
+        ConnectionPtr con = entry->second;
+        unindexConnection(ipIndex, (int) con->clientAddress.sin_addr.s_addr, con.get());
+        unindexConnection(accountIndex, con->accountID, con.get());
+        for (stringset_t::const_iterator i = con->roles.begin(); i != con->roles.end(); ++i) {
+            unindexConnection(roleIndex, *i, con.get());
         }
+        unlinkConnection(onlineOps, con.get());
+        size_t slot = con->userListSlot;
+        userList[slot] = userList.back();
+        userList[slot]->userListSlot = slot;
+        userList.pop_back();
+        invalidateUserList(slot);
+        invalidateUserList(userList.size());
         // Need to remove staff call target if there is one, or connections get leaked..
-        staffCallTargets.erase(connectionMap[name]);
-        connectionMap.erase(name);
+        staffCallTargets.erase(con);
+        connectionMap.erase(entry);
         --userCount;
     }
 }
 
+static MessagePtr userListFrame(const string& prefix, const conptrlist_t& list, size_t begin, size_t end) {
+    json_t* rootnode = json_object();
+    json_t* arraynode = json_array();
+    for (size_t i = begin; i < end; ++i) {
+        const ConnectionPtr& con = list[i];
+        json_t* cha = json_array();
+        json_array_append_new(cha, json_string_nocheck(con->characterName.c_str()));
+        json_array_append_new(cha, json_string_nocheck(con->gender.c_str()));
+        json_array_append_new(cha, json_string_nocheck(con->status.c_str()));
+        json_t* status = json_string(con->statusMessage.c_str());
+        if (!status)
+            status = json_string_nocheck("");
+        json_array_append_new(cha, status);
+        json_array_append_new(arraynode, cha);
+    }
+    json_object_set_new_nocheck(rootnode, "characters", arraynode);
+    MessagePtr message(MessageBuffer::fromJSON(prefix.c_str(), rootnode));
+    json_decref(rootnode);
+    return message;
+}
+
+/*
+ * There is always one more frame than there are full frames, like when the list was built for every request, so a
+ * list that divides evenly still ends with an empty frame.
+ */
+const vector<MessagePtr>& ServerState::getUserListFrames(const string& prefix, size_t split) {
+    if (prefix != userListPrefix || split != userListSplit) {
+        userListPrefix = prefix;
+        userListSplit = split;
+        userListFrames.clear();
+    }
+    userListFrames.resize(userList.size() / split + 1);
+    size_t frames = userListFrames.size();
+    for (size_t i = 0; i < frames; ++i) {
+        if (userListFrames[i])
+            continue;
+        size_t begin = i * split;
+        size_t end = begin + split < userList.size() ? begin + split : userList.size();
+        userListFrames[i] = userListFrame(prefix, userList, begin, end);
+    }
+    return userListFrames;
+}
+
+void ServerState::invalidateUserList(size_t slot) {
+    if (!userListSplit)
+        return;
+    userListFrames.resize(userList.size() / userListSplit + 1);
+    size_t frame = slot / userListSplit;
+    if (frame < userListFrames.size())
+        userListFrames[frame] = 0;
+}
+
+void ServerState::userListChanged(ConnectionPtr con) {
+    if (isRegistered(con))
+        invalidateUserList(con->userListSlot);
+}
+
+bool ServerState::isRegistered(ConnectionPtr con) {
+    conptrmap_t::const_iterator i = connectionMap.find(con->characterNameLower);
+    return i != connectionMap.end() && i->second == con;
+}
+
+const conptrlist_t& ServerState::getConnectionsByAccount(long accountid) {
+    accountconmap_t::const_iterator i = accountIndex.find(accountid);
+    return i != accountIndex.end() ? i->second : emptyList;
+}
+
+const conptrlist_t& ServerState::getConnectionsByIP(ConnectionPtr con) {
+    ipconmap_t::const_iterator i = ipIndex.find((int) con->clientAddress.sin_addr.s_addr);
+    return i != ipIndex.end() ? i->second : emptyList;
+}
+
+const conptrlist_t& ServerState::getConnectionsByRole(const string& role) {
+    roleconmap_t::const_iterator i = roleIndex.find(role);
+    return i != roleIndex.end() ? i->second : emptyList;
+}
+
+void ServerState::setAccountID(ConnectionPtr con, long accountid) {
+    if (con->accountID == accountid)
+        return;
+    bool registered = isRegistered(con);
+    if (registered)
+        unindexConnection(accountIndex, con->accountID, con.get());
+    con->accountID = accountid;
+    if (registered && accountid != 0)
+        accountIndex[accountid].push_back(con);
+}
+
+void ServerState::addRole(ConnectionPtr con, const string& role) {
+    if (con->roles.insert(role).second && isRegistered(con))
+        roleIndex[role].push_back(con);
+}
+
+void ServerState::removeRole(ConnectionPtr con, const string& role) {
+    if (con->roles.erase(role) && isRegistered(con))
+        unindexConnection(roleIndex, role, con.get());
+}
+
 ConnectionPtr ServerState::getConnection(string& name) {
     if (connectionMap.find(name) != connectionMap.end())
         return connectionMap[name];
@@ -397,7 +564,7 @@ ConnectionPtr ServerState::getConnection(string& name) {
 }
 
 const int ServerState::getConnectionIPCount(ConnectionPtr con) {
-    return connectionCountMap[(int) con->clientAddress.sin_addr.s_addr];
+    return getConnectionsByIP(con).size();
 }
 
 string ServerState::generatePrivateChannelID(ConnectionPtr con, string& title) {
@@ -438,12 +605,18 @@ void ServerState::addChannel(string& name, Channel* channel) {
         lname[i] = (char) tolower(lname[i]);
     }
     ChannelPtr chan(channel);
+    chanptrmap_t::iterator old = channelMap.find(lname);
+    if (old != channelMap.end())
+        ChannelDirectory::remove(old->second.get());
     channelMap[lname] = chan;
+    ChannelDirectory::add(channel);
 }
 
 void ServerState::removeChannel(string& name) {
-    if (channelMap.find(name) != channelMap.end()) {
-        channelMap.erase(name);
+    chanptrmap_t::iterator i = channelMap.find(name);
+    if (i != channelMap.end()) {
+        ChannelDirectory::remove(i->second.get());
+        channelMap.erase(i);
     }
 }
 
@@ -455,11 +628,26 @@ ChannelPtr ServerState::getChannel(string& name) {
 }
 
 void ServerState::addOp(string& op) {
-    opList.insert(op);
+    if (!opList.insert(op).second)
+        return;
+    string lname = lowerName(op);
+    ConnectionPtr con = getConnection(lname);
+    if (con)
+        onlineOps.push_back(con);
 }
 
 void ServerState::removeOp(string& op) {
-    opList.erase(op);
+    if (!opList.erase(op))
+        return;
+    string lname = lowerName(op);
+    ConnectionPtr con = getConnection(lname);
+    if (con)
+        unlinkConnection(onlineOps, con.get());
+}
+
+void ServerState::clearOps() {
+    opList.clear();
+    onlineOps.clear();
 }
 
 bool ServerState::isOp(string& op) {
@@ -564,11 +752,10 @@ void ServerState::removeStaffCallTarget(ConnectionPtr con) {
 
 void ServerState::rebuildChannelOpList() {
     channelOpList.clear();
-    const chanptrmap_t chans = getChannels();
+    const chanptrmap_t& chans = getChannels();
     for (chanptrmap_t::const_iterator i = chans.begin(); i != chans.end(); ++i) {
         if (i->second->getType() == CT_PUBLIC) {
-            ChannelPtr chan = i->second;
-            const chmodmap_t mods = chan->getModRecords();
+            const chmodmap_t& mods = i->second->getModRecords();
             for (chmodmap_t::const_iterator m = mods.begin(); m != mods.end(); ++m) {
                 if (m->first != "") {
                     channelOpList.insert(m->first);
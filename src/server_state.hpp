@@ -29,6 +29,7 @@
 #include <tr1/unordered_map>
 #include <tr1/unordered_set>
 #include <list>
+#include <boost/intrusive/list.hpp>
 #include <time.h>
 
 #include "connection.hpp"
@@ -62,9 +63,14 @@ typedef struct {
 
 
 typedef unordered_map<string, ConnectionPtr> conptrmap_t; //character name lower, connection
-typedef unordered_map<int, int> concountmap_t; //IP, count
+typedef vector<ConnectionPtr> conptrlist_t;
+typedef unordered_map<long, conptrlist_t> accountconmap_t; //account id, connections
+typedef unordered_map<int, conptrlist_t> ipconmap_t; //IP, connections
+typedef unordered_map<string, conptrlist_t> roleconmap_t; //role, connections
 typedef unordered_map<string, ChannelPtr> chanptrmap_t; //channel name lower, channel
-typedef list<ConnectionPtr> conptrlist_t;
+typedef boost::intrusive::list<ConnectionInstance,
+        boost::intrusive::member_hook<ConnectionInstance, boost::intrusive::list_member_hook<>,
+                &ConnectionInstance::unidentifiedHook> > conlinklist_t; //holds a reference on each connection
 typedef unordered_set<string, case_insensitive_hash, case_insensitive_compare> oplist_t; //op name
 typedef unordered_map<long, string> banlist_t; //account id, character name lower
 typedef unordered_map<long, TimeoutRecord> timeoutmap_t; //account id, timeout record
@@ -115,6 +121,29 @@ public:
     }
     static const int getConnectionIPCount(ConnectionPtr con);
 
+    /*
+     * Secondary indexes over the identified connections. They are kept up to date as connections are added and
+     * removed, so the lists returned here are only valid until the next change to the connection map.
+     */
+    static const conptrlist_t& getConnectionsByAccount(long accountid);
+    static const conptrlist_t& getConnectionsByIP(ConnectionPtr con);
+    static const conptrlist_t& getConnectionsByRole(const string& role);
+
+    static const conptrlist_t& getOnlineOps() {
+        return onlineOps;
+    }
+
+    /*
+     * The online user list is kept as frames of split characters each, for one prefix and split at a time. A frame is
+     * rebuilt the next time it is asked for after one of its characters joined, left or changed.
+     */
+    static const vector<MessagePtr>& getUserListFrames(const string& prefix, size_t split);
+    static void userListChanged(ConnectionPtr con);
+
+    static void setAccountID(ConnectionPtr con, long accountid);
+    static void addRole(ConnectionPtr con, const string& role);
+    static void removeRole(ConnectionPtr con, const string& role);
+
     static const long getConnectionCount() {
         return connectionMap.size();
     }
@@ -135,9 +164,7 @@ public:
     static void addOp(string& op);
     static void removeOp(string& op);
     static bool isOp(string& op);
-    static void clearOps() {
-        opList.clear();
-    }
+    static void clearOps();
 
     static const oplist_t& getOpList() {
         return opList;
@@ -198,14 +225,24 @@ private:
     ~ServerState() { }
 
     static void loadStringList(string filename, stringFunctionTarget target, clearFunction clear);
+    static bool isRegistered(ConnectionPtr con);
+    static void invalidateUserList(size_t slot);
 
     static long userCount;
     static long maxUserCount;
     static long channelSeed;
     static conptrmap_t connectionMap;
-    static concountmap_t connectionCountMap;
+    static accountconmap_t accountIndex;
+    static ipconmap_t ipIndex;
+    static roleconmap_t roleIndex;
+    static conptrlist_t onlineOps;
+    static const conptrlist_t emptyList;
+    static conptrlist_t userList;
+    static vector<MessagePtr> userListFrames;
+    static string userListPrefix;
+    static size_t userListSplit;
     static chanptrmap_t channelMap;
-    static conptrlist_t unidentifiedList;
+    static conlinklist_t unidentifiedList;
     static oplist_t opList;
     static banlist_t banList;
     static timeoutmap_t timeoutList;
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "precompiled_headers.hpp"
+
+#include "timing_wheel.hpp"
+#include "logging.hpp"
+
+#include <math.h>
+
+TimingWheel::TimingWheel(struct ev_loop* loop, Callback callback)
+:
+loop(loop),
+callback(callback),
+start(ev_now(loop)),
+ticks(0) {
+    ev_timer_init(&tickEvent, TimingWheel::tickCallback, WHEEL_RESOLUTION, WHEEL_RESOLUTION);
+    tickEvent.data = this;
+    ev_timer_start(loop, &tickEvent);
+}
+
+/*
+ * Connections still on the wheel keep the reference it held. This only happens when the server is stopping.
+ */
+TimingWheel::~TimingWheel() {
+    ev_timer_stop(loop, &tickEvent);
+    for (int i = 0; i < WHEEL_SLOTS; ++i) {
+        nearSlots[i].clear();
+        farSlots[i].clear();
+    }
+}
+
+void TimingWheel::schedule(ConnectionInstance* con, ev_tstamp when) {
+    if (con->wheelHook.is_linked())
+        con->wheelHook.unlink();
+    else
+        intrusive_ptr_add_ref(con);
+    con->wheelDeadline = when;
+    insert(con, ticks + 1);
+}
+
+void TimingWheel::cancel(ConnectionInstance* con) {
+    if (!con->wheelHook.is_linked())
+        return;
+    con->wheelHook.unlink();
+    intrusive_ptr_release(con);
+}
+
+/*
+ * Slots up to the current tick have already been expired, except while cascading into the near level, which happens
+ * just before the current slot is expired.
+ */
+void TimingWheel::insert(ConnectionInstance* con, unsigned long long earliest) {
+    double offset = ceil((con->wheelDeadline - start) / WHEEL_RESOLUTION);
+    unsigned long long tick = offset > earliest ? static_cast<unsigned long long> (offset) : earliest;
+    if (tick - ticks < WHEEL_SLOTS) {
+        nearSlots[tick % WHEEL_SLOTS].push_back(*con);
+        return;
+    }
+
+    // Anything past the far level's range waits in its last slot, and is placed again when that slot cascades.
+    unsigned long long farTick = tick / WHEEL_SLOTS;
+    unsigned long long lastFarTick = ticks / WHEEL_SLOTS + WHEEL_SLOTS - 1;
+    if (farTick > lastFarTick)
+        farTick = lastFarTick;
+    farSlots[farTick % WHEEL_SLOTS].push_back(*con);
+}
+
+void TimingWheel::tickCallback(struct ev_loop* loop, ev_timer* w, int revents) {
+    TimingWheel* wheel = static_cast<TimingWheel*> (w->data);
+    wheel->advance(ev_now(loop));
+}
+
+/*
+ * Catches up on every tick that has passed, so a loop that was held up doesn't skip any slots.
+ */
+void TimingWheel::advance(ev_tstamp now) {
+    while (start + (ticks + 1) * WHEEL_RESOLUTION <= now) {
+        ++ticks;
+        if (ticks % WHEEL_SLOTS == 0)
+            cascade(farSlots[(ticks / WHEEL_SLOTS) % WHEEL_SLOTS]);
+        expire(nearSlots[ticks % WHEEL_SLOTS], now);
+    }
+}
+
+void TimingWheel::cascade(wheellist_t& slot) {
+    wheellist_t moving;
+    moving.swap(slot);
+    while (!moving.empty()) {
+        ConnectionInstance* con = &moving.front();
+        moving.pop_front();
+        insert(con, ticks);
+    }
+}
+
+void TimingWheel::expire(wheellist_t& slot, ev_tstamp now) {
+    // The callback can schedule or cancel anything, including entries still waiting in this slot.
+    wheellist_t due;
+    due.swap(slot);
+    while (!due.empty()) {
+        ConnectionInstance* con = &due.front();
+        due.pop_front();
+        if (con->wheelDeadline > now) {
+            insert(con, ticks + 1);
+            continue;
+        }
+        ConnectionPtr ptr(con);
+        intrusive_ptr_release(con);
+        callback(con, now);
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FSERV_TIMING_WHEEL_H
+#define FSERV_TIMING_WHEEL_H
+
+#include <ev.h>
+#include <boost/intrusive/list.hpp>
+#include "connection.hpp"
+
+// Seconds per tick.
+#define WHEEL_RESOLUTION 1.
+// Slots per level. The near level covers 64 seconds and the far level a little over an hour.
+#define WHEEL_SLOTS 64
+
+typedef boost::intrusive::list<ConnectionInstance,
+        boost::intrusive::member_hook<ConnectionInstance, wheelhook_t, &ConnectionInstance::wheelHook>,
+        boost::intrusive::constant_time_size<false> > wheellist_t;
+
+/**
+ * Two level timing wheel for the timeouts of the connections on one event loop.
+ *
+ * A single repeating libev timer advances the wheel, so scheduling and cancelling are O(1) list operations no matter
+ * how many connections there are. Each connection has at most one entry, for whichever of its deadlines comes first,
+ * and the callback is expected to work out which one it was and schedule the next. Deadlines are rounded up to the
+ * next tick, so a callback runs up to WHEEL_RESOLUTION late but never early.
+ *
+ * A scheduled connection holds a reference. The wheel must only be used from its loop's thread.
+ */
+class TimingWheel {
+public:
+    typedef void (*Callback)(ConnectionInstance* con, ev_tstamp now);
+
+    TimingWheel(struct ev_loop* loop, Callback callback);
+    ~TimingWheel();
+
+    // Replaces the connection's current entry, if it has one.
+    void schedule(ConnectionInstance* con, ev_tstamp when);
+    void cancel(ConnectionInstance* con);
+private:
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel&) = delete;
+
+    static void tickCallback(struct ev_loop* loop, ev_timer* w, int revents);
+
+    void advance(ev_tstamp now);
+    void insert(ConnectionInstance* con, unsigned long long earliest);
+    void cascade(wheellist_t& slot);
+    void expire(wheellist_t& slot, ev_tstamp now);
+
+    struct ev_loop* loop;
+    Callback callback;
+    ev_timer tickEvent;
+    ev_tstamp start;
+    unsigned long long ticks;
+    wheellist_t nearSlots[WHEEL_SLOTS];
+    wheellist_t farSlots[WHEEL_SLOTS];
+};
+
+#endif //FSERV_TIMING_WHEEL_H
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "precompiled_headers.hpp"
+
+#include "tls.hpp"
+#include "connection.hpp"
+#include "logging.hpp"
+#include "startup_config.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_TICKET_KEY_SIZE 80
+
+static const unsigned char tlsSessionContext[] = "fserv";
+
+SSL_CTX* TLS::context = 0;
+
+static void logErrors(const char* what) {
+    unsigned long error = ERR_get_error();
+    char buffer[256];
+    ERR_error_string_n(error, buffer, sizeof(buffer));
+    LOG(WARNING) << what << ": " << buffer;
+    ERR_clear_error();
+}
+
+bool TLS::configure() {
+    if (!StartupConfig::getBool("tls_enabled"))
+        return true;
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        logErrors("Could not create the TLS context");
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                     SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    string certificate = StartupConfig::getString("tls_certificate");
+    string key = StartupConfig::getString("tls_private_key");
+    if (SSL_CTX_use_certificate_chain_file(ctx, certificate.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        logErrors("Could not load the TLS certificate and private key");
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, static_cast<long> (StartupConfig::getDouble("tls_session_cache_size")));
+    SSL_CTX_set_session_id_context(ctx, tlsSessionContext, sizeof(tlsSessionContext) - 1);
+    context = ctx;
+
+    string ticketKeys = StartupConfig::getString("tls_ticket_key_file");
+    if (ticketKeys.size() && !loadTicketKeys(ticketKeys.c_str())) {
+        shutdown();
+        return false;
+    }
+
+    LOG(INFO) << "TLS enabled with certificate " << certificate << ".";
+    return true;
+}
+
+void TLS::shutdown() {
+    SSL_CTX_free(context);
+    context = 0;
+}
+
+bool TLS::loadTicketKeys(const char* path) {
+    unsigned char keys[TLS_TICKET_KEY_SIZE];
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        LOG(WARNING) << "Could not open the TLS ticket key file " << path << ".";
+        return false;
+    }
+    size_t length = fread(keys, 1, sizeof(keys), file);
+    fclose(file);
+    if (length != sizeof(keys)) {
+        LOG(WARNING) << "The TLS ticket key file " << path << " must contain " << TLS_TICKET_KEY_SIZE << " bytes.";
+        return false;
+    }
+    if (SSL_CTX_set_tlsext_ticket_keys(context, keys, sizeof(keys)) != 1) {
+        logErrors("Could not set the TLS ticket keys");
+        return false;
+    }
+    return true;
+}
+
+SSL* TLS::accept(int fd) {
+    SSL* ssl = SSL_new(context);
+    if (!ssl) {
+        logErrors("Could not create a TLS session");
+        return 0;
+    }
+    SSL_set_fd(ssl, fd);
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+void TLS::release(SSL* ssl) {
+    SSL_free(ssl);
+}
+
+TLSResult TLS::handshake(ConnectionInstance* con) {
+    int ret = SSL_do_handshake(con->ssl);
+    if (ret != 1) {
+        switch (SSL_get_error(con->ssl, ret)) {
+            case SSL_ERROR_WANT_READ:
+                return TLS_WANT_READ;
+            case SSL_ERROR_WANT_WRITE:
+                return TLS_WANT_WRITE;
+            default:
+                // Mostly clients that gave up or don't speak TLS, so this is not worth a warning.
+                ERR_clear_error();
+                return TLS_ERROR;
+        }
+    }
+
+    con->tlsReady = true;
+#ifdef SSL_OP_ENABLE_KTLS
+    con->tlsKernelSend = BIO_get_ktls_send(SSL_get_wbio(con->ssl));
+    // Anything OpenSSL read past the handshake has to be read from it before the socket can be used directly.
+    con->tlsKernelReceive = BIO_get_ktls_recv(SSL_get_rbio(con->ssl)) && !SSL_has_pending(con->ssl);
+#endif
+    DLOG(INFO) << "TLS handshake done with " << SSL_get_version(con->ssl) << (SSL_session_reused(con->ssl) ? ", resumed" : "")
+               << ". Kernel send: " << con->tlsKernelSend << " receive: " << con->tlsKernelReceive;
+    return TLS_DONE;
+}
+
+ssize_t TLS::read(SSL* ssl, char* buffer, size_t length) {
+    int ret = SSL_read(ssl, buffer, static_cast<int> (length));
+    if (ret > 0)
+        return ret;
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            ERR_clear_error();
+            errno = EIO;
+            return -1;
+    }
+}
+
+ssize_t TLS::write(SSL* ssl, const void* buffer, size_t length) {
+    int ret = SSL_write(ssl, buffer, static_cast<int> (length));
+    if (ret > 0)
+        return ret;
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        default:
+            ERR_clear_error();
+            errno = EIO;
+            return -1;
+    }
+}
+
+bool TLS::pending(SSL* ssl) {
+    return SSL_has_pending(ssl) == 1;
+}
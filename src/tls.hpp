@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FSERV_TLS_H
+#define FSERV_TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+class ConnectionInstance;
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+enum TLSResult {
+    TLS_DONE,
+    TLS_WANT_READ,
+    TLS_WANT_WRITE,
+    TLS_ERROR
+};
+
+/**
+ * Optional TLS on the client listener, enabled with tls_enabled in the startup config.
+ *
+ * OpenSSL does the handshake. Where both the kernel and OpenSSL support it, the session keys are then handed to the
+ * kernel (kTLS) and the connection goes back to plain recv and writev, so the rest of the server doesn't know the
+ * difference. Otherwise, or for whichever direction the kernel couldn't take, reads and writes go through OpenSSL.
+ *
+ * Sessions can be resumed from the server's session cache or with tickets. Ticket keys are random per process unless
+ * tls_ticket_key_file names an 80 byte key file, which lets tickets survive a restart.
+ */
+class TLS {
+public:
+    // Returns false if TLS is enabled but could not be set up.
+    static bool configure();
+    static void shutdown();
+
+    static bool enabled() {
+        return context != 0;
+    }
+
+    static SSL* accept(int fd);
+    static void release(SSL* ssl);
+
+    // Continues the handshake. Once it is done, the connection's kernel TLS flags are set.
+    static TLSResult handshake(ConnectionInstance* con);
+
+    // These behave like recv and send, including setting errno to EAGAIN.
+    static ssize_t read(SSL* ssl, char* buffer, size_t length);
+    static ssize_t write(SSL* ssl, const void* buffer, size_t length);
+    // Decrypted bytes that OpenSSL is holding, which the socket won't report as readable.
+    static bool pending(SSL* ssl);
+private:
+
+    TLS() { }
+
+    ~TLS() { }
+
+    static bool loadTicketKeys(const char* path);
+
+    static SSL_CTX* context;
+};
+
+#endif //FSERV_TLS_H
@@ -26,15 +26,160 @@
 #include "precompiled_headers.hpp"
 #include "unicode_tools.hpp"
 
-#include <unicode/utypes.h>
-#include <unicode/ustring.h>
-#include <unicode/unistr.h>
-
-std::string UnicodeTools::escapeHTML(std::string& input) {
-    icu::UnicodeString ustr(input.c_str());
-    ustr.findAndReplace("&", "&amp;");
-    ustr.findAndReplace("<", "&lt;");
-    ustr.findAndReplace(">", "&gt;");
-    string out;
-    return ustr.toUTF8String(out);
+#include <stdint.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+    inline bool plain(unsigned char c) {
+        return c < 0x80 && c && c != '&' && c != '<' && c != '>';
+    }
+
+    /*
+     * The number of bytes before the first one that isn't plain ASCII text: a byte of 0x80 or more, a zero byte, or one
+     * of the characters that get escaped. Looks at 32 or 16 bytes at a time when AVX2 or SSE2 is available.
+     */
+    inline size_t plainLength(const char* input, size_t length) {
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i amp = _mm256_set1_epi8('&');
+        const __m256i lt = _mm256_set1_epi8('<');
+        const __m256i gt = _mm256_set1_epi8('>');
+        for (; i + 32 <= length; i += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (input + i));
+            __m256i special = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, zero), _mm256_cmpeq_epi8(block, amp)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, lt), _mm256_cmpeq_epi8(block, gt)));
+            uint32_t mask = static_cast<uint32_t> (_mm256_movemask_epi8(_mm256_or_si256(block, special)));
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+#elif defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i amp = _mm_set1_epi8('&');
+        const __m128i lt = _mm_set1_epi8('<');
+        const __m128i gt = _mm_set1_epi8('>');
+        for (; i + 16 <= length; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*> (input + i));
+            __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(block, zero), _mm_cmpeq_epi8(block, amp)),
+                _mm_or_si128(_mm_cmpeq_epi8(block, lt), _mm_cmpeq_epi8(block, gt)));
+            uint32_t mask = static_cast<uint32_t> (_mm_movemask_epi8(_mm_or_si128(block, special)));
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+#endif
+        for (; i < length; ++i) {
+            if (!plain(input[i]))
+                break;
+        }
+        return i;
+    }
+
+    /*
+     * Measures the UTF-8 sequence starting with the byte at p, which is 0x80 or more. valid is set if it is a whole
+     * well formed character. Otherwise the length is that of the maximal subpart, the lead byte and the continuation
+     * bytes that could still have been part of a character, which ICU replaces with a single U+FFFD.
+     */
+    inline size_t sequenceLength(const unsigned char* p, const unsigned char* end, bool& valid) {
+        unsigned char c = *p;
+        size_t count;
+        unsigned char low = 0x80;
+        unsigned char high = 0xBF;
+        valid = false;
+        if (c >= 0xC2 && c <= 0xDF) {
+            count = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            count = 2;
+            if (c == 0xE0)
+                low = 0xA0;
+            else if (c == 0xED)
+                high = 0x9F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            count = 3;
+            if (c == 0xF0)
+                low = 0x90;
+            else if (c == 0xF4)
+                high = 0x8F;
+        } else {
+            return 1;
+        }
+        size_t i = 1;
+        for (; i <= count && p + i < end; ++i) {
+            if (p[i] < low || p[i] > high)
+                return i;
+            low = 0x80;
+            high = 0xBF;
+        }
+        valid = i > count;
+        return i;
+    }
+}
+
+bool UnicodeTools::escapeHTML(const char* input, size_t length, string& output) {
+    const char* p = input;
+    const char* end = input + length;
+    const char* run = input;
+    bool changed = false;
+    while (true) {
+        p += plainLength(p, end - p);
+        if (p == end)
+            break;
+
+        unsigned char c = *p;
+        const char* replacement;
+        size_t replacementLength;
+        size_t consumed = 1;
+        if (c >= 0x80) {
+            bool valid;
+            consumed = sequenceLength(reinterpret_cast<const unsigned char*> (p),
+                                      reinterpret_cast<const unsigned char*> (end), valid);
+            if (valid) {
+                p += consumed;
+                continue;
+            }
+            replacement = "\xEF\xBF\xBD";
+            replacementLength = 3;
+        } else if (c == '&') {
+            replacement = "&amp;";
+            replacementLength = 5;
+        } else if (c == '<') {
+            replacement = "&lt;";
+            replacementLength = 4;
+        } else if (c == '>') {
+            replacement = "&gt;";
+            replacementLength = 4;
+        } else {
+            // A zero byte, where the input ends.
+            replacement = "";
+            replacementLength = 0;
+            consumed = end - p;
+        }
+
+        if (!changed) {
+            output.clear();
+            output.reserve(length + 16);
+            changed = true;
+        }
+        output.append(run, p - run);
+        output.append(replacement, replacementLength);
+        p += consumed;
+        run = p;
+    }
+    if (changed)
+        output.append(run, end - run);
+    return changed;
+}
+
+string UnicodeTools::escapeHTML(string& input) {
+    string output;
+    if (!escapeHTML(input.data(), input.length(), output))
+        return input;
+    return output;
 }
@@ -26,12 +26,21 @@
 #ifndef UNICODE_TOOLS_H
 #define UNICODE_TOOLS_H
 
+#include <stddef.h>
 #include <string>
 
 using std::string;
 
 class UnicodeTools {
 public:
+    /**
+     * Escapes &, < and > as HTML entities, and replaces each invalid UTF-8 sequence with U+FFFD the way ICU's UTF-8
+     * conversion does, so that the output is the same as the round trip through icu::UnicodeString gave. Like that
+     * round trip, the input ends at its first zero byte.
+     *
+     * Returns false without touching output if the input needs no changes, which is the case for most messages.
+     */
+    static bool escapeHTML(const char* input, size_t length, string& output);
     static string escapeHTML(string& input);
 private:
 
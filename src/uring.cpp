@@ -0,0 +1,552 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "precompiled_headers.hpp"
+
+#include "uring.hpp"
+#include "logging.hpp"
+#include "server.hpp"
+#include "admission.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#ifdef FSERV_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Submission queue size. The completion queue is four times this, as multishot requests post many completions each.
+#define URING_ENTRIES 1024
+// Number and size of the provided receive buffers. The count must be a power of two.
+#define URING_BUFFER_COUNT 512
+#define URING_BUFFER_SIZE 0x2000
+#define URING_BUFFER_GROUP 0
+
+// The operation is kept in the low bits of user_data, and the connection pointer in the rest.
+#define URING_OP_MASK 0x7
+enum UringOperation {
+    URING_OP_IGNORE = 0,
+    URING_OP_BUFFERS,
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_SEND
+};
+
+static inline uint64_t uringData(ConnectionInstance* con, UringOperation op) {
+    return reinterpret_cast<uintptr_t> (con) | op;
+}
+
+Uring::Uring(struct ev_loop* loop, int listenfd)
+:
+loop(loop),
+listenSocket(listenfd),
+ringfd(-1),
+completionEvent(0),
+submitEvent(0),
+fallbackListen(0),
+resumeAccept(0),
+acceptPaused(false),
+multishotReceive(true),
+sqRing(MAP_FAILED),
+sqRingSize(0),
+sqHead(0),
+sqTail(0),
+sqArray(0),
+sqMask(0),
+sqEntries(0),
+sqes(static_cast<struct io_uring_sqe*> (MAP_FAILED)),
+sqesSize(0),
+sqeTail(0),
+sqeSubmitted(0),
+cqRing(MAP_FAILED),
+cqRingSize(0),
+cqHead(0),
+cqTail(0),
+cqMask(0),
+cqes(0),
+buffers(0) {
+}
+
+/*
+ * Requests still in flight are dropped along with the ring, and so are the connection references they hold. This only
+ * happens when the server is stopping.
+ */
+Uring::~Uring() {
+    if (completionEvent) {
+        ev_io_stop(loop, completionEvent);
+        delete completionEvent;
+    }
+    if (submitEvent) {
+        ev_prepare_stop(loop, submitEvent);
+        delete submitEvent;
+    }
+    if (fallbackListen)
+        Server::stopListener(loop, fallbackListen);
+    if (resumeAccept) {
+        ev_timer_stop(loop, resumeAccept);
+        delete resumeAccept;
+    }
+    if (listenSocket >= 0)
+        close(listenSocket);
+
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+        munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED)
+        munmap(sqRing, sqRingSize);
+    delete[] buffers;
+    if (ringfd >= 0)
+        close(ringfd);
+}
+
+Uring* Uring::create(struct ev_loop* loop, int listenfd) {
+    Uring* uring = new Uring(loop, listenfd);
+    if (!uring->init()) {
+        LOG(WARNING) << "Could not set up io_uring. Falling back to libev.";
+        // The caller keeps using the socket.
+        uring->listenSocket = -1;
+        delete uring;
+        return 0;
+    }
+    LOG(INFO) << "Using io_uring for connection I/O.";
+    return uring;
+}
+
+bool Uring::init() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof (params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+    ringfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ringfd < 0) {
+        LOG(WARNING) << "io_uring_setup failed: " << strerror(errno);
+        return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        if (cqRingSize > sqRingSize)
+            sqRingSize = cqRingSize;
+        cqRingSize = sqRingSize;
+    }
+
+    sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED)
+        return false;
+    if (single) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+            return false;
+    }
+    sqesSize = params.sq_entries * sizeof (struct io_uring_sqe);
+    sqes = static_cast<struct io_uring_sqe*> (mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                   ringfd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED)
+        return false;
+
+    char* sq = static_cast<char*> (sqRing);
+    sqHead = reinterpret_cast<unsigned*> (sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*> (sq + params.sq_off.tail);
+    sqArray = reinterpret_cast<unsigned*> (sq + params.sq_off.array);
+    sqMask = *reinterpret_cast<unsigned*> (sq + params.sq_off.ring_mask);
+    sqEntries = params.sq_entries;
+    sqeTail = sqeSubmitted = *sqTail;
+
+    char* cq = static_cast<char*> (cqRing);
+    cqHead = reinterpret_cast<unsigned*> (cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*> (cq + params.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned*> (cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+
+    buffers = new char[URING_BUFFER_COUNT * URING_BUFFER_SIZE];
+    provideBuffers(0, URING_BUFFER_COUNT);
+
+    completionEvent = new ev_io;
+    ev_io_init(completionEvent, Uring::completionCallback, ringfd, EV_READ);
+    completionEvent->data = this;
+    ev_io_start(loop, completionEvent);
+
+    submitEvent = new ev_prepare;
+    ev_prepare_init(submitEvent, Uring::submitCallback);
+    submitEvent->data = this;
+    ev_prepare_start(loop, submitEvent);
+
+    armAccept();
+    return true;
+}
+
+struct io_uring_sqe* Uring::getSqe() {
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (sqeTail - head >= sqEntries) {
+        submit();
+        head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqeTail - head >= sqEntries)
+            return 0;
+    }
+    struct io_uring_sqe* sqe = &sqes[sqeTail & sqMask];
+    ++sqeTail;
+    memset(sqe, 0, sizeof (struct io_uring_sqe));
+    return sqe;
+}
+
+void Uring::submit() {
+    unsigned pending = sqeTail - sqeSubmitted;
+    if (!pending)
+        return;
+
+    for (unsigned i = sqeSubmitted; i != sqeTail; ++i)
+        sqArray[i & sqMask] = i & sqMask;
+    __atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+    int ret = syscall(__NR_io_uring_enter, ringfd, pending, 0, 0, 0, 0);
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EBUSY && errno != EINTR)
+            LOG(WARNING) << "io_uring_enter failed: " << strerror(errno);
+        return;
+    }
+    sqeSubmitted += ret;
+}
+
+/*
+ * Buffers are handed back with IORING_OP_PROVIDE_BUFFERS rather than a registered buffer ring, which isn't reliably
+ * usable across the kernels we run on. The requests are batched with everything else at the next submission.
+ */
+void Uring::provideBuffers(unsigned short id, unsigned short count) {
+    struct io_uring_sqe* sqe = getSqe();
+    if (!sqe) {
+        LOG(WARNING) << "io_uring submission queue is full. Lost " << count << " receive buffers.";
+        return;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = reinterpret_cast<uintptr_t> (buffers + id * URING_BUFFER_SIZE);
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->off = id;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = uringData(0, URING_OP_BUFFERS);
+}
+
+void Uring::armAccept() {
+    struct io_uring_sqe* sqe = getSqe();
+    if (!sqe) {
+        LOG(WARNING) << "io_uring submission queue is full. Could not accept.";
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenSocket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = uringData(0, URING_OP_ACCEPT);
+}
+
+/*
+ * A multishot accept takes connections off the backlog as fast as they arrive, so admission can't leave them there.
+ * Instead the accept is cancelled until the global bucket refills, and the backlog fills up in the meantime.
+ */
+void Uring::pauseAccept(double wait) {
+    if (acceptPaused)
+        return;
+    struct io_uring_sqe* sqe = getSqe();
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uringData(0, URING_OP_ACCEPT);
+    sqe->user_data = uringData(0, URING_OP_IGNORE);
+    acceptPaused = true;
+
+    if (!resumeAccept) {
+        resumeAccept = new ev_timer;
+        ev_timer_init(resumeAccept, Uring::resumeAcceptCallback, 0., 0.);
+        resumeAccept->data = this;
+    }
+    ev_timer_set(resumeAccept, wait, 0.);
+    ev_timer_start(loop, resumeAccept);
+}
+
+void Uring::resumeAcceptCallback(struct ev_loop* loop, ev_timer* w, int revents) {
+    Uring* uring = static_cast<Uring*> (w->data);
+    uring->acceptPaused = false;
+    uring->armAccept();
+}
+
+void Uring::armReceive(ConnectionInstance* con) {
+    UringConnection* state = con->uringState;
+    struct io_uring_sqe* sqe = getSqe();
+    if (!sqe) {
+        LOG(WARNING) << "io_uring submission queue is full. Closing a connection that could not read.";
+        closeConnection(con);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = state->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = multishotReceive ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = uringData(con, URING_OP_RECV);
+    state->receiving = true;
+    state->multishot = multishotReceive;
+    intrusive_ptr_add_ref(con);
+}
+
+void Uring::armSend(ConnectionInstance* con) {
+    UringConnection* state = con->uringState;
+    struct io_uring_sqe* sqe = getSqe();
+    if (!sqe) {
+        // Try again on the next loop iteration.
+        queueFlush(con);
+        return;
+    }
+
+    // Only the first message can be partially sent.
+    int count = 0;
+    size_t len = 0;
+    for (auto i = con->writeQueue.begin(); i != con->writeQueue.end() && count < URING_MAX_IOVECS; ++i) {
+        size_t offset = count ? 0 : con->writePosition;
+        state->iov[count].iov_base = (void*) ((*i)->buffer() + offset);
+        state->iov[count].iov_len = (*i)->length() - offset;
+        len += state->iov[count].iov_len;
+        ++count;
+    }
+    memset(&state->header, 0, sizeof (state->header));
+    state->header.msg_iov = &state->iov[0];
+    state->header.msg_iovlen = count;
+    state->sendLength = len;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = state->fd;
+    sqe->addr = reinterpret_cast<uintptr_t> (&state->header);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uringData(con, URING_OP_SEND);
+    state->sending = true;
+    intrusive_ptr_add_ref(con);
+}
+
+void Uring::queueFlush(ConnectionInstance* con) {
+    UringConnection* state = con->uringState;
+    if (!state || state->sending || state->flushQueued)
+        return;
+    state->flushQueued = true;
+    flushQueue.push_back(con);
+}
+
+void Uring::cancel(ConnectionInstance* con) {
+    UringConnection* state = con->uringState;
+    if (!state)
+        return;
+
+    UringOperation ops[] = {URING_OP_RECV, URING_OP_SEND};
+    bool active[] = {state->receiving, state->sending};
+    for (int i = 0; i < 2; ++i) {
+        if (!active[i])
+            continue;
+        struct io_uring_sqe* sqe = getSqe();
+        if (!sqe)
+            return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = uringData(con, ops[i]);
+        sqe->user_data = uringData(0, URING_OP_IGNORE);
+    }
+}
+
+void Uring::closeConnection(ConnectionInstance* con) {
+    if (con->closed)
+        return;
+    Server::prepareShutdownConnection(con);
+    close(con->uringState->fd);
+}
+
+void Uring::complete(uint64_t userData, int result, unsigned int flags) {
+    ConnectionInstance* con = reinterpret_cast<ConnectionInstance*> (userData & ~static_cast<uint64_t> (URING_OP_MASK));
+    switch (userData & URING_OP_MASK) {
+        case URING_OP_BUFFERS:
+            if (result < 0)
+                LOG(WARNING) << "io_uring could not take back receive buffers: " << strerror(-result);
+            break;
+        case URING_OP_ACCEPT:
+            completeAccept(result, flags);
+            break;
+        case URING_OP_RECV:
+            completeReceive(con, result, flags);
+            break;
+        case URING_OP_SEND:
+            completeSend(con, result);
+            break;
+        default:
+            break;
+    }
+}
+
+void Uring::completeAccept(int result, unsigned int flags) {
+    if (result >= 0) {
+        struct sockaddr_in accept_addr;
+        socklen_t socklen = sizeof (accept_addr);
+        double now = ev_now(loop);
+        double wait = 0;
+        if (getpeername(result, (sockaddr*) &accept_addr, &socklen) < 0) {
+            close(result);
+        } else if (!Admission::acquire(now, wait)) {
+            // Already accepted by the kernel, so all that can be done is to stop accepting more for now.
+            close(result);
+            Admission::countDropped();
+            pauseAccept(wait);
+        } else if (Admission::admit(accept_addr.sin_addr.s_addr, now) != ADMISSION_ACCEPT) {
+            close(result);
+        } else {
+            ConnectionPtr con = Server::acceptConnection(loop, result, accept_addr, this);
+            UringConnection* state = new UringConnection;
+            memset(state, 0, sizeof (UringConnection));
+            state->fd = result;
+            con->uringState = state;
+            armReceive(con.get());
+        }
+    } else if (result == -EINVAL || result == -EOPNOTSUPP) {
+        LOG(WARNING) << "This kernel does not support multishot accept. Accepting with libev instead.";
+        fallbackListen = Server::startListener(loop, listenSocket);
+        return;
+    } else if (result != -ECANCELED) {
+        LOG(WARNING) << "io_uring accept failed: " << strerror(-result);
+    }
+
+    if (!(flags & IORING_CQE_F_MORE) && !acceptPaused)
+        armAccept();
+}
+
+void Uring::completeReceive(ConnectionInstance* con, int result, unsigned int flags) {
+    ConnectionPtr ptr(con);
+    UringConnection* state = con->uringState;
+    bool more = flags & IORING_CQE_F_MORE;
+    if (!more) {
+        state->receiving = false;
+        intrusive_ptr_release(con);
+    }
+
+    if (result > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        unsigned short id = flags >> IORING_CQE_BUFFER_SHIFT;
+        Server::connectionReceived(loop, ptr, state->fd, buffers + id * URING_BUFFER_SIZE, result);
+        provideBuffers(id, 1);
+    } else if ((result == -EINVAL || result == -EOPNOTSUPP) && state->multishot) {
+        // Kernels before 6.0 have multishot accept but not multishot recv. Every connection with one armed fails the
+        // same way, and is re-armed below with a single shot recv.
+        if (multishotReceive)
+            LOG(WARNING) << "This kernel does not support multishot recv. Receiving one buffer per request instead.";
+        multishotReceive = false;
+    } else if (result != -ENOBUFS) {
+        // The peer closed the connection, something failed, or we cancelled the request while closing.
+        closeConnection(con);
+        return;
+    }
+
+    if (!more && !con->closed)
+        armReceive(con);
+}
+
+void Uring::completeSend(ConnectionInstance* con, int result) {
+    ConnectionPtr ptr(con);
+    UringConnection* state = con->uringState;
+    state->sending = false;
+    intrusive_ptr_release(con);
+
+    if (con->closed)
+        return;
+    if (result <= 0) {
+        closeConnection(con);
+        return;
+    }
+
+    ++con->statWriteCalls;
+    size_t remaining = result;
+    while (remaining) {
+        size_t left = con->writeQueue.front()->length() - con->writePosition;
+        if (remaining < left) {
+            con->writePosition += remaining;
+            break;
+        }
+        remaining -= left;
+        con->popWriteQueue();
+        ++con->statWriteFrames;
+    }
+
+    if (con->writeQueue.size())
+        armSend(con);
+}
+
+void Uring::completionCallback(struct ev_loop* loop, ev_io* w, int revents) {
+    Uring* instance = static_cast<Uring*> (w->data);
+    struct io_uring_cqe* cqes = static_cast<struct io_uring_cqe*> (instance->cqes);
+    unsigned head = *instance->cqHead;
+    while (head != __atomic_load_n(instance->cqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &cqes[head & instance->cqMask];
+        uint64_t userData = cqe->user_data;
+        int result = cqe->res;
+        unsigned int flags = cqe->flags;
+        ++head;
+        __atomic_store_n(instance->cqHead, head, __ATOMIC_RELEASE);
+        instance->complete(userData, result, flags);
+    }
+}
+
+/*
+ * Runs right before the loop blocks, so everything queued during this iteration goes to the kernel in one call.
+ */
+void Uring::submitCallback(struct ev_loop* loop, ev_prepare* w, int revents) {
+    Uring* instance = static_cast<Uring*> (w->data);
+    while (!instance->flushQueue.empty()) {
+        ConnectionPtr con = instance->flushQueue.front();
+        instance->flushQueue.pop_front();
+        UringConnection* state = con->uringState;
+        state->flushQueued = false;
+        if (!con->closed && !state->sending && con->writeQueue.size())
+            instance->armSend(con.get());
+    }
+    instance->submit();
+}
+
+#else
+
+Uring::Uring(struct ev_loop* loop, int listenfd) { }
+
+Uring::~Uring() { }
+
+Uring* Uring::create(struct ev_loop* loop, int listenfd) {
+    LOG(WARNING) << "This build does not include io_uring support. Falling back to libev.";
+    return 0;
+}
+
+void Uring::queueFlush(ConnectionInstance* con) { }
+
+void Uring::cancel(ConnectionInstance* con) { }
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FSERV_URING_H
+#define FSERV_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <ev.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "connection.hpp"
+
+// The most queued messages handed to a single sendmsg.
+#define URING_MAX_IOVECS 64
+
+struct io_uring_sqe;
+
+/**
+ * Per connection state for the io_uring backend.
+ */
+struct UringConnection {
+    int fd;
+    bool receiving; // A recv is armed.
+    bool multishot; // The armed recv is multishot.
+    bool sending; // A sendmsg is in flight.
+    bool flushQueued; // Waiting for the next submission.
+    size_t sendLength;
+    struct msghdr header;
+    struct iovec iov[URING_MAX_IOVECS];
+};
+
+/**
+ * Optional io_uring I/O backend for one event loop, selected with io_backend in the startup config.
+ *
+ * libev keeps running the loop, timers and async wakeups. The ring's file descriptor is watched by the loop, and
+ * submissions are batched and made once per loop iteration from a prepare watcher. Accepts are multishot, reads are
+ * multishot (single shot before Linux 6.0) into a pool of provided buffers, and each flush sends the whole write
+ * queue with a single sendmsg.
+ *
+ * Every request in flight holds a reference on its connection, so the normal delayed close in
+ * connectionTimerCallback can run while the kernel is still finishing with the socket.
+ */
+class Uring {
+public:
+    // Returns null if io_uring can't be used, in which case the caller should listen with libev instead.
+    static Uring* create(struct ev_loop* loop, int listenfd);
+    ~Uring();
+
+    void queueFlush(ConnectionInstance* con);
+    void cancel(ConnectionInstance* con);
+private:
+    Uring(struct ev_loop* loop, int listenfd);
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    bool init();
+    struct io_uring_sqe* getSqe();
+    void submit();
+
+    void armAccept();
+    void pauseAccept(double wait);
+    void armReceive(ConnectionInstance* con);
+    void armSend(ConnectionInstance* con);
+    void provideBuffers(unsigned short id, unsigned short count);
+    void complete(uint64_t userData, int result, unsigned int flags);
+    void completeAccept(int result, unsigned int flags);
+    void completeReceive(ConnectionInstance* con, int result, unsigned int flags);
+    void completeSend(ConnectionInstance* con, int result);
+    void closeConnection(ConnectionInstance* con);
+
+    static void completionCallback(struct ev_loop* loop, ev_io* w, int revents);
+    static void submitCallback(struct ev_loop* loop, ev_prepare* w, int revents);
+    static void resumeAcceptCallback(struct ev_loop* loop, ev_timer* w, int revents);
+
+    struct ev_loop* loop;
+    int listenSocket;
+    int ringfd;
+    ev_io* completionEvent;
+    ev_prepare* submitEvent;
+    ev_io* fallbackListen;
+    // Accepting stops while the global admission bucket is empty.
+    ev_timer* resumeAccept;
+    bool acceptPaused;
+    // Cleared when the kernel turns out to support multishot accept but not multishot recv (before 6.0).
+    bool multishotReceive;
+
+    // Submission ring.
+    void* sqRing;
+    size_t sqRingSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned sqeTail;
+    unsigned sqeSubmitted;
+
+    // Completion ring.
+    void* cqRing;
+    size_t cqRingSize;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    void* cqes;
+
+    // Provided receive buffers.
+    char* buffers;
+
+    std::deque<ConnectionPtr> flushQueue;
+};
+
+#endif //FSERV_URING_H
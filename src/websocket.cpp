@@ -31,15 +31,20 @@
 #include "websocket.hpp"
 #include "sha1.hpp"
 #include "base64.hpp"
+#include "modp_b64.hpp"
+#include "messagebuffer.hpp"
 #include <stdlib.h>
 #include <stdio.h>
 #include <exception>
 #include "startup_config.hpp"
 #include "logging.hpp"
 #include "connection.hpp"
+#include "readbuffer.hpp"
+#include "websocket_mask.hpp"
+#include "websocket_deflate.hpp"
 
-#include <map>
 #include <vector>
+#include <strings.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -56,73 +61,108 @@
 namespace Websocket {
 
     /*
-     * Due to some "issues" with the TLS proxy server mangling headers, we
-     * have to lowercase headers to normalize the capitalization.
+     * Finds a header line's value when its name, compared without case, is name. Due to some "issues" with the TLS
+     * proxy server mangling headers, capitalization can't be relied on.
      */
-    ProtocolVersion Acceptor::accept(std::string& input, std::string& output,
-            std::string& ip) {
-        ProtocolVersion ret = PROTOCOL_INCOMPLETE;
-        try {
-            DLOG(INFO) << "Attempting to parse a websocket header.";
-            if (input.find("\r\n\r\n") == std::string::npos)
-                return ret;
-
-            std::map<std::string, std::string> headers;
-            std::string line;
-            std::string remainder = input;
-            std::string::size_type end = remainder.find("\r\n");
-            while (end != std::string::npos) {
-                line = remainder.substr(0, end);
-                remainder = remainder.substr(end + 2);
-
-                std::string::size_type pos = line.find(": ");
-                if (pos != std::string::npos) {
-                    std::string key = line.substr(0, pos);
-                    for (size_t i = 0; i < key.length(); ++i) {
-                        key[i] = tolower(key[i]);
-                    }
-                    headers[key] = line.substr(pos + 2);
-                }
-
-                end = remainder.find("\r\n");
-            }
+    static bool headerValue(const char* line, const char* lineEnd, const char* name, size_t nameLength,
+                            const char*& value, size_t& valueLength) {
+        if (static_cast<size_t> (lineEnd - line) <= nameLength || line[nameLength] != ':' ||
+            strncasecmp(line, name, nameLength))
+            return false;
+        const char* begin = line + nameLength + 1;
+        while (begin < lineEnd && (*begin == ' ' || *begin == '\t'))
+            ++begin;
+        const char* end = lineEnd;
+        while (end > begin && (end[-1] == ' ' || end[-1] == '\t'))
+            --end;
+        value = begin;
+        valueLength = end - begin;
+        return true;
+    }
 
-            std::string outbuffer;
+#define HEADER_NAME(s) s, sizeof (s) - 1
 
-            // Copy the forwarded for ip into our output if it exists.
-            // Caller checks for proper remote address before trusting this.
-            if (headers.count("x-real-ip") != 0) {
-                ip = headers["x-real-ip"];
-            }
-            if (headers.count("sec-websocket-version") != 0 && headers.count("sec-websocket-key") != 0) {
-                DLOG(INFO) << "Found a Hybi websocket header.";
-                if (Hybi::accept(headers["sec-websocket-key"], headers["sec-websocket-origin"], outbuffer) != WS_RESULT_OK) {
-                    ret = PROTOCOL_BAD;
-                } else {
-                    ret = PROTOCOL_HYBI;
-                }
-            } else {
-                ret = PROTOCOL_BAD;
+    /*
+     * A single pass over the headers, once their end has arrived. Only the few we use are picked out, and they are
+     * left where they are in the read buffer.
+     */
+    ProtocolVersion Acceptor::accept(const char* input, size_t length, size_t& scanned, MessageBuffer*& output,
+                                     std::string& ip, bool& deflate) {
+        // The terminator may have started at the end of the previous read.
+        size_t from = scanned > 3 ? scanned - 3 : 0;
+        const char* terminator = from < length ?
+            static_cast<const char*> (memmem(input + from, length - from, "\r\n\r\n", 4)) : 0;
+        if (!terminator) {
+            scanned = length;
+            return PROTOCOL_INCOMPLETE;
+        }
+        DLOG(INFO) << "Parsing a websocket header.";
+
+        const char* key = 0;
+        size_t keyLength = 0;
+        const char* version = 0;
+        size_t versionLength = 0;
+        const char* extensions = 0;
+        size_t extensionsLength = 0;
+        const char* realIP = 0;
+        size_t realIPLength = 0;
+
+        // The request line is skipped.
+        const char* line = static_cast<const char*> (memchr(input, '\n', terminator - input + 2)) + 1;
+        const char* headersEnd = terminator + 2;
+        while (line < headersEnd) {
+            const char* lineEnd = static_cast<const char*> (memchr(line, '\n', headersEnd - line));
+            const char* next = lineEnd + 1;
+            if (lineEnd > line && lineEnd[-1] == '\r')
+                --lineEnd;
+            switch (*line | 0x20) {
+                case 's':
+                    headerValue(line, lineEnd, HEADER_NAME("sec-websocket-key"), key, keyLength) ||
+                    headerValue(line, lineEnd, HEADER_NAME("sec-websocket-version"), version, versionLength) ||
+                    headerValue(line, lineEnd, HEADER_NAME("sec-websocket-extensions"), extensions, extensionsLength);
+                    break;
+                case 'x':
+                    headerValue(line, lineEnd, HEADER_NAME("x-real-ip"), realIP, realIPLength);
+                    break;
+                default:
+                    break;
             }
-            output = outbuffer;
-        } catch (std::exception e) {
-            LOG(WARNING) << "Exception occurred in websocket accept. e.what: " << e.what();
-            ret = PROTOCOL_BAD;
-        } catch (...) {
-            LOG(WARNING) << "Unexpected exception occured in websocket accept.";
-            ret = PROTOCOL_BAD;
+            line = next;
+        }
+
+        // Copy the forwarded for ip into our output if it exists.
+        // Caller checks for proper remote address before trusting this.
+        if (realIP)
+            ip.assign(realIP, realIPLength);
+        if (!version || !key) {
+            return PROTOCOL_BAD;
         }
-        return ret;
+
+        DLOG(INFO) << "Found a Hybi websocket header.";
+        char accepted[Hybi::acceptKeySize];
+        if (!Hybi::acceptKey(key, keyLength, accepted))
+            return PROTOCOL_BAD;
+        std::string extensionResponse;
+        deflate = false;
+        if (extensions)
+            deflate = Deflate::negotiate(std::string(extensions, extensionsLength), extensionResponse);
+        output = MessageBuffer::fromHandshake(accepted, extensionResponse);
+        return PROTOCOL_HYBI;
     }
 
+#undef HEADER_NAME
+
     static const unsigned int wsHeaderSize = 2;
     static const unsigned int wsMaskingKeySize = 4;
     static const unsigned int wsOpcodeMask = 0x0F;
+    static const unsigned int wsFinalMask = 0x80;
     static const unsigned int wsMaskedMask = 0x80;
+    static const unsigned int wsCompressedMask = 0x40; //RSV1, set on permessage-deflate messages.
     static const unsigned int wsLengthMask = 0x7F;
     static const unsigned int wsSingleByteLength = 125;
     static const unsigned int wsTwoByteLength = 126;
     static const unsigned int wsEightByteLength = 127;
+    static const unsigned int wsOpcodeContinuation = 0x00;
     static const unsigned int wsOpcodeText = 0x01;
     //static const unsigned int wsOpcodeBinary = 0x02;
     static const unsigned int wsOpcodeClose = 0x08;
@@ -131,39 +171,73 @@ namespace Websocket {
     static const unsigned int wsMaximumClientFrameSize = 0x80000; //512kB should be sufficient for any client->server message.
     static const char* const wsMagicalGUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
-    WebSocketResult Hybi::accept(string& key, string& origin, string& output) {
-        if (key.empty())
-            return WS_RESULT_ERROR;
+    // A valid key is 16 random bytes in base64, but clients get some slack.
+    static const size_t wsMaximumKeyLength = 64;
+    static const char wsResponseStart[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: ";
+    static const char wsExtensionsHeader[] = "Sec-WebSocket-Extensions: ";
+
+    bool Hybi::acceptKey(const char* key, size_t keyLength, char* output) {
+        static const size_t guidLength = strlen(wsMagicalGUID);
+        if (!keyLength || keyLength > wsMaximumKeyLength)
+            return false;
+
+        char keystr[wsMaximumKeyLength + 36];
+        memcpy(keystr, key, keyLength);
+        memcpy(keystr + keyLength, wsMagicalGUID, guidLength);
+        unsigned char hash[thirdparty::kSHA1Length];
+        thirdparty::SHA1HashBytes(reinterpret_cast<const unsigned char*> (keystr), keyLength + guidLength, hash);
+        char encoded[modp_b64_encode_len(thirdparty::kSHA1Length)];
+        if (modp_b64_encode(encoded, reinterpret_cast<const char*> (hash), sizeof (hash)) != static_cast<int> (acceptKeySize))
+            return false;
+        memcpy(output, encoded, acceptKeySize);
+        return true;
+    }
 
-        char buf[4096];
-        bzero(&buf[0], sizeof (buf));
-        int len = snprintf(&buf[0], sizeof (buf), "%s%s", key.c_str(), wsMagicalGUID);
-        string keystr(&buf[0], len);
-        bzero(&buf[0], sizeof (buf));
-        string encodedkey;
-        string hashkey = thirdparty::SHA1HashString(keystr);
-        thirdparty::Base64Encode(hashkey, encodedkey);
-        len = snprintf(&buf[0], sizeof (buf),
-                "HTTP/1.1 101 Switching Protocols\r\n"
-                "Upgrade: websocket\r\n"
-                "Connection: Upgrade\r\n"
-                "Sec-WebSocket-Accept: %s\r\n\r\n", encodedkey.c_str());
-        string tmp(&buf[0], len);
-        output.swap(tmp);
-        return WS_RESULT_OK;
+    size_t Hybi::handshakeResponseSize(size_t extensionsLength) {
+        size_t size = sizeof (wsResponseStart) - 1 + acceptKeySize + 2;
+        if (extensionsLength)
+            size += sizeof (wsExtensionsHeader) - 1 + extensionsLength + 2;
+        return size + 2;
     }
 
-    WebSocketResult Hybi::receive(ConnectionInstance* con, std::string& input,
-                                  std::string& output) {
-        unsigned long rlen = input.length();
+    void Hybi::writeHandshakeResponse(const char* acceptKey, const string& extensions, uint8_t* output) {
+        memcpy(output, wsResponseStart, sizeof (wsResponseStart) - 1);
+        output += sizeof (wsResponseStart) - 1;
+        memcpy(output, acceptKey, acceptKeySize);
+        output += acceptKeySize;
+        memcpy(output, "\r\n", 2);
+        output += 2;
+        if (!extensions.empty()) {
+            memcpy(output, wsExtensionsHeader, sizeof (wsExtensionsHeader) - 1);
+            output += sizeof (wsExtensionsHeader) - 1;
+            memcpy(output, extensions.data(), extensions.length());
+            output += extensions.length();
+            memcpy(output, "\r\n", 2);
+            output += 2;
+        }
+        memcpy(output, "\r\n", 2);
+    }
+
+    /*
+     * Text frames are split while they are unmasked. The first three bytes are the command and everything after the
+     * separating space is the payload, so neither needs to be copied out of a combined message afterwards.
+     */
+    WebSocketResult Hybi::receive(ConnectionInstance* con, ReadBuffer& input,
+                                  std::string& command, std::string& payload) {
+        unsigned long rlen = input.size();
         if (rlen < wsHeaderSize)
             return WS_RESULT_INCOMPLETE;
 
-        const char* msg = input.c_str();
+        const char* msg = input.data();
         unsigned char b1 = *msg++;
         unsigned char b2 = *msg++;
 
         unsigned int opcode = b1 & wsOpcodeMask;
+        bool compressed = b1 & wsCompressedMask;
         bool masked = b2 & wsMaskedMask;
         unsigned int lengthhint = b2 & wsLengthMask;
 
@@ -171,6 +245,10 @@ namespace Websocket {
         if (!masked)
             return WS_RESULT_ERROR;
 
+        // Only text messages may be compressed, and only once the extension was negotiated.
+        if (compressed && (opcode != wsOpcodeText || !con->inflater))
+            return WS_RESULT_ERROR;
+
         switch (opcode) {
                 // Text
             case wsOpcodeText:
@@ -211,56 +289,105 @@ namespace Websocket {
 
         // Immediately dump pongs.
         if (opcode == wsOpcodePong) {
-            input = input.substr(wsHeaderSize + lengthsize + totallen);
+            input.consume(wsHeaderSize + lengthsize + totallen);
             return WS_RESULT_PING_PONG;
         } else if (opcode == wsOpcodePing) {
             string pingData;
             pingData.resize(payload_length);
             const char* mask = msg;
             msg += wsMaskingKeySize;
-            for (unsigned int i = 0; i < payload_length; ++i) {
-                pingData[i] = msg[i] ^ mask[i % wsMaskingKeySize];
-            }
+            unmask(msg, &pingData[0], payload_length, mask);
             string pongData;
             Hybi::sendPong(pingData, pongData);
             con->sendRaw(pongData);
-            input = input.substr(wsHeaderSize + lengthsize + totallen);
+            input.consume(wsHeaderSize + lengthsize + totallen);
             return WS_RESULT_PING_PONG;
         }
 
-        output.resize(payload_length);
         const char* mask = msg;
         msg += wsMaskingKeySize;
-        for (unsigned int i = 0; i < payload_length; ++i) {
-            output[i] = msg[i] ^ mask[i % wsMaskingKeySize];
+        if (compressed) {
+            static thread_local string deflated;
+            static thread_local string inflated;
+            deflated.resize(payload_length + 4);
+            unmask(msg, &deflated[0], payload_length, mask);
+            memcpy(&deflated[payload_length], "\x00\x00\xff\xff", 4);
+            input.consume(wsHeaderSize + lengthsize + totallen);
+            if (!con->inflater->inflate(deflated.data(), deflated.length(), inflated, wsMaximumClientFrameSize))
+                return WS_RESULT_ERROR;
+            command.assign(inflated, 0, 3);
+            if (inflated.length() > 4)
+                payload.assign(inflated, 4, string::npos);
+            else
+                payload.clear();
+            return WS_RESULT_OK;
         }
 
-        input = input.substr(wsHeaderSize + lengthsize + totallen);
+        size_t command_length = payload_length < 3 ? payload_length : 3;
+        command.resize(command_length);
+        unmask(msg, &command[0], command_length, mask);
+        if (payload_length > 4) {
+            payload.resize(payload_length - 4);
+            unmask(msg + 4, &payload[0], payload_length - 4, mask, 4);
+        } else {
+            payload.clear();
+        }
+
+        input.consume(wsHeaderSize + lengthsize + totallen);
 
         return WS_RESULT_OK;
     }
 
-    void Hybi::sendMessage(unsigned int opcode, string& input, string& output) {
-        std::vector<unsigned char> frame;
-        unsigned int length = input.length();
+    size_t Hybi::frameHeaderSize(size_t length) {
+        if (length <= wsSingleByteLength)
+            return wsHeaderSize;
+        else if (length <= 0xFFFF)
+            return wsHeaderSize + 2;
+        return wsHeaderSize + 8;
+    }
 
-        frame.push_back(0x80 | opcode);
+    void Hybi::writeFrameHeader(unsigned int opcode, size_t length, uint8_t* output) {
+        *output++ = 0x80 | opcode;
         if (length <= wsSingleByteLength) {
-            frame.push_back(static_cast<unsigned char> (length));
+            *output++ = static_cast<uint8_t> (length);
         } else if (length <= 0xFFFF) {
-            frame.push_back(wsTwoByteLength);
-            frame.push_back((length & 0xFF00) >> 8);
-            frame.push_back(length & 0xFF);
+            *output++ = wsTwoByteLength;
+            *output++ = (length & 0xFF00) >> 8;
+            *output++ = length & 0xFF;
         } else {
             uint64_t qlength = length;
-            frame.push_back(wsEightByteLength);
+            *output++ = wsEightByteLength;
             for (size_t i = 0; i < 8; ++i) {
-                unsigned char length_piece = (qlength >> 8 * (7 - i)) & 0xFF;
-                frame.push_back(length_piece);
+                *output++ = (qlength >> 8 * (7 - i)) & 0xFF;
             }
         }
-        frame.insert(frame.end(), input.data(), input.data() + length);
-        string tmp(frame.begin(), frame.end());
+    }
+
+    void Hybi::writeTextHeader(size_t length, uint8_t* output, bool compressed) {
+        Hybi::writeFrameHeader(wsOpcodeText, length, output);
+        if (compressed)
+            output[0] |= wsCompressedMask;
+    }
+
+    void Hybi::writeFragmentHeader(size_t length, bool first, bool final, bool compressed, uint8_t* output) {
+        Hybi::writeFrameHeader(first ? wsOpcodeText : wsOpcodeContinuation, length, output);
+        if (!final)
+            output[0] &= ~wsFinalMask;
+        if (first && compressed)
+            output[0] |= wsCompressedMask;
+    }
+
+    bool Hybi::isCompressed(const uint8_t* frame) {
+        return frame[0] & wsCompressedMask;
+    }
+
+    void Hybi::sendMessage(unsigned int opcode, string& input, string& output) {
+        size_t length = input.length();
+        size_t header = Hybi::frameHeaderSize(length);
+        string tmp;
+        tmp.resize(header + length);
+        Hybi::writeFrameHeader(opcode, length, reinterpret_cast<uint8_t*> (&tmp[0]));
+        memcpy(&tmp[header], input.data(), length);
         output.swap(tmp);
     }
 
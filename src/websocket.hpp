@@ -29,9 +29,13 @@
 #ifndef WEBSOCKET_H
 #define WEBSOCKET_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
 
 class ConnectionInstance;
+class ReadBuffer;
+class MessageBuffer;
 
 enum ProtocolVersion {
     PROTOCOL_HYBI, //Complex framing!
@@ -61,8 +65,11 @@ namespace Websocket {
 
     class Acceptor {
     public:
-        static ProtocolVersion accept(std::string& input, std::string& output,
-                                      std::string& ip);
+        // Parses the upgrade request at the front of input without copying it. scanned is how much of input has
+        // already been searched for the end of the headers, and is advanced while the request is incomplete. output
+        // is set to the 101 response on success.
+        static ProtocolVersion accept(const char* input, size_t length, size_t& scanned, MessageBuffer*& output,
+                                      std::string& ip, bool& deflate);
     private:
 
         Acceptor() { }
@@ -72,10 +79,21 @@ namespace Websocket {
 
     class Hybi {
     public:
-        static WebSocketResult accept(std::string& key, std::string& origin,
-                                      std::string& output);
-        static WebSocketResult receive(ConnectionInstance* con, std::string& input,
-                                       std::string& output);
+        static const size_t acceptKeySize = 28;
+        // Sec-WebSocket-Accept for a client's Sec-WebSocket-Key, written without a terminator.
+        static bool acceptKey(const char* key, size_t keyLength, char* output);
+        // The 101 response is written straight into its outgoing buffer.
+        static size_t handshakeResponseSize(size_t extensionsLength);
+        static void writeHandshakeResponse(const char* acceptKey, const std::string& extensions, uint8_t* output);
+        static WebSocketResult receive(ConnectionInstance* con, ReadBuffer& input,
+                                       std::string& command, std::string& payload);
+        // Frame headers are written separately so that outgoing buffers can be built in place.
+        static size_t frameHeaderSize(size_t length);
+        static void writeFrameHeader(unsigned int opcode, size_t length, uint8_t* output);
+        static void writeTextHeader(size_t length, uint8_t* output, bool compressed = false);
+        // One frame of a fragmented text message. Only the first carries the opcode and the compression bit.
+        static void writeFragmentHeader(size_t length, bool first, bool final, bool compressed, uint8_t* output);
+        static bool isCompressed(const uint8_t* frame);
         static void sendMessage(unsigned int opcode, std::string& input,
                                 std::string& output);
         static void sendText(std::string& input, std::string& output);
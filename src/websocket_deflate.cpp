@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "precompiled_headers.hpp"
+
+#include "websocket_deflate.hpp"
+#include "logging.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <zlib.h>
+
+using std::string;
+
+namespace Websocket {
+
+    static const int deflateWindowBits = 15;
+    static const size_t deflateMinimumSpace = 64;
+    static const unsigned char deflateTail[4] = {0x00, 0x00, 0xFF, 0xFF};
+
+    bool Deflate::enabled_ = false;
+    size_t Deflate::threshold_ = 0;
+
+    void Deflate::configure(bool enabled, size_t threshold) {
+        enabled_ = enabled;
+        threshold_ = threshold;
+    }
+
+    static string trim(const string& input) {
+        string::size_type start = input.find_first_not_of(" \t");
+        if (start == string::npos)
+            return string();
+        string::size_type end = input.find_last_not_of(" \t");
+        return input.substr(start, end - start + 1);
+    }
+
+    /*
+     * Any client window size is fine because inflate always runs with the largest window. A limit on the server
+     * window can't be honored without compressing broadcasts more than once, so offers with one are declined unless
+     * the limit is 15, the window deflate uses anyway. serverBits is set when such an offer is accepted, because the
+     * response then has to repeat it (RFC 7692 7.1.2.1).
+     */
+    static bool acceptOffer(const string& offer, bool& serverBits) {
+        std::vector<string> parameters;
+        string::size_type start = 0;
+        while (true) {
+            string::size_type end = offer.find(';', start);
+            parameters.push_back(trim(offer.substr(start, end == string::npos ? string::npos : end - start)));
+            if (end == string::npos)
+                break;
+            start = end + 1;
+        }
+
+        if (parameters[0] != "permessage-deflate")
+            return false;
+
+        bool seenServerTakeover = false;
+        bool seenClientTakeover = false;
+        bool seenServerBits = false;
+        bool seenClientBits = false;
+        for (size_t i = 1; i < parameters.size(); ++i) {
+            string name = parameters[i];
+            string value;
+            string::size_type eq = name.find('=');
+            if (eq != string::npos) {
+                value = trim(name.substr(eq + 1));
+                name = trim(name.substr(0, eq));
+                if (value.length() >= 2 && value[0] == '"' && value[value.length() - 1] == '"')
+                    value = value.substr(1, value.length() - 2);
+            }
+
+            if (name == "server_no_context_takeover" && !seenServerTakeover && eq == string::npos) {
+                seenServerTakeover = true;
+            } else if (name == "client_no_context_takeover" && !seenClientTakeover && eq == string::npos) {
+                seenClientTakeover = true;
+            } else if (name == "server_max_window_bits" && !seenServerBits && value == "15") {
+                seenServerBits = true;
+            } else if (name == "client_max_window_bits" && !seenClientBits) {
+                if (eq != string::npos) {
+                    int bits = atoi(value.c_str());
+                    if (bits < 8 || bits > 15 || value.find_first_not_of("0123456789") != string::npos)
+                        return false;
+                }
+                seenClientBits = true;
+            } else {
+                return false;
+            }
+        }
+        serverBits = seenServerBits;
+        return true;
+    }
+
+    bool Deflate::negotiate(const string& offers, string& response) {
+        if (!enabled_)
+            return false;
+
+        string::size_type start = 0;
+        while (start <= offers.length()) {
+            string::size_type end = offers.find(',', start);
+            string offer = trim(offers.substr(start, end == string::npos ? string::npos : end - start));
+            bool serverBits = false;
+            if (!offer.empty() && acceptOffer(offer, serverBits)) {
+                response = "permessage-deflate; server_no_context_takeover";
+                if (serverBits)
+                    response += "; server_max_window_bits=15";
+                return true;
+            }
+            if (end == string::npos)
+                break;
+            start = end + 1;
+        }
+        return false;
+    }
+
+    bool Deflate::compress(const uint8_t* input, size_t length, string& output) {
+        static thread_local z_stream* stream = 0;
+        if (!stream) {
+            stream = new z_stream;
+            memset(stream, 0, sizeof (z_stream));
+            if (deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -deflateWindowBits, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK) {
+                LOG(WARNING) << "Failed to initialize the websocket deflate stream.";
+                delete stream;
+                stream = 0;
+                return false;
+            }
+        } else {
+            deflateReset(stream);
+        }
+
+        output.resize(deflateBound(stream, length) + deflateMinimumSpace);
+        stream->next_in = const_cast<Bytef*> (input);
+        stream->avail_in = length;
+        size_t written = 0;
+        while (true) {
+            stream->next_out = reinterpret_cast<Bytef*> (&output[written]);
+            stream->avail_out = output.length() - written;
+            int ret = deflate(stream, Z_SYNC_FLUSH);
+            written = output.length() - stream->avail_out;
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                LOG(WARNING) << "Websocket deflate failed with error: " << ret;
+                return false;
+            }
+            if (stream->avail_in == 0 && stream->avail_out != 0)
+                break;
+            output.resize(output.length() * 2);
+        }
+
+        if (written < sizeof (deflateTail) ||
+            memcmp(&output[written - sizeof (deflateTail)], deflateTail, sizeof (deflateTail)) != 0) {
+            LOG(WARNING) << "Websocket deflate did not end with a sync flush.";
+            return false;
+        }
+        output.resize(written - sizeof (deflateTail));
+        return true;
+    }
+
+    Inflater::Inflater() :
+    stream(new z_stream) {
+        memset(stream, 0, sizeof (z_stream));
+        if (inflateInit2(stream, -deflateWindowBits) != Z_OK) {
+            LOG(WARNING) << "Failed to initialize a websocket inflate stream.";
+            delete stream;
+            stream = 0;
+        }
+    }
+
+    Inflater::~Inflater() {
+        if (stream) {
+            inflateEnd(stream);
+            delete stream;
+        }
+    }
+
+    /*
+     * The input is expected to have room for, and already contain, the 00 00 FF FF tail that the sender removed.
+     */
+    bool Inflater::inflate(const char* input, size_t length, string& output, size_t limit) {
+        if (!stream)
+            return false;
+
+        output.resize(length * 4 < limit ? length * 4 + deflateMinimumSpace : limit + 1);
+        stream->next_in = reinterpret_cast<Bytef*> (const_cast<char*> (input));
+        stream->avail_in = length;
+        size_t written = 0;
+        while (true) {
+            stream->next_out = reinterpret_cast<Bytef*> (&output[written]);
+            stream->avail_out = output.length() - written;
+            int ret = ::inflate(stream, Z_SYNC_FLUSH);
+            written = output.length() - stream->avail_out;
+            if (written > limit)
+                return false;
+            if (ret == Z_STREAM_END) {
+                // The client finished its stream in this message. Whatever follows starts a new one.
+                inflateReset(stream);
+                break;
+            }
+            if (ret != Z_OK && ret != Z_BUF_ERROR)
+                return false;
+            if (stream->avail_in == 0 && stream->avail_out != 0)
+                break;
+            if (ret == Z_BUF_ERROR && stream->avail_out != 0)
+                return false;
+            size_t grow = output.length() * 2;
+            output.resize(grow > limit + 1 ? limit + 1 : grow);
+        }
+        output.resize(written);
+        return true;
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WEBSOCKET_DEFLATE_HPP
+#define WEBSOCKET_DEFLATE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+struct z_stream_s;
+
+namespace Websocket {
+
+    /**
+     * RFC 7692 permessage-deflate. The server always compresses with server_no_context_takeover so that a
+     * compressed broadcast frame is valid for every connection that negotiated the extension, and can be shared.
+     */
+    class Deflate {
+    public:
+        // Read once at startup. Frames shorter than threshold are always sent uncompressed.
+        static void configure(bool enabled, size_t threshold);
+
+        static bool enabled() {
+            return enabled_;
+        }
+
+        static size_t threshold() {
+            return threshold_;
+        }
+
+        // Picks the first acceptable offer from a Sec-WebSocket-Extensions header, writing the reply value to response.
+        static bool negotiate(const std::string& offers, std::string& response);
+
+        // Compresses a whole message with a fresh context. The trailing 00 00 FF FF is removed as the RFC requires.
+        static bool compress(const uint8_t* input, size_t length, std::string& output);
+    private:
+
+        Deflate() { }
+
+        ~Deflate() { }
+
+        static bool enabled_;
+        static size_t threshold_;
+    };
+
+    /**
+     * Per connection inflate state. Clients are allowed to keep their context between messages, so this has to
+     * live as long as the connection does.
+     */
+    class Inflater {
+    public:
+        Inflater();
+        ~Inflater();
+
+        // Inflates one complete message. Fails if the message is corrupt or would inflate past limit.
+        bool inflate(const char* input, size_t length, std::string& output, size_t limit);
+    private:
+        Inflater(const Inflater&) = delete;
+        Inflater& operator=(const Inflater&) = delete;
+
+        struct z_stream_s* stream;
+    };
+}
+
+#endif //WEBSOCKET_DEFLATE_HPP
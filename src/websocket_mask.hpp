@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WEBSOCKET_MASK_HPP
+#define WEBSOCKET_MASK_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Websocket {
+
+    /**
+     * XORs length bytes of in with the 4 byte websocket masking key and writes the result to out. in and out may be
+     * the same buffer. phase is the offset of in[0] within the masked payload, so a payload can be unmasked in pieces.
+     *
+     * Works 32 or 16 bytes at a time when AVX2 or SSE2 is available, then 8 bytes at a time, then bytewise for the
+     * tail. Every block size is a multiple of four, so the rotated mask stays in phase across all of them.
+     */
+    inline void unmask(const char* in, char* out, size_t length, const char* mask, size_t phase = 0) {
+        unsigned char rotated[4];
+        for (int i = 0; i < 4; ++i)
+            rotated[i] = static_cast<unsigned char> (mask[(phase + i) & 3]);
+        uint32_t mask32;
+        memcpy(&mask32, &rotated[0], sizeof(mask32));
+
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i mask256 = _mm256_set1_epi32(static_cast<int> (mask32));
+        for (; i + 32 <= length; i += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (in + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*> (out + i), _mm256_xor_si256(block, mask256));
+        }
+#elif defined(__SSE2__)
+        const __m128i mask128 = _mm_set1_epi32(static_cast<int> (mask32));
+        for (; i + 16 <= length; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*> (in + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*> (out + i), _mm_xor_si128(block, mask128));
+        }
+#endif
+        const uint64_t mask64 = (static_cast<uint64_t> (mask32) << 32) | mask32;
+        for (; i + 8 <= length; i += 8) {
+            uint64_t block;
+            memcpy(&block, in + i, sizeof(block));
+            block ^= mask64;
+            memcpy(out + i, &block, sizeof(block));
+        }
+        for (; i < length; ++i) {
+            out[i] = in[i] ^ rotated[i & 3];
+        }
+    }
+}
+
+#endif //WEBSOCKET_MASK_HPP
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmark for HTML escaping. Compares the ICU round trip UnicodeTools::escapeHTML used to make, converting to
+ * UTF-16, running findAndReplace once per character and converting back, against UnicodeTools::escapeHTML.
+ *
+ * Random inputs built from ASCII, escaped characters, multibyte characters and broken sequences are checked against
+ * ICU before anything is timed. Then each kind of message is timed at a few sizes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <unicode/unistr.h>
+
+#include "../src/unicode_tools.hpp"
+
+#define TOTAL_BYTES 0x10000000ULL
+
+static const size_t sizes[] = {16, 128, 1024, 4096};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static std::string escapeICU(const std::string& input) {
+    icu::UnicodeString ustr(input.c_str());
+    ustr.findAndReplace("&", "&amp;");
+    ustr.findAndReplace("<", "&lt;");
+    ustr.findAndReplace(">", "&gt;");
+    std::string out;
+    return ustr.toUTF8String(out);
+}
+
+static std::string escapeNative(const std::string& input) {
+    std::string output;
+    if (!UnicodeTools::escapeHTML(input.data(), input.length(), output))
+        return input;
+    return output;
+}
+
+static const char* const pieces[] = {
+    "a", "Hello ", "&", "<", ">", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xff", "\xc0\x80", "\x80",
+    "\xed\xa0\x80", "\xe2\x82", "\xf4\x90\x80\x80", "\xf0\x9f", "\xe0\x80", "\xc2", "\x01", "\x7f",
+    "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+};
+
+struct Kind {
+    const char* name;
+    const char* unit;
+};
+
+// Each kind of message is its unit repeated to the wanted size.
+static const Kind kinds[] = {
+    {"ascii", "The quick brown fox jumps over the lazy dog. "},
+    {"markup", "[b]Hi[/b] <3 & see you > later. "},
+    {"utf-8", "Caf\xc3\xa9 \xe3\x81\x93\xe3\x82\x93\xe3\x81\xab\xe3\x81\xa1\xe3\x81\xaf \xf0\x9f\x98\x80 "},
+    {"invalid", "Broken \xff\xfe text \xe2\x82 here. "}
+};
+
+int main(int argc, char* argv[]) {
+    srand(time(NULL));
+    size_t pieceCount = sizeof(pieces) / sizeof(pieces[0]);
+    for (int t = 0; t < 100000; ++t) {
+        std::string input;
+        int count = rand() % 16;
+        for (int i = 0; i < count; ++i)
+            input += pieces[rand() % pieceCount];
+        if (rand() % 32 == 0)
+            input.insert(rand() % (input.length() + 1), 1, '\0');
+        if (escapeICU(input) != escapeNative(input)) {
+            printf("Mismatch on input of %zu bytes:", input.length());
+            for (size_t i = 0; i < input.length(); ++i)
+                printf(" %02x", static_cast<unsigned char> (input[i]));
+            printf("\n");
+            return 1;
+        }
+    }
+
+    printf("%10s %10s %14s %14s\n", "kind", "bytes", "icu ns", "escape ns");
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); ++k) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            std::string input;
+            while (input.length() < sizes[s])
+                input += kinds[k].unit;
+            input.resize(sizes[s]);
+            unsigned long long rounds = TOTAL_BYTES / sizes[s];
+
+            double start = now();
+            for (unsigned long long r = 0; r < rounds; ++r) {
+                std::string output = escapeICU(input);
+                __asm__ __volatile__("" : : "r"(output.data()) : "memory");
+            }
+            double icu = (now() - start) / rounds;
+
+            std::string output;
+            start = now();
+            for (unsigned long long r = 0; r < rounds; ++r) {
+                UnicodeTools::escapeHTML(input.data(), input.length(), output);
+                __asm__ __volatile__("" : : "r"(output.data()) : "memory");
+            }
+            double native = (now() - start) / rounds;
+
+            printf("%10s %10zu %14.0f %14.0f\n", kinds[k].name, sizes[s], icu, native);
+        }
+    }
+    return 0;
+}
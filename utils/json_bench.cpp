@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark for converting between JSON and Lua tables. Compares json_loads followed by a walk of the jansson tree,
+ * which is what LuaChat::jsonToLua did for every command, against LuaJSON::decode, and LuaChat::luaToJson followed by
+ * json_dumps, which is what every outgoing message took, against LuaJSON::encode.
+ *
+ * Recorded payloads can be given as files with one JSON document per line. Without any, a few typical command
+ * payloads and a login reply are used. Both decoders are checked to build the same table, and both encoders to write
+ * JSON that decodes to it, before anything is timed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <jansson.h>
+
+#include "../src/lua_json.hpp"
+
+#define TOTAL_BYTES 0x4000000ULL
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The jansson path, as LuaChat::jsonToLua and j2lParseItem implement it.
+static void janssonItem(lua_State* L, const char* key, json_t* json, int index = -1) {
+    lua_checkstack(L, 20);
+    switch (json_typeof(json)) {
+        case JSON_TRUE:
+            lua_pushboolean(L, 1);
+            break;
+        case JSON_FALSE:
+            lua_pushboolean(L, 0);
+            break;
+        case JSON_REAL:
+            lua_pushnumber(L, json_real_value(json));
+            break;
+        case JSON_INTEGER:
+            lua_pushinteger(L, json_integer_value(json));
+            break;
+        case JSON_STRING:
+            lua_pushstring(L, json_string_value(json));
+            break;
+        case JSON_ARRAY: {
+            lua_newtable(L);
+            size_t len = json_array_size(json);
+            for (size_t i = 0; i < len; ++i)
+                janssonItem(L, 0, json_array_get(json, i), i + 1);
+            if (index == -1) {
+                std::string newname = "array_";
+                newname += key;
+                lua_setfield(L, -2, newname.c_str());
+            } else {
+                lua_rawseti(L, -2, index);
+            }
+            return;
+        }
+        case JSON_OBJECT: {
+            lua_newtable(L);
+            const char* itemkey;
+            json_t* itemvalue;
+            json_object_foreach(json, itemkey, itemvalue) {
+                janssonItem(L, itemkey, itemvalue);
+            }
+            break;
+        }
+        default:
+            return;
+    }
+    if (index == -1)
+        lua_setfield(L, -2, key);
+    else
+        lua_rawseti(L, -2, index);
+}
+
+static bool janssonDecode(lua_State* L, const std::string& payload) {
+    json_t* root = json_loads(payload.c_str(), 0, 0);
+    if (!root)
+        return false;
+    lua_newtable(L);
+    const char* key;
+    json_t* value;
+    json_object_foreach(root, key, value) {
+        janssonItem(L, key, value);
+    }
+    json_decref(root);
+    return true;
+}
+
+// The jansson path, as LuaChat::luaToJson and l2jParseItem implement it.
+static json_t* janssonEncodeItem(lua_State* L, std::string& key) {
+    lua_checkstack(L, 20);
+    json_t* n = 0;
+    if (lua_type(L, -2) == LUA_TSTRING)
+        key = lua_tostring(L, -2);
+    switch (lua_type(L, -1)) {
+        case LUA_TBOOLEAN:
+            n = lua_toboolean(L, -1) ? json_true() : json_false();
+            break;
+        case LUA_TNUMBER:
+            n = json_real(lua_tonumber(L, -1));
+            break;
+        case LUA_TSTRING:
+            n = json_string(lua_tostring(L, -1));
+            if (!n)
+                n = json_string_nocheck("");
+            break;
+        case LUA_TTABLE: {
+            bool isArray = key.find("array_") == 0;
+            if (isArray) {
+                key = key.substr(6);
+                n = json_array();
+            } else {
+                n = json_object();
+            }
+            lua_pushnil(L);
+            while (lua_next(L, -2)) {
+                std::string itemkey;
+                json_t* item = janssonEncodeItem(L, itemkey);
+                if (isArray)
+                    json_array_append_new(n, item);
+                else
+                    json_object_set_new(n, itemkey.c_str(), item);
+            }
+            break;
+        }
+        default:
+            n = json_null();
+            break;
+    }
+    lua_pop(L, 1);
+    return n;
+}
+
+static void janssonEncode(lua_State* L, std::string& output) {
+    json_t* root = json_object();
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        std::string key;
+        json_t* item = janssonEncodeItem(L, key);
+        json_object_set_new(root, key.c_str(), item);
+    }
+    char* dumped = json_dumps(root, JSON_COMPACT);
+    output.assign(dumped);
+    free(dumped);
+    json_decref(root);
+}
+
+static bool sameValue(lua_State* L, int a, int b);
+
+// Every key of table a has the same value in table b.
+static bool containedIn(lua_State* L, int a, int b) {
+    lua_pushnil(L);
+    while (lua_next(L, a)) {
+        lua_pushvalue(L, -2);
+        lua_rawget(L, b);
+        bool same = sameValue(L, lua_gettop(L) - 1, lua_gettop(L));
+        lua_pop(L, 2);
+        if (!same) {
+            lua_pop(L, 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool sameValue(lua_State* L, int a, int b) {
+    if (lua_type(L, a) != lua_type(L, b))
+        return false;
+    if (lua_type(L, a) == LUA_TTABLE)
+        return containedIn(L, a, b) && containedIn(L, b, a);
+    return lua_equal(L, a, b);
+}
+
+static void addDefaults(std::vector<std::string>& payloads) {
+    payloads.push_back("{\"channel\":\"ADH-0123456789abcdef\",\"message\":\"Hello there, how is everyone doing tonight?\"}");
+    payloads.push_back("{\"recipient\":\"Some Character\",\"message\":\"[b]Hi![/b] Did you see the \\\"new\\\" profile? \\u2764\"}");
+    payloads.push_back("{\"character\":\"Some Character\",\"status\":\"looking\",\"statusmsg\":\"Around for a while.\"}");
+    payloads.push_back("{\"kinks\":[1,2,3,523,71,99,1024],\"genders\":[\"Female\",\"Male\"],\"roles\":[\"Always submissive\"]}");
+
+    // A login reply with a long friends list, like the ones ident_callback gets.
+    std::string login = "{\"error\":\"\",\"account_id\":123456,\"default_character\":\"Some Character\",\"characters\":[";
+    for (int i = 0; i < 30; ++i)
+        login += (i ? ",\"Character " : "\"Character ") + std::to_string(i) + "\"";
+    login += "],\"friends\":[";
+    for (int i = 0; i < 300; ++i)
+        login += std::string(i ? "," : "") + "{\"source_name\":\"Character " + std::to_string(i % 30) +
+            "\",\"dest_name\":\"Friend " + std::to_string(i) + "\"}";
+    login += "],\"bookmarks\":[";
+    for (int i = 0; i < 200; ++i)
+        login += std::string(i ? "," : "") + "{\"name\":\"Bookmark " + std::to_string(i) + "\"}";
+    login += "]}";
+    payloads.push_back(login);
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> payloads;
+    for (int i = 1; i < argc; ++i) {
+        FILE* file = fopen(argv[i], "r");
+        if (!file) {
+            printf("Could not open %s.\n", argv[i]);
+            return 1;
+        }
+        char* line = 0;
+        size_t capacity = 0;
+        ssize_t length;
+        while ((length = getline(&line, &capacity, file)) > 0) {
+            while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+                --length;
+            if (length)
+                payloads.push_back(std::string(line, length));
+        }
+        free(line);
+        fclose(file);
+    }
+    if (payloads.empty())
+        addDefaults(payloads);
+
+    lua_State* L = luaL_newstate();
+    for (size_t p = 0; p < payloads.size(); ++p) {
+        bool jansson = janssonDecode(L, payloads[p]);
+        bool decoded = LuaJSON::decode(L, payloads[p].data(), payloads[p].length());
+        if (jansson != decoded || (jansson && !sameValue(L, -2, -1))) {
+            printf("Mismatch on payload %zu: %.80s\n", p, payloads[p].c_str());
+            return 1;
+        }
+        lua_settop(L, 0);
+
+        // Key order may differ between the two, so the results are compared by decoding them again.
+        if (!decoded)
+            continue;
+        LuaJSON::decode(L, payloads[p].data(), payloads[p].length());
+        std::string janssonJSON, encodedJSON;
+        janssonEncode(L, janssonJSON);
+        LuaJSON::encode(L, 1, encodedJSON);
+        if (!LuaJSON::decode(L, janssonJSON.data(), janssonJSON.length()) ||
+            !LuaJSON::decode(L, encodedJSON.data(), encodedJSON.length()) || !sameValue(L, 1, 2) ||
+            !sameValue(L, 1, 3)) {
+            printf("Encoder mismatch on payload %zu: %.80s\n", p, payloads[p].c_str());
+            return 1;
+        }
+        lua_settop(L, 0);
+    }
+
+    printf("%10s %14s %14s %14s %14s\n", "bytes", "jansson ns", "decode ns", "jansson ns", "encode ns");
+    for (size_t p = 0; p < payloads.size(); ++p) {
+        const std::string& payload = payloads[p];
+        unsigned long long rounds = TOTAL_BYTES / payload.length() + 1;
+
+        double start = now();
+        for (unsigned long long r = 0; r < rounds; ++r) {
+            janssonDecode(L, payload);
+            lua_settop(L, 0);
+        }
+        double jansson = (now() - start) / rounds;
+
+        start = now();
+        for (unsigned long long r = 0; r < rounds; ++r) {
+            LuaJSON::decode(L, payload.data(), payload.length());
+            lua_settop(L, 0);
+        }
+        double decoded = (now() - start) / rounds;
+
+        LuaJSON::decode(L, payload.data(), payload.length());
+        std::string output;
+        start = now();
+        for (unsigned long long r = 0; r < rounds; ++r)
+            janssonEncode(L, output);
+        double janssonEncoded = (now() - start) / rounds;
+
+        start = now();
+        for (unsigned long long r = 0; r < rounds; ++r) {
+            output.clear();
+            LuaJSON::encode(L, 1, output);
+        }
+        double encoded = (now() - start) / rounds;
+        lua_settop(L, 0);
+
+        printf("%10zu %14.0f %14.0f %14.0f %14.0f\n", payload.length(), jansson, decoded, janssonEncoded, encoded);
+    }
+
+    lua_close(L);
+    return 0;
+}
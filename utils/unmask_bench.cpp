@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2011-2013, "Kira"
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmark for websocket payload unmasking. Compares the original bytewise loop against
+ * Websocket::unmask at a few payload sizes and prints the throughput of each in bytes per nanosecond.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../src/websocket_mask.hpp"
+
+#define TOTAL_BYTES 0x40000000ULL
+
+static const size_t sizes[] = {16, 128, 1024, 4096, 51200};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void unmask_bytewise(const char* in, char* out, size_t length, const char* mask) {
+    for (unsigned int i = 0; i < length; ++i) {
+        out[i] = in[i] ^ mask[i % 4];
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    size_t largest = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    char* input = new char[largest + 1];
+    char* expected = new char[largest + 1];
+    char* output = new char[largest + 1];
+    srand(time(NULL));
+    for (size_t i = 0; i < largest + 1; ++i)
+        input[i] = rand();
+
+    // Check every length and mask phase against the reference before timing anything.
+    for (size_t length = 0; length < 300; ++length) {
+        for (size_t phase = 0; phase < 4; ++phase) {
+            const char rotated[4] = {mask[phase & 3], mask[(phase + 1) & 3], mask[(phase + 2) & 3],
+                                     mask[(phase + 3) & 3]};
+            unmask_bytewise(input + 1, expected, length, &rotated[0]);
+            Websocket::unmask(input + 1, output, length, &mask[0], phase);
+            if (memcmp(expected, output, length) != 0) {
+                printf("Mismatch at length %zu phase %zu.\n", length, phase);
+                return 1;
+            }
+        }
+    }
+
+    printf("%10s %14s %14s\n", "bytes", "bytewise b/ns", "unmask b/ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        size_t length = sizes[s];
+        unsigned long long rounds = TOTAL_BYTES / length;
+
+        double start = now();
+        for (unsigned long long r = 0; r < rounds; ++r) {
+            unmask_bytewise(input, output, length, &mask[0]);
+            __asm__ __volatile__("" : : "r"(output) : "memory");
+        }
+        double bytewise = (double) (rounds * length) / (now() - start);
+
+        start = now();
+        for (unsigned long long r = 0; r < rounds; ++r) {
+            Websocket::unmask(input, output, length, &mask[0]);
+            __asm__ __volatile__("" : : "r"(output) : "memory");
+        }
+        double vectored = (double) (rounds * length) / (now() - start);
+
+        printf("%10zu %14.2f %14.2f\n", length, bytewise, vectored);
+    }
+
+    delete[] input;
+    delete[] expected;
+    delete[] output;
+    return 0;
+}